@@ -23,6 +23,44 @@
 //* Magic number set by the host for DDR reset */
 #define DDR_MAGIC           0xbabe7175          // Magic number used to reset the DDR counter 
 
+//* Options of a command, must be kept in sync with StepperCommand.h */
+#define STEPPER_COMMAND_REPEAT_MASK     0x7F    // Number of times the command is executed again after its first execution
+#define STEPPER_COMMAND_TRAPEZOID_BIT   7       // The command is the header of a SteppersTrapezoid
+
+//* Copy of the current trapezoid descriptor and its state in the PRU0 local RAM */
+#define TRAPEZOID_BASE                  0x40
+#define TRAPEZOID_STEPS                 0x44
+#define TRAPEZOID_DELTA_X               0x48
+#define TRAPEZOID_DELTA_Y               0x4C
+#define TRAPEZOID_DELTA_Z               0x50
+#define TRAPEZOID_DELTA_E               0x54
+#define TRAPEZOID_DELTA_H               0x58
+#define TRAPEZOID_ACCEL_STEPS           0x5C    // Followed by the decel steps
+#define TRAPEZOID_V_START               0x64    // Followed by vMax and vEnd
+#define TRAPEZOID_V_END                 0x6C
+#define TRAPEZOID_F_ACCELERATION        0x70
+#define TRAPEZOID_FULL_INTERVAL         0x74
+#define TRAPEZOID_ERROR_X               0x78    // Bresenham errors of X, Y, Z, E and H
+#define TRAPEZOID_ERROR_Y               0x7C
+#define TRAPEZOID_ERROR_Z               0x80
+#define TRAPEZOID_ERROR_E               0x84
+#define TRAPEZOID_ERROR_H               0x88
+#define TRAPEZOID_STEP_NUMBER           0x8C    // Followed by the acceleration timer, the deceleration timer and the maximum speed reached
+
+//* Cycles spent computing a step of a trapezoid, removed from the delay of the step. Counted in the pasm listing, one 
+//* cycle per instruction, from the end of the delay of the previous step to REPEAT_COMMAND, minus the 7 instructions a 
+//* plain command takes over the same span:
+//*   ramp step:   5 (TRAPEZOID_NEXT_STEP) + 56 (Bresenham and phase test) + 730 (acceleration or deceleration, MULTIPLY 
+//*                259 and DIVIDE 454 included) + 5 (TRAPEZOID_STEP_READY) - 7 = 789
+//*   cruise step: 5 + 56 + 5 (TRAPEZOID_CRUISE) + 5 - 7 = 64
+//* Both paths are constant time: MULTIPLY and DIVIDE always run 32 iterations without branch and the acceleration is 
+//* padded to the deceleration. The first step also takes the 19 instructions of TRAPEZOID_START plus 2 of NEXT_COMMAND 
+//* and the step after the last one 4 more than after a plain command, 25 per trapezoid (TRAPEZOID_START_CYCLES on the 
+//* host side). As everywhere in this firmware, the extra latency of the DDR loads is not counted.
+//* Must be kept in sync with PRU_TRAPEZOID_RAMP_CYCLES, PRU_TRAPEZOID_CRUISE_CYCLES and PRU_TRAPEZOID_START_CYCLES.
+#define TRAPEZOID_RAMP_CYCLES           789
+#define TRAPEZOID_CRUISE_CYCLES         64
+
 #ifdef HAS_CONFIG_H
 #include "config.h"
 #endif
@@ -60,26 +98,67 @@
     .u8     step                //Steppers are defined as 0b000HEZYX - A 1 for a stepper means we will do a step for this stepper
     .u8     direction           //Steppers are defined as 0b000HEZYX - Direction for each stepper
     .u8     cancellableMask     //If the endstop match the mask, all the move commands are canceled. 
-    .u8     options              //Options for the move, not yet used.
+    .u8     options              //Options for the move, bits 0-6 are the number of repetitions of the command
     .u32    delay               //number of cycle to wait (this is the # of PRU click cycles)
 .ends
 
+//Move level command, the steps are computed by the PRU. Same layout as SteppersTrapezoid in StepperCommand.h
+.struct SteppersTrapezoid
+    .u8     step                //Steppers moving during the move, defined as 0b000HEZYX
+    .u8     direction           //Steppers are defined as 0b000HEZYX - Direction for each stepper
+    .u8     cancellableMask     //If the endstop match the mask, all the move commands are canceled. 
+    .u8     options             //STEPPER_COMMAND_TRAPEZOID_BIT is set
+    .u32    steps               //Number of steps of the primary axis
+    .u32    deltaX              //Steps to do for each stepper
+    .u32    deltaY
+    .u32    deltaZ
+    .u32    deltaE
+    .u32    deltaH
+    .u32    accelSteps          //Number of steps of the acceleration phase
+    .u32    decelSteps          //Number of steps of the deceleration phase
+    .u32    vStart              //Starting speed in steps/s
+    .u32    vMax                //Maximum speed in steps/s
+    .u32    vEnd                //End speed in steps/s
+    .u32    fAcceleration       //Acceleration of the primary axis*262144/F_CPU
+    .u32    fullInterval        //Delay between two steps at full speed in PRU cycles
+.ends
+
+//Bresenham algorithm for one stepper of a trapezoid. r2.b0 is the step mask being built and r18 the number of steps of the primary axis.
+//Branch free so that every step takes the same time.
+.macro BRESENHAM_AXIS
+.mparam bit, errorOffset, deltaOffset
+    LBCO r12, C24, errorOffset, 4                           // Current error of the stepper
+    LBCO r13, C24, deltaOffset, 4                           // Delta of the stepper
+    SUB  r12, r12, r13                                      // error -= delta
+    LSR  r13, r12, 31                                       // r13 = 1 if the error is negative
+    LSL  r14, r13, bit
+    OR   r2.b0, r2.b0, r14                                  // The stepper steps if the error is negative
+    RSB  r13, r13, 0                                        // r13 = 0xFFFFFFFF if the error is negative
+    AND  r13, r13, r18
+    ADD  r12, r12, r13                                      // error += steps if the error is negative
+    SBCO r12, C24, errorOffset, 4
+.endm
+
 
 // Global register used:
 //
 // r1 : Remaining number of commands to process since we started to read DRAM
+// r2, r3: Current command
 // r4 : Current command reading address in DRAM
 // r5 : Event counter
 // r6 : Address in DRAM where to put the events counter
 // r7 :  
 // r11: Adress for reading/writing GPIO0 OUT pins
-// r12: GPIO0_IN
-// r13: GPIO2_IN
-// r14: GPIO_3_IN
+// r12-r14, r18-r26, r28, r29: Temporary registers for computing the steps of a trapezoid, r13.w0 holds the return address
+//                             of MULTIPLY and DIVIDE
+// r12: GPIO0_IN, only valid during INIT
+// r13: GPIO2_IN, only valid during INIT
+// r14: GPIO_3_IN, only valid during INIT
 // r15: Inverted mask for GPIO0 togglable pin
 // r16: Inverted mask for GPIO1 togglable pin
 // r17: Adress for reading/writing GPIO1 OUT pins
-// r20: GPIO1_IN
+// r20: GPIO1_IN, only valid during INIT: the trapezoids overwrite r12-r14 and r20, the GPIO_x_IN registers must not be
+//      used after INIT
 
 
 INIT:
@@ -159,6 +238,9 @@ NEXT_COMMAND:
     LBBO r2, r4, 0, 8                                       // Load pin command into r2 and r3, which is 8 bytes
     .assign SteppersCommand, r2,r3, pinCommand              // Assign the struct spanning onto r2 and r3
 
+    QBBS TRAPEZOID_START, pinCommand.options, STEPPER_COMMAND_TRAPEZOID_BIT
+
+REPEAT_COMMAND:                                             // A repeated command starts again from here with r2 and r3 already loaded
     //Translate the commands into pins
     //First load the direction pins
 
@@ -243,6 +325,7 @@ NEXT_COMMAND:
     //Cancel the move and all the other moves
 
     //Remove all the command from the buffer
+    QBBS start_loop_remove_trapezoid, pinCommand.options, STEPPER_COMMAND_TRAPEZOID_BIT
 start_loop_remove:
     ADD  r4, r4, SIZE(SteppersCommand)
     SUB r1, r1, 1                                           // r1 contains the number of PIN instructions in the DDR, we remove one.
@@ -250,40 +333,47 @@ start_loop_remove:
 
     QBA CANCEL_COMMAND_AFTER
 
+start_loop_remove_trapezoid:                                // A block of trapezoids only contains trapezoids
+    ADD  r4, r4, SIZE(SteppersTrapezoid)
+    SUB r1, r1, 1
+    QBNE start_loop_remove_trapezoid, r1, 0
+
+    QBA CANCEL_COMMAND_AFTER
+
 notcancel:
     AND r7, r7, 0x000000FF
     SBCO r7, C28, 8, 4
-    AND pinCommand.step, pinCommand.step, r7.b0               // Mask the step pins with the end stop mask
+    AND r21.b0, pinCommand.step, r7.b0                      // Mask the step pins with the end stop mask, the command is kept as is for its repetitions
  
     //Build the step pins GPIOs values 
     MOV r7, 0 
     MOV r8, 0 
  
     //Stepper X 
-    AND  r9,  pinCommand.step, 0x01 
+    AND  r9,  r21.b0, 0x01 
     LSL  r9, r9, STEPPER_X_STEP_PIN 
     OR  STEPPER_X_STEP_BANK, STEPPER_X_STEP_BANK, r9        // Put a 1 into the GPIO value if we need to step this stepper
  
     //Stepper Y 
-    LSR  r9, pinCommand.step, 0x01 
+    LSR  r9, r21.b0, 0x01 
     AND  r9, r9, 0x01 
     LSL  r9, r9, STEPPER_Y_STEP_PIN     
     OR  STEPPER_Y_STEP_BANK, STEPPER_Y_STEP_BANK, r9        // Put a 1 into the GPIO value if we need to step this stepper
  
     //Stepper Z 
-    LSR  r9, pinCommand.step, 0x02 
+    LSR  r9, r21.b0, 0x02 
     AND  r9, r9, 0x01 
     LSL  r9, r9, STEPPER_Z_STEP_PIN     
     OR  STEPPER_Z_STEP_BANK, STEPPER_Z_STEP_BANK, r9        // Put a 1 into the GPIO value if we need to step this stepper
  
     //Stepper E 
-    LSR  r9, pinCommand.step, 0x03 
+    LSR  r9, r21.b0, 0x03 
     AND  r9, r9, 0x01 
     LSL  r9, r9, STEPPER_E_STEP_PIN     
     OR  STEPPER_E_STEP_BANK, STEPPER_E_STEP_BANK, r9        // Put a 1 into the GPIO value if we need to step this stepper
  
     //Stepper H 
-    LSR  r9, pinCommand.step, 0x04 
+    LSR  r9, r21.b0, 0x04 
     AND  r9, r9, 0x01 
     LSL  r9, r9, STEPPER_H_STEP_PIN     
     OR  STEPPER_H_STEP_BANK, STEPPER_H_STEP_BANK, r9        // Put a 1 into the GPIO value if we need to step this stepper
@@ -366,12 +456,22 @@ DELAY:
     QBNE DELAY, r0, 0
 
 
-    SUB r1, r1, 1                                           //r1 contains the number of stepper instructions in the DDR, we remove one.
-    
 SUSPENDED:
     LBBO r0, r27, 0, 4                                      //Check if we are suspended or not
     QBNE SUSPENDED, r0, 0
 
+    QBBS TRAPEZOID_NEXT_STEP, r2.b3, STEPPER_COMMAND_TRAPEZOID_BIT  // The step was computed from a trapezoid
+
+    //Execute the same command again if it has still some repetitions to do
+    AND r0, r2.b3, STEPPER_COMMAND_REPEAT_MASK              // r2.b3 is the options of the current command
+    QBEQ COMMAND_DONE, r0, 0
+    SUB r2.b3, r2.b3, 1                                     // One repetition less to do
+    SUB r4, r4, SIZE(SteppersCommand)                       // The reading address has already been incremented for this command
+    LBBO r9, r4, 0, 8                                       // Unused load of the command so that a repetition takes as long as a new command
+    QBA REPEAT_COMMAND
+
+COMMAND_DONE:
+    SUB r1, r1, 1                                           //r1 contains the number of stepper instructions in the DDR, we remove one.
     QBNE NEXT_COMMAND, r1, 0                                // Still more commands to go, jump back           
             
 CANCEL_COMMAND_AFTER:           
@@ -393,3 +493,150 @@ WAIT2:
     QBNE PINS, r1, 0                                        // Start to process the commands stored in DDR if we have a value != of 0 stored in the current location of the DDR
     QBA WAIT2                                                // Loop back to wait for new data
 
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//Trapezoid descriptors
+//The descriptor is copied into the PRU0 local RAM and each of its steps is turned into a command in r2 and r3 that is 
+//executed by the step code above, like any other command. The computation is the same as expandSteppersTrapezoid()
+//on the host side, including the 32 bits arithmetic.
+
+TRAPEZOID_START:
+    //Copy the descriptor into the local RAM
+    LBBO r7, r4, 0, 16
+    SBCO r7, C24, TRAPEZOID_BASE, 16
+    LBBO r7, r4, 16, 16
+    SBCO r7, C24, TRAPEZOID_BASE+16, 16
+    LBBO r7, r4, 32, 16
+    SBCO r7, C24, TRAPEZOID_BASE+32, 16
+    LBBO r7, r4, 48, 8
+    SBCO r7, C24, TRAPEZOID_BASE+48, 8
+
+    //Initialize the state of the move
+    LBCO r18, C24, TRAPEZOID_STEPS, 4
+    LSR  r18, r18, 1                                        // The Bresenham errors start at half the steps of the primary axis
+    MOV  r19, r18
+    MOV  r20, r18
+    MOV  r21, r18
+    MOV  r22, r18
+    MOV  r23, 0                                             // Step number
+    MOV  r24, 0                                             // Acceleration timer
+    MOV  r25, 0                                             // Deceleration timer
+    LBCO r26, C24, TRAPEZOID_V_START, 4                     // Maximum speed reached
+    SBCO r18, C24, TRAPEZOID_ERROR_X, 36
+
+TRAPEZOID_STEP:
+    LBCO r2, C24, TRAPEZOID_BASE, 4                         // Direction, cancellable mask and options of the trapezoid
+    MOV  r2.b0, 0                                           // No stepper steps yet
+    LBCO r18, C24, TRAPEZOID_STEPS, 4
+
+    BRESENHAM_AXIS 0, TRAPEZOID_ERROR_X, TRAPEZOID_DELTA_X
+    BRESENHAM_AXIS 1, TRAPEZOID_ERROR_Y, TRAPEZOID_DELTA_Y
+    BRESENHAM_AXIS 2, TRAPEZOID_ERROR_Z, TRAPEZOID_DELTA_Z
+    BRESENHAM_AXIS 3, TRAPEZOID_ERROR_E, TRAPEZOID_DELTA_E
+    BRESENHAM_AXIS 4, TRAPEZOID_ERROR_H, TRAPEZOID_DELTA_H
+
+    LBCO r19, C24, TRAPEZOID_STEP_NUMBER, 16                // r19 = step number, r20 = acceleration timer, r21 = deceleration timer, r22 = maximum speed reached
+    LBCO r23, C24, TRAPEZOID_ACCEL_STEPS, 8                 // r23 = acceleration steps, r24 = deceleration steps
+    QBLT TRAPEZOID_NOT_ACCELERATING, r19, r23               // Jump if accelSteps < stepNumber
+
+    //Accelerating: v = (((timer_accel>>8)*fAcceleration)>>10)+vStart, limited to vMax
+    LSR  r28, r20, 8
+    LBCO r29, C24, TRAPEZOID_F_ACCELERATION, 4
+    JAL  r13.w0, MULTIPLY
+    LSR  r26, r26, 10
+    LBCO r28, C24, TRAPEZOID_V_START, 8                     // r28 = vStart, r29 = vMax
+    ADD  r22, r26, r28
+    MIN  r22, r22, r29
+    MOV  r29, r22
+    JAL  r13.w0, DIVIDE                                     // interval = F_CPU/v
+    ADD  r20, r20, r26                                      // timer_accel += interval
+    MOV  r25, r25                                           // Padding so that the acceleration takes as long as the deceleration
+    MOV  r25, r25
+    MOV  r25, r25
+    MOV  r25, r25
+    MOV  r25, r25
+    MOV  r0, TRAPEZOID_RAMP_CYCLES
+    QBA  TRAPEZOID_STEP_READY
+
+TRAPEZOID_NOT_ACCELERATING:
+    LBCO r18, C24, TRAPEZOID_STEPS, 4
+    SUB  r25, r18, r19                                      // Remaining steps
+    QBLT TRAPEZOID_CRUISE, r25, r24                         // Jump if decelSteps < remaining steps
+
+    //Decelerating: v = vMaxReached-(((timer_decel>>8)*fAcceleration)>>10), not lower than vEnd
+    LSR  r28, r21, 8
+    LBCO r29, C24, TRAPEZOID_F_ACCELERATION, 4
+    JAL  r13.w0, MULTIPLY
+    LSR  r26, r26, 10
+    LBCO r29, C24, TRAPEZOID_V_END, 4
+    SUB  r28, r22, r26                                      // Negative if the deceleration goes too far, both are below 2^31
+    LSR  r25, r28, 31
+    SUB  r25, r25, 1                                        // 0 if negative, 0xFFFFFFFF otherwise
+    AND  r28, r28, r25                                      // vEnd is then used, without branch
+    MAX  r29, r28, r29
+    JAL  r13.w0, DIVIDE                                     // interval = F_CPU/v
+    ADD  r21, r21, r26                                      // timer_decel += interval
+    MOV  r0, TRAPEZOID_RAMP_CYCLES
+    QBA  TRAPEZOID_STEP_READY
+
+TRAPEZOID_CRUISE:
+    LBCO r26, C24, TRAPEZOID_FULL_INTERVAL, 4
+    MOV  r0, TRAPEZOID_CRUISE_CYCLES
+
+TRAPEZOID_STEP_READY:
+    ADD  r19, r19, 1
+    SBCO r19, C24, TRAPEZOID_STEP_NUMBER, 16                // Save the step number, the timers and the maximum speed reached
+
+    //The time spent to compute the step is removed from the delay
+    MAX  r26, r26, r0
+    SUB  r3, r26, r0
+    QBA  REPEAT_COMMAND                                     // Execute the step
+
+TRAPEZOID_NEXT_STEP:
+    SUB  r4, r4, SIZE(SteppersCommand)                      // The reading address has been incremented by the step code
+    LBCO r18, C24, TRAPEZOID_STEPS, 4
+    LBCO r19, C24, TRAPEZOID_STEP_NUMBER, 4
+    QBNE TRAPEZOID_STEP, r19, r18                           // Still some steps to do
+
+    ADD  r4, r4, SIZE(SteppersTrapezoid)                    // The trapezoid is done
+    QBA  COMMAND_DONE
+
+//MULTIPLY and DIVIDE always run their 32 iterations without data dependent branch, so that every step of a ramp 
+//takes the same TRAPEZOID_RAMP_CYCLES
+
+MULTIPLY:                                                   // r26 = r28*r29 on 32 bits, uses r0 and r25, return address in r13.w0
+    MOV  r26, 0
+    MOV  r0, 32
+MULTIPLY_LOOP:
+    AND  r25, r29, 1
+    RSB  r25, r25, 0                                        // 0xFFFFFFFF if the lowest bit of r29 is set
+    AND  r25, r25, r28
+    ADD  r26, r26, r25
+    LSL  r28, r28, 1
+    LSR  r29, r29, 1
+    SUB  r0, r0, 1
+    QBNE MULTIPLY_LOOP, r0, 0
+    JMP  r13.w0
+
+DIVIDE:                                                     // r26 = PRU_SPEED/r29, uses r0, r14, r24, r25 and r28, return address in r13.w0
+    MOV  r28, PRU_SPEED                                     // The divisor and the remainder stay below 2^31, the speeds are below PRU_SPEED
+    MOV  r26, 0                                             // Quotient
+    MOV  r24, 0                                             // Remainder
+    MOV  r0, 32
+DIVIDE_LOOP:
+    LSL  r24, r24, 1
+    LSR  r25, r28, 31
+    OR   r24, r24, r25                                      // Next bit of the dividend into the remainder
+    LSL  r28, r28, 1
+    LSL  r26, r26, 1
+    SUB  r25, r24, r29
+    LSR  r25, r25, 31
+    SUB  r25, r25, 1                                        // 0xFFFFFFFF if remainder >= divisor, 0 otherwise
+    AND  r14, r29, r25
+    SUB  r24, r24, r14                                      // The divisor is subtracted only if it fits
+    AND  r14, r25, 1
+    OR   r26, r26, r14                                      // And the bit of the quotient set
+    SUB  r0, r0, 1
+    QBNE DIVIDE_LOOP, r0, 0
+    JMP  r13.w0
@@ -25,12 +25,15 @@ License: GNU GPL v3: http://www.gnu.org/copyleft/gpl.html
 """
 
 import logging
+import os
 from Path import Path, AbsolutePath, RelativePath, G92Path
+from Delta import Delta
 from Printer import Printer
 import numpy as np
 
 try:
-    from path_planner.PathPlannerNative import PathPlannerNative
+    from path_planner.PathPlannerNative import PathPlannerNative, \
+        MOVE_FLAG_CANCELABLE, MOVE_FLAG_OPTIMIZE
 except Exception, e:
     logging.error("You have to compile the native path planner before running"
                   " Redeem. Make sure you have swig installed (apt-get "
@@ -72,6 +75,11 @@ class PathPlanner:
             tuple([float(Path.max_speeds[i]) for i in range(3)]))	
         self.native_planner.setMaxJerk(self.printer.maxJerkXY / 1000.0, self.printer.maxJerkZ /1000.0)
 
+        # Kinematics used by queueMoveTo()
+        self.native_planner.setDeltaKinematics(Delta.L, Delta.r, Delta.Ae,
+                                               Delta.Be, Delta.Ce, Delta.Hez)
+        self.native_planner.setAxisConfig(Path.axis_config)
+
         #Setup the extruders
         for i in range(Path.NUM_AXES - 3):
             e = self.native_planner.getExtruder(i)
@@ -83,6 +91,20 @@ class PathPlanner:
 
         self.native_planner.setExtruder(0)
 
+        # Counters of the planner and of the PRU in the Prometheus text format
+        metrics_socket = self.printer.config.get('System', 'metrics_socket', "")
+        if metrics_socket and not self.native_planner.startMetricsServer(metrics_socket):
+            logging.warning("Unable to serve the metrics on " + metrics_socket)
+
+        # Levels of the native messages, unless REDEEM_LOG sets them
+        if "REDEEM_LOG" not in os.environ:
+            self.native_planner.setLogLevel("all", self.printer.config.getint('System', 'loglevel'))
+
+        if self.printer.config.getboolean('System', 'trace'):
+            self.native_planner.setTraceEnabled(True)
+
+        self.native_planner.setAdaptiveBuffering(self.printer.config.getboolean('System', 'adaptive_buffering'))
+
         self.native_planner.runThread()
 
     def get_current_pos(self):
@@ -115,6 +137,14 @@ class PathPlanner:
         self.native_planner.stopThread(True)
         self.__init_path_planner()
 
+    def set_trace_enabled(self, enabled):
+        """ Record the events of the native path planner threads """
+        self.native_planner.setTraceEnabled(enabled)
+
+    def dump_trace(self, path):
+        """ Write the last events recorded in the Chrome trace format """
+        return self.native_planner.dumpTrace(path)
+
     def suspend(self):
         self.native_planner.suspend()
 
@@ -191,6 +221,66 @@ class PathPlanner:
         self.prev.unlink()  # We don't want to store the entire print
         # in memory, so we keep only the last path.
 
+    def add_paths(self, paths):
+        """ Add several path segments to the path planner at once.
+        The moves are sent to the native planner in a single call, which
+        is much faster than add_path for many tiny segments. """
+        moves = []
+        for new in paths:
+            # Link to the previous segment in the chain
+            new.set_prev(self.prev)
+
+            if not new.is_G92():
+                moves.append(new)
+
+            self.prev = new
+            self.prev.unlink()
+
+        if not moves:
+            return
+
+        self.printer.ensure_steppers_enabled()
+
+        # Contiguous arrays, read in place by the native planner
+        deltas = np.array([new.delta[:4] for new in moves], dtype=np.float32)
+        steps = np.array([new.num_steps[:4] for new in moves],
+                         dtype=np.float32)
+        speeds = np.array([new.speed for new in moves], dtype=np.float32)
+        flags = np.array([(MOVE_FLAG_CANCELABLE if new.cancelable else 0) |
+                          (MOVE_FLAG_OPTIMIZE if new.movement != Path.RELATIVE
+                           else 0) for new in moves], dtype=np.uint8)
+
+        self.native_planner.queueMoves(deltas, steps, speeds, flags)
+
+    def add_arc(self, end, offset_i, offset_j, radius, clockwise, speed,
+                relative=False):
+        """ Add an arc in the XY plane, split into chords by the native
+        planner. end holds the end position of the axes that move, in meters.
+        The center is given by its offset from the start position, or by the
+        radius when radius is not None. """
+        start = self.get_current_pos()
+        target = []
+        for axis in Path.AXES[:4]:
+            value = end.get(axis, 0.0 if relative else start[axis])
+            target.append(float(start[axis] + value if relative else value))
+
+        self.printer.ensure_steppers_enabled()
+
+        self.native_planner.setPosition(
+            tuple([float(start[axis]) for axis in Path.AXES[:4]]))
+        if radius is None:
+            self.native_planner.queueArc(tuple(target), offset_i, offset_j,
+                                         clockwise, speed, False, True)
+        else:
+            self.native_planner.queueArcRadius(tuple(target), radius,
+                                               clockwise, speed, False, True)
+
+        # Continue from the position reached by the native planner
+        reached = {}
+        for index, axis in enumerate(Path.AXES[:4]):
+            reached[axis] = self.native_planner.getPosition(index)
+        self.add_path(G92Path(reached, speed))
+
     def set_extruder(self, ext_nr):
         if ext_nr in [0, 1]:
             if ext_nr == 0:
@@ -0,0 +1,73 @@
+"""
+GCode G2 and G3
+Controlled arc move, clockwise for G2 and counter-clockwise for G3
+
+The arc is in the XY plane. Its center is given by its offset I and J from
+the start position, or by its radius R. Z and E move along the arc for
+helical moves. The native path planner splits the arc into chords.
+
+License: CC BY-SA: http://creativecommons.org/licenses/by-sa/2.0/
+"""
+
+from GCodeCommand import GCodeCommand
+from Path import Path
+import logging
+
+
+class G2(GCodeCommand):
+
+    clockwise = True
+
+    def execute(self, g):
+        if g.has_letter("F"):  # Get the feed rate
+            # Convert from mm/min to SI unit m/s
+            self.printer.feed_rate = float(g.get_value_by_letter("F"))
+            self.printer.feed_rate /= 60000.0
+            g.remove_token_by_letter("F")
+
+        offset_i = offset_j = radius = None
+        if g.has_letter("R"):
+            radius = float(g.get_value_by_letter("R")) / 1000.0
+        elif g.has_letter("I") or g.has_letter("J"):
+            offset_i = offset_j = 0.0
+            if g.has_letter("I"):
+                offset_i = float(g.get_value_by_letter("I")) / 1000.0
+            if g.has_letter("J"):
+                offset_j = float(g.get_value_by_letter("J")) / 1000.0
+        else:
+            logging.error("arc without I, J or R: " + g.message)
+            return
+
+        end = {}
+        for i in range(g.num_tokens()):
+            axis = g.token_letter(i)
+            if axis not in Path.AXES:
+                continue  # I, J and R
+            value = float(g.token_value(i)) / 1000.0
+            if (axis == 'E' or axis == 'H') and self.printer.extrude_factor != 1.0:
+                value *= self.printer.extrude_factor
+            end[axis] = value
+
+        if self.printer.movement not in (Path.ABSOLUTE, Path.RELATIVE):
+            logging.error("invalid movement: " + str(self.printer.movement))
+            return
+
+        # Blocks until the path planner has capacity for all the chords
+        self.printer.path_planner.add_arc(
+            end, offset_i, offset_j, radius, self.clockwise,
+            self.printer.feed_rate * self.printer.factor,
+            self.printer.movement == Path.RELATIVE)
+
+    def get_description(self):
+        return "Clockwise arc move"
+
+    def is_buffered(self):
+        return True
+
+
+class G3(G2):
+
+    clockwise = False
+
+    def get_description(self):
+        return "Counter-clockwise arc move"
@@ -0,0 +1,29 @@
+"""
+GCode M279
+Trace of the path planner: S1 starts recording the events, S0 stops it.
+Without parameter, writes the events recorded to the trace_file of the
+configuration in the Chrome trace format (chrome://tracing or ui.perfetto.dev)
+
+License: CC BY-SA: http://creativecommons.org/licenses/by-sa/2.0/
+"""
+
+from GCodeCommand import GCodeCommand
+import logging
+
+
+class M279(GCodeCommand):
+
+    def execute(self, g):
+        if g.has_letter("S"):
+            enabled = int(g.get_value_by_letter("S")) != 0
+            self.printer.path_planner.set_trace_enabled(enabled)
+            logging.info("Path planner trace " + ("enabled" if enabled else "disabled"))
+        else:
+            path = self.printer.config.get('System', 'trace_file')
+            if self.printer.path_planner.dump_trace(path):
+                logging.info("Path planner trace written to " + path)
+            else:
+                logging.warning("Unable to write the path planner trace to " + path)
+
+    def get_description(self):
+        return "Record or write the trace of the path planner"
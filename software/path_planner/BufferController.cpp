@@ -0,0 +1,133 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#include "BufferController.h"
+
+#include <algorithm>
+#include <climits>
+#include <math.h>
+#include "Logger.h"
+#include "config.h"
+
+BufferController::BufferController() {
+	adaptive = false;
+	target = MIN_BUFFERED_MOVE_TIME/1000.0;
+	latencyPeak = 0;
+	gapPeak = 0;
+	targetTime = lastQueued = Clock::now();
+	lastStarvations = 0;
+}
+
+double BufferController::decay(Clock::time_point now, Clock::time_point since) {
+	double elapsed = std::chrono::duration_cast<std::chrono::duration<double> >(now - since).count();
+	
+	return exp2(-elapsed*1000/ADAPTIVE_BUFFER_HALF_LIFE);
+}
+
+double BufferController::fillWait(Clock::time_point now) {
+	double wait = ADAPTIVE_BUFFER_GAP_FACTOR*gapPeak*decay(now, lastQueued);
+	
+	return std::min(std::max(wait, ADAPTIVE_BUFFER_WAIT_MIN/1000.0), PRINT_MOVE_BUFFER_WAIT/1000.0);
+}
+
+void BufferController::setAdaptive(bool enabled) {
+	std::lock_guard<std::mutex> lk(mutex);
+	
+	adaptive = enabled;
+	target = MIN_BUFFERED_MOVE_TIME/1000.0;
+	latencyPeak = 0;
+	gapPeak = 0;
+	targetTime = lastQueued = Clock::now();
+}
+
+unsigned long BufferController::getTargetTime() {
+	std::lock_guard<std::mutex> lk(mutex);
+	
+	return target*F_CPU;
+}
+
+unsigned long BufferController::getFillTime() {
+	std::lock_guard<std::mutex> lk(mutex);
+	
+	return adaptive ? (unsigned long)(ADAPTIVE_BUFFER_FILL_FACTOR*target*F_CPU) : ULONG_MAX;
+}
+
+unsigned long BufferController::getFillWait() {
+	std::lock_guard<std::mutex> lk(mutex);
+	
+	return adaptive ? (unsigned long)(fillWait(Clock::now())*1000) : PRINT_MOVE_BUFFER_WAIT;
+}
+
+double BufferController::getLatency() {
+	std::lock_guard<std::mutex> lk(mutex);
+	
+	return latencyPeak*decay(Clock::now(), targetTime);
+}
+
+void BufferController::lineQueued() {
+	std::lock_guard<std::mutex> lk(mutex);
+	
+	if(!adaptive)
+		return;
+	
+	Clock::time_point now = Clock::now();
+	double gap = std::chrono::duration_cast<std::chrono::duration<double> >(now - lastQueued).count();
+	
+	if(gap*1000 < PRINT_MOVE_BUFFER_WAIT)
+		gapPeak = std::max(gap, gapPeak*decay(now, lastQueued));
+	
+	lastQueued = now;
+}
+
+void BufferController::refill(uint64_t latency, unsigned long remaining, uint64_t starvations) {
+	std::lock_guard<std::mutex> lk(mutex);
+	
+	bool starved = starvations != lastStarvations;
+	lastStarvations = starvations;
+	
+	if(!adaptive)
+		return;
+	
+	Clock::time_point now = Clock::now();
+	double minTarget = ADAPTIVE_BUFFERED_MOVE_TIME_MIN/1000.0;
+	double maxTarget = ADAPTIVE_BUFFERED_MOVE_TIME_MAX/1000.0;
+	double factor = decay(now, targetTime);
+	double previous = target;
+	
+	latencyPeak *= factor;
+	
+	if(latency)
+		latencyPeak = std::max(latencyPeak, latency/1e9);
+	
+	if(starved)
+		target *= 2;
+	else if(latency && remaining < target*F_CPU/4)
+		target *= 1.25;
+	else
+		target = minTarget + (target - minTarget)*factor;
+	
+	target = std::min(std::max(target, std::max(minTarget, ADAPTIVE_BUFFER_LATENCY_FACTOR*latencyPeak)), maxTarget);
+	targetTime = now;
+	
+	if(target > previous*1.5)
+		LOG_INFO(LOG_PLANNER, "Buffered move time raised to " << target*1000 << " ms, " << (starved ? "the PRU ran out of moves" : "low margin") << ", latency " << latencyPeak*1000 << " ms" << std::endl);
+}
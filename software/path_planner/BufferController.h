@@ -0,0 +1,101 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#ifndef __PathPlanner__BufferController__
+#define __PathPlanner__BufferController__
+
+#include <stdint.h>
+#include <chrono>
+#include <mutex>
+
+/* Adapts the buffering of the path planner to how the host behaves: the PRU time run() keeps queued and the startup 
+ * fill of the ring. Quiet hosts get short buffers so that the moves start and stop quickly, loaded hosts get longer 
+ * ones so that the PRU does not run out of moves. All the peaks decay with a half-life of ADAPTIVE_BUFFER_HALF_LIFE. 
+ * The measures start optimistic: MIN_BUFFERED_MOVE_TIME queued and ADAPTIVE_BUFFER_WAIT_MIN for the new lines. */
+class BufferController {
+private:
+	typedef std::chrono::steady_clock Clock;
+	
+	std::mutex mutex;
+	bool adaptive;
+	
+	double target;                ///< PRU time to keep queued, in s
+	double latencyPeak;           ///< Peak time between the PRU needing moves and run() pushing them, in s
+	double gapPeak;               ///< Peak time between two lines queued in a row, in s
+	Clock::time_point targetTime; ///< Last update of target and latencyPeak
+	Clock::time_point lastQueued; ///< Time of the last line queued, gapPeak is updated with it
+	uint64_t lastStarvations;
+	
+	static double decay(Clock::time_point now, Clock::time_point since);
+	double fillWait(Clock::time_point now);
+	
+public:
+	BufferController();
+	
+	/**
+	 * @brief Adapt the buffering to the host, or use the fixed MIN_BUFFERED_MOVE_TIME and PRINT_MOVE_BUFFER_WAIT
+	 * @details The measures start again from the fixed values when the adaptive buffering is enabled.
+	 */
+	void setAdaptive(bool enabled);
+	
+	/**
+	 * @brief Return the PRU time run() keeps queued before waiting, in PRU cycles
+	 */
+	unsigned long getTargetTime();
+	
+	/**
+	 * @brief Return the time of the moves to queue in the ring before printing, in PRU cycles
+	 * @details ULONG_MAX when the adaptive buffering is disabled, the ring is then filled by half.
+	 */
+	unsigned long getFillTime();
+	
+	/**
+	 * @brief Return how long run() waits for a new line before printing the ones it has, in ms
+	 */
+	unsigned long getFillWait();
+	
+	/**
+	 * @brief Return the peak wake-up latency of run() measured by refill(), in s
+	 */
+	double getLatency();
+	
+	/**
+	 * @brief Record a line queued by the path planner, the time since the previous one measures the producer
+	 * @details The gaps longer than PRINT_MOVE_BUFFER_WAIT are pauses between two jobs and are not measured.
+	 */
+	void lineQueued();
+	
+	/**
+	 * @brief Adapt the target to a refill of the PRU
+	 * @details The target doubles when the PRU ran out of moves since the last refill and grows by a quarter when less 
+	 * than a quarter of it remained. Otherwise it goes down towards ADAPTIVE_BUFFERED_MOVE_TIME_MIN, but never below 
+	 * ADAPTIVE_BUFFER_LATENCY_FACTOR times the peak latency.
+	 *
+	 * @param latency Time between the PRU thread signaling that it needs moves and run() running again in ns, 0 if 
+	 * run() did not have to wait for the PRU: the remaining time then says nothing about the host
+	 * @param remaining PRU time queued when run() pushes the next moves, in PRU cycles
+	 * @param starvations Times the PRU ran out of moves while moves were waiting, see PlannerMetrics
+	 */
+	void refill(uint64_t latency, unsigned long remaining, uint64_t starvations);
+};
+
+#endif /* defined(__PathPlanner__BufferController__) */
@@ -0,0 +1,128 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#include "CommandArena.h"
+
+CommandArena::CommandArena() {
+	chunks = new CommandChunk[COMMAND_ARENA_CHUNKS];
+	freeList = NULL;
+	
+	for(unsigned int i=0; i<COMMAND_ARENA_CHUNKS; i++) {
+		chunks[i].fromHeap = false;
+		chunks[i].next = freeList;
+		freeList = &chunks[i];
+	}
+	
+	chunksUsed = 0;
+	chunksReserved = 0;
+	highWater = 0;
+	heapAllocations = 0;
+}
+
+CommandArena::~CommandArena() {
+	delete[] chunks;
+}
+
+size_t CommandArena::chunksForSteps(unsigned int steps) {
+	//A line without steps still gets an empty chunk
+	return steps ? (steps + COMMAND_ARENA_CHUNK_COMMANDS - 1) / COMMAND_ARENA_CHUNK_COMMANDS : 1;
+}
+
+bool CommandArena::reserve(size_t count) {
+	std::lock_guard<std::mutex> lk(arenaMutex);
+	
+	if(COMMAND_ARENA_CHUNKS - chunksUsed < chunksReserved + count + COMMAND_ARENA_KEPT_CHUNKS)
+		return false;
+	
+	chunksReserved += count;
+	return true;
+}
+
+void CommandArena::cancelReservation(size_t count) {
+	std::lock_guard<std::mutex> lk(arenaMutex);
+	chunksReserved -= count;
+}
+
+CommandChunk* CommandArena::allocate(bool reserved) {
+	CommandChunk* chunk = NULL;
+	
+	{
+		std::lock_guard<std::mutex> lk(arenaMutex);
+		
+		if(reserved)
+			chunksReserved--;
+		
+		if(freeList) {
+			chunk = freeList;
+			freeList = chunk->next;
+			
+			chunksUsed++;
+			if(chunksUsed > highWater)
+				highWater = chunksUsed;
+		} else {
+			heapAllocations++;
+		}
+	}
+	
+	if(!chunk) {
+		chunk = new CommandChunk;
+		chunk->fromHeap = true;
+	}
+	
+	chunk->next = NULL;
+	chunk->count = 0;
+	chunk->steps = 0;
+	
+	return chunk;
+}
+
+void CommandArena::release(CommandChunk* chunk) {
+	while(chunk) {
+		CommandChunk* next = chunk->next;
+		
+		if(chunk->fromHeap) {
+			delete chunk;
+		} else {
+			std::lock_guard<std::mutex> lk(arenaMutex);
+			chunk->next = freeList;
+			freeList = chunk;
+			chunksUsed--;
+		}
+		
+		chunk = next;
+	}
+}
+
+size_t CommandArena::getChunksUsed() {
+	std::lock_guard<std::mutex> lk(arenaMutex);
+	return chunksUsed;
+}
+
+size_t CommandArena::getHighWater() {
+	std::lock_guard<std::mutex> lk(arenaMutex);
+	return highWater;
+}
+
+unsigned long CommandArena::getHeapAllocations() {
+	std::lock_guard<std::mutex> lk(arenaMutex);
+	return heapAllocations;
+}
@@ -0,0 +1,114 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#ifndef __PathPlanner__CommandArena__
+#define __PathPlanner__CommandArena__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+#include "StepperCommand.h"
+#include "config.h"
+
+/* Fixed size chunk of step commands, the commands of a line are stored in a list of chunks */
+typedef struct CommandChunk {
+	struct CommandChunk* next;
+	uint32_t count;                                 ///< Number of commands used in the chunk
+	uint32_t steps;                                 ///< Number of steps executed by these commands
+	bool fromHeap;                                  ///< Allocated outside of the arena because it was full
+	SteppersCommand commands[COMMAND_ARENA_CHUNK_COMMANDS];
+} CommandChunk;
+
+/**
+ * Pool of command chunks shared by all the lines of the path planner.
+ *
+ * All the chunks are allocated once at creation and kept in a free list, so that getting and releasing a chunk is O(1) 
+ * and does not touch the heap. If all the chunks are in use, a chunk is allocated on the heap instead, which shows up 
+ * in the statistics.
+ * 
+ * Chunks can be reserved in advance by the generation workers, the last COMMAND_ARENA_KEPT_CHUNKS chunks are kept for 
+ * the allocations done without reservation.
+ */
+class CommandArena {
+private:
+	CommandChunk* chunks;
+	CommandChunk* freeList;
+	std::mutex arenaMutex;
+	
+	size_t chunksUsed;
+	size_t chunksReserved;
+	size_t highWater;
+	unsigned long heapAllocations;
+	
+public:
+	CommandArena();
+	virtual ~CommandArena();
+	
+	/**
+	 * @brief Return the most chunks needed for the commands of a line
+	 * @param steps The number of steps of the line
+	 */
+	static size_t chunksForSteps(unsigned int steps);
+	
+	/**
+	 * @brief Reserve chunks to allocate them later
+	 * @param count The number of chunks
+	 * @return false if the free chunks, without the kept ones, cannot cover the reservation. Nothing is reserved then
+	 */
+	bool reserve(size_t count);
+	
+	/**
+	 * @brief Give back the reserved chunks that have not been allocated
+	 * @param count The number of chunks
+	 */
+	void cancelReservation(size_t count);
+	
+	/**
+	 * @brief Get an empty chunk
+	 * @param reserved true to take one of the chunks reserved before
+	 * @return The chunk, never NULL
+	 */
+	CommandChunk* allocate(bool reserved = false);
+	
+	/**
+	 * @brief Release a list of chunks
+	 * @param chunk The first chunk of the list, can be NULL
+	 */
+	void release(CommandChunk* chunk);
+	
+	/**
+	 * @brief Return the number of chunks of the arena currently used
+	 */
+	size_t getChunksUsed();
+	
+	/**
+	 * @brief Return the maximum number of chunks of the arena used at the same time
+	 */
+	size_t getHighWater();
+	
+	/**
+	 * @brief Return the number of chunks allocated on the heap because the arena was full
+	 */
+	unsigned long getHeapAllocations();
+};
+
+#endif /* defined(__PathPlanner__CommandArena__) */
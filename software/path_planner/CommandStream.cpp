@@ -0,0 +1,68 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#include "CommandStream.h"
+#include <assert.h>
+
+CommandStream::CommandStream(const SteppersTrapezoid& trapezoid, RampCache* rampCache, RampAlgorithm algorithm, uint32_t acceleration)
+	: generator(trapezoid, STEP_KERNEL_SPECIALIZED, rampCache, algorithm, acceleration) {
+	direction = trapezoid.direction;
+	cancellableMask = trapezoid.cancellableMask;
+	count = 0;
+	position = 0;
+}
+
+bool CommandStream::fill(CommandChunk* chunk) {
+	SteppersCommand* lastCmd = chunk->count ? &chunk->commands[chunk->count-1] : NULL;
+	
+	while(true) {
+		if(position == count) {
+			count = generator.generate(steps, delays, STEP_GENERATOR_BLOCK_SIZE);
+			position = 0;
+			
+			if(!count)
+				return false;
+		}
+		
+		for(; position<count; position++) {
+			assert(delays[position] < F_CPU*4);
+			
+			//Same step pattern with the same interval as the previous command (cruise phase): repeat the previous command instead of adding a new one
+			if(lastCmd && lastCmd->step == steps[position] && lastCmd->delay == delays[position] && (lastCmd->options & STEPPER_COMMAND_REPEAT_MASK) < STEPPER_COMMAND_MAX_REPEAT) {
+				lastCmd->options++;
+			} else {
+				//The step stays in the buffers for the next chunk
+				if(chunk->count == COMMAND_ARENA_CHUNK_COMMANDS)
+					return true;
+				
+				lastCmd = &chunk->commands[chunk->count++];
+				lastCmd->step = steps[position];
+				lastCmd->direction = direction;
+				lastCmd->cancellableMask = cancellableMask;
+				lastCmd->options = 0;
+				lastCmd->delay = delays[position];
+			}
+			
+			chunk->steps++;
+		}
+	}
+}
@@ -0,0 +1,73 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#ifndef __PathPlanner__CommandStream__
+#define __PathPlanner__CommandStream__
+
+#include <stdint.h>
+#include "StepperCommand.h"
+#include "StepGenerator.h"
+#include "CommandArena.h"
+#include "config.h"
+
+/**
+ * Resumable generation of the step commands of a move, chunk by chunk.
+ *
+ * The steps of the StepGenerator are turned into commands, a step with the same pattern and interval as the previous one 
+ * being merged in the previous command with the repeat count. Each call to fill() stops when the chunk is full and the 
+ * next call goes on with the following steps, so that a move can be sent to the PRU while its next commands are computed, 
+ * with a memory use that does not depend on its number of steps.
+ */
+class CommandStream {
+private:
+	StepGenerator generator;
+	uint8_t direction;
+	uint8_t cancellableMask;
+	
+	uint8_t steps[STEP_GENERATOR_BLOCK_SIZE];
+	uint32_t delays[STEP_GENERATOR_BLOCK_SIZE];
+	unsigned int count;                             ///< Number of steps in the buffers
+	unsigned int position;                          ///< Next step of the buffers to turn into a command
+	
+public:
+	/**
+	 * @brief Create the stream of the commands of a move
+	 *
+	 * @param trapezoid The descriptor of the move, giving the direction and cancellable masks of the commands
+	 * @param rampCache Cache of the acceleration ramps given to the StepGenerator, can be NULL
+	 * @param algorithm The algorithm computing the intervals of the acceleration and deceleration phases
+	 * @param acceleration The acceleration of the primary axis in steps/s^2, only used by RAMP_INCREMENTAL
+	 */
+	CommandStream(const SteppersTrapezoid& trapezoid, RampCache* rampCache, RampAlgorithm algorithm, uint32_t acceleration);
+	
+	/**
+	 * @brief Append the next commands of the move to a chunk
+	 * @details The commands are added after the ones already in the chunk, and chunk->steps is increased by the number of 
+	 * steps they execute.
+	 *
+	 * @param chunk The chunk to fill
+	 * @return true if the chunk is full and steps are left, false when all the steps of the move are in the chunks
+	 */
+	bool fill(CommandChunk* chunk);
+};
+
+#endif /* defined(__PathPlanner__CommandStream__) */
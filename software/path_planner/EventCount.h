@@ -0,0 +1,151 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#ifndef __PathPlanner__EventCount__
+#define __PathPlanner__EventCount__
+
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
+
+/**
+ * Lets a thread block until a condition on lock-free data becomes true, without any lock on the fast path.
+ *
+ * The waiting thread registers with prepareWait(), checks its condition, then either calls cancelWait() if the 
+ * condition is true or wait() otherwise. The notifying thread makes the condition true then calls notifyAll(). 
+ * Since both sides use sequentially consistent operations, a notification between prepareWait() and wait() 
+ * makes wait() return immediately. The futex system calls are only made when a thread actually sleeps or 
+ * has to be woken up.
+ */
+class EventCount {
+private:
+	std::atomic<uint32_t> sequence;
+	std::atomic<uint32_t> waiters;
+	
+	static_assert(sizeof(std::atomic<uint32_t>) == sizeof(int), "The futex word must be a 32 bits integer");
+	
+	inline void futexWait(uint32_t key, const struct timespec* timeout) {
+		syscall(SYS_futex, (int*)&sequence, FUTEX_WAIT_PRIVATE, key, timeout, NULL, 0);
+	}
+	
+public:
+	EventCount() : sequence(0), waiters(0) {
+	}
+	
+	/**
+	 * @brief Register the calling thread as a waiter, to be called before checking the condition
+	 * @return The key to give to wait()
+	 */
+	inline uint32_t prepareWait() {
+		waiters++;
+		return sequence;
+	}
+	
+	/**
+	 * @brief Unregister the calling thread, when the condition was true after prepareWait()
+	 */
+	inline void cancelWait() {
+		waiters--;
+	}
+	
+	/**
+	 * @brief Block until notifyAll() is called, unless it has been called since prepareWait()
+	 * @details Can return spuriously, the condition has to be checked again.
+	 *
+	 * @param key The value returned by prepareWait()
+	 */
+	inline void wait(uint32_t key) {
+		if(sequence == key)
+			futexWait(key, NULL);
+		waiters--;
+	}
+	
+	/**
+	 * @brief Same as wait() but with a timeout
+	 *
+	 * @param key The value returned by prepareWait()
+	 * @param milliseconds The maximum time to wait
+	 */
+	inline void waitFor(uint32_t key, unsigned int milliseconds) {
+		if(sequence == key) {
+			struct timespec timeout;
+			timeout.tv_sec = milliseconds / 1000;
+			timeout.tv_nsec = (milliseconds % 1000) * 1000000L;
+			futexWait(key, &timeout);
+		}
+		waiters--;
+	}
+	
+	/**
+	 * @brief Block until a condition is true
+	 *
+	 * @param condition Function returning true when the thread can go on
+	 */
+	template<class Predicate>
+	void waitUntil(Predicate condition) {
+		while(!condition()) {
+			uint32_t key = prepareWait();
+			if(condition()) {
+				cancelWait();
+				break;
+			}
+			wait(key);
+		}
+	}
+	
+	/**
+	 * @brief Block until a condition is true or until a notification has been received after the timeout
+	 *
+	 * @param condition Function returning true when the thread can go on
+	 * @param milliseconds The maximum time to wait for each notification
+	 * @return The value of the condition
+	 */
+	template<class Predicate>
+	bool waitUntilFor(Predicate condition, unsigned int milliseconds) {
+		if(condition())
+			return true;
+		
+		uint32_t key = prepareWait();
+		if(condition()) {
+			cancelWait();
+			return true;
+		}
+		waitFor(key, milliseconds);
+		
+		return condition();
+	}
+	
+	/**
+	 * @brief Wake up all the waiting threads, to be called after making the condition true
+	 */
+	inline void notifyAll() {
+		sequence++;
+		if(waiters)
+			syscall(SYS_futex, (int*)&sequence, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+	}
+};
+
+#endif /* defined(__PathPlanner__EventCount__) */
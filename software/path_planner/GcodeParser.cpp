@@ -0,0 +1,315 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include "GcodeParser.h"
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define GCODE_PARSER_NEON
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#define GCODE_PARSER_SSE2
+#include <emmintrin.h>
+#endif
+
+/* Digits kept in the 64 bits mantissa of a number, the following ones are ignored */
+#define GCODE_MAX_DIGITS 18
+
+static const double negativePowersOfTen[GCODE_MAX_DIGITS + 1] = {
+	1e0, 1e-1, 1e-2, 1e-3, 1e-4, 1e-5, 1e-6, 1e-7, 1e-8, 1e-9,
+	1e-10, 1e-11, 1e-12, 1e-13, 1e-14, 1e-15, 1e-16, 1e-17, 1e-18
+};
+
+static inline bool isBlank(char c) {
+	return c == ' ' || c == '\t';
+}
+
+static inline bool isSpecial(char c) {
+	return c == ';' || c == '*' || c == '\n' || c == '\r';
+}
+
+/* Position of the first ; * or end of line character, length if there is none */
+static size_t findSpecial(const char* p, size_t length) {
+	size_t i = 0;
+	
+#if defined(GCODE_PARSER_SSE2)
+	const __m128i semicolon = _mm_set1_epi8(';');
+	const __m128i star = _mm_set1_epi8('*');
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i carriageReturn = _mm_set1_epi8('\r');
+	
+	for(; i + 16 <= length; i += 16) {
+		__m128i chars = _mm_loadu_si128((const __m128i*)(p + i));
+		__m128i found = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chars, semicolon), _mm_cmpeq_epi8(chars, star)), 
+									 _mm_or_si128(_mm_cmpeq_epi8(chars, newline), _mm_cmpeq_epi8(chars, carriageReturn)));
+		int mask = _mm_movemask_epi8(found);
+		if(mask)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(GCODE_PARSER_NEON)
+	const uint8x16_t semicolon = vdupq_n_u8(';');
+	const uint8x16_t star = vdupq_n_u8('*');
+	const uint8x16_t newline = vdupq_n_u8('\n');
+	const uint8x16_t carriageReturn = vdupq_n_u8('\r');
+	
+	for(; i + 16 <= length; i += 16) {
+		uint8x16_t chars = vld1q_u8((const uint8_t*)(p + i));
+		uint8x16_t found = vorrq_u8(vorrq_u8(vceqq_u8(chars, semicolon), vceqq_u8(chars, star)), 
+									vorrq_u8(vceqq_u8(chars, newline), vceqq_u8(chars, carriageReturn)));
+		//4 bits per character
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(found), 4)), 0);
+		if(mask)
+			return i + (__builtin_ctzll(mask) >> 2);
+	}
+#endif
+	
+	for(; i < length; i++) {
+		if(isSpecial(p[i]))
+			return i;
+	}
+	
+	return length;
+}
+
+/* XOR of the characters, as the checksum of the RepRap protocol */
+static uint8_t xorCharacters(const char* p, size_t length) {
+	size_t i = 0;
+	uint8_t result = 0;
+	
+#if defined(GCODE_PARSER_SSE2)
+	__m128i accumulator = _mm_setzero_si128();
+	for(; i + 16 <= length; i += 16) {
+		accumulator = _mm_xor_si128(accumulator, _mm_loadu_si128((const __m128i*)(p + i)));
+	}
+	accumulator = _mm_xor_si128(accumulator, _mm_srli_si128(accumulator, 8));
+	accumulator = _mm_xor_si128(accumulator, _mm_srli_si128(accumulator, 4));
+	accumulator = _mm_xor_si128(accumulator, _mm_srli_si128(accumulator, 2));
+	accumulator = _mm_xor_si128(accumulator, _mm_srli_si128(accumulator, 1));
+	result = (uint8_t)_mm_cvtsi128_si32(accumulator);
+#elif defined(GCODE_PARSER_NEON)
+	uint8x16_t accumulator = vdupq_n_u8(0);
+	for(; i + 16 <= length; i += 16) {
+		accumulator = veorq_u8(accumulator, vld1q_u8((const uint8_t*)(p + i)));
+	}
+	uint64x2_t halves = vreinterpretq_u64_u8(accumulator);
+	uint64_t folded = vgetq_lane_u64(halves, 0) ^ vgetq_lane_u64(halves, 1);
+	folded ^= folded >> 32;
+	folded ^= folded >> 16;
+	folded ^= folded >> 8;
+	result = (uint8_t)folded;
+#endif
+	
+	for(; i < length; i++) {
+		result ^= (uint8_t)p[i];
+	}
+	
+	return result;
+}
+
+/* Parse an integer, return false if there is no digit */
+static bool parseInteger(const char*& p, const char* end, int32_t& value) {
+	bool negative = false;
+	const char* start;
+	
+	if(p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		p++;
+	}
+	
+	start = p;
+	value = 0;
+	while(p < end && (unsigned int)(*p - '0') < 10) {
+		value = value * 10 + (*p - '0');
+		p++;
+	}
+	
+	if(negative)
+		value = -value;
+	
+	return p != start;
+}
+
+/* Parse a decimal number without exponent, return false if there is no digit */
+static bool parseNumber(const char*& p, const char* end, float& value) {
+	bool negative = false;
+	uint64_t mantissa = 0;
+	unsigned int digits = 0;
+	unsigned int fractionDigits = 0;
+	int integerDigitsDropped = 0;
+	bool anyDigit = false;
+	
+	if(p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		p++;
+	}
+	
+	for(; p < end && (unsigned int)(*p - '0') < 10; p++) {
+		anyDigit = true;
+		if(digits < GCODE_MAX_DIGITS) {
+			mantissa = mantissa * 10 + (*p - '0');
+			if(mantissa) digits++;
+		} else {
+			integerDigitsDropped++;
+		}
+	}
+	
+	if(p < end && *p == '.') {
+		p++;
+		for(; p < end && (unsigned int)(*p - '0') < 10; p++) {
+			anyDigit = true;
+			if(digits < GCODE_MAX_DIGITS && fractionDigits < GCODE_MAX_DIGITS) {
+				mantissa = mantissa * 10 + (*p - '0');
+				if(mantissa) digits++;
+				fractionDigits++;
+			}
+		}
+	}
+	
+	if(!anyDigit)
+		return false;
+	
+	double result = (double)mantissa * negativePowersOfTen[fractionDigits];
+	for(; integerDigitsDropped > 0; integerDigitsDropped--) {
+		result *= 10;
+	}
+	
+	value = (float)(negative ? -result : result);
+	
+	return true;
+}
+
+GcodeLine::GcodeLine() {
+	parse("", 0);
+}
+
+bool GcodeLine::parse(const char* line, size_t length) {
+	const char* p = line;
+	const char* end = line + length;
+	
+	letters = 0;
+	numbers = 0;
+	commandLetter = 0;
+	commandCode = -1;
+	commandSubcode = -1;
+	lineNumber = -1;
+	checksum = -1;
+	computedChecksum = 0;
+	textOffset = length;
+	
+	while(p < end && isBlank(*p)) {
+		p++;
+	}
+	
+	//The comment, the checksum and the end of line are found at once
+	const char* commandEnd = p + findSpecial(p, end - p);
+	
+	if(commandEnd < end && *commandEnd == '*') {
+		const char* checksumStart = commandEnd + 1;
+		int32_t value;
+		
+		computedChecksum = xorCharacters(p, commandEnd - p);
+		if(parseInteger(checksumStart, end, value) && value >= 0)
+			checksum = value;
+	}
+	
+	while(p < commandEnd) {
+		char c = *p;
+		unsigned int index = (unsigned int)((c | 0x20) - 'a');
+		
+		//Blanks and stray characters between the words
+		if(index >= GCODE_LETTERS) {
+			p++;
+			continue;
+		}
+		
+		char letter = 'A' + index;
+		p++;
+		
+		if(!commandLetter) {
+			int32_t value;
+			
+			if(letter == 'N' && lineNumber < 0 && !letters && parseInteger(p, commandEnd, value)) {
+				lineNumber = value;
+				continue;
+			}
+			
+			if((letter == 'G' || letter == 'M' || letter == 'T') && parseInteger(p, commandEnd, value)) {
+				commandLetter = letter;
+				commandCode = value;
+				
+				if(p < commandEnd && *p == '.') {
+					p++;
+					if(parseInteger(p, commandEnd, value))
+						commandSubcode = value;
+				}
+				
+				while(p < commandEnd && isBlank(*p)) {
+					p++;
+				}
+				textOffset = p - line;
+				continue;
+			}
+		}
+		
+		letters |= 1 << index;
+		
+		if(parseNumber(p, commandEnd, values[index])) {
+			numbers |= 1 << index;
+		} else {
+			//A word that is not a number, as in a text
+			while(p < commandEnd && !isBlank(*p)) {
+				p++;
+			}
+		}
+	}
+	
+	return commandLetter != 0;
+}
+
+std::string GcodeLine::getCommand() const {
+	char buffer[32];
+	
+	if(!commandLetter)
+		return std::string();
+	
+	if(commandSubcode >= 0) {
+		snprintf(buffer, sizeof(buffer), "%c%d.%d", commandLetter, commandCode, commandSubcode);
+	} else {
+		snprintf(buffer, sizeof(buffer), "%c%d", commandLetter, commandCode);
+	}
+	
+	return std::string(buffer);
+}
+
+float GcodeLine::getValue(char letter) const {
+	unsigned int index = (unsigned int)((letter | 0x20) - 'a');
+	
+	if(index >= GCODE_LETTERS || !(numbers & (1 << index)))
+		return NAN;
+	
+	return values[index];
+}
+
+unsigned int GcodeLine::getLettersCount() const {
+	return __builtin_popcount(letters);
+}
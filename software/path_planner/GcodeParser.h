@@ -0,0 +1,147 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#ifndef __PathPlanner__GcodeParser__
+#define __PathPlanner__GcodeParser__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+/* Number of parameter letters, A to Z */
+#define GCODE_LETTERS 26
+
+/**
+ * A G-code line parsed into a fixed size structure.
+ *
+ * The parameters are stored in a table indexed by their letter, so that looking one up is O(1), and parsing a line 
+ * does no memory allocation. The comment and the checksum delimiters are found 16 bytes at a time with SSE2 or NEON 
+ * when available, and the checksum is computed the same way.
+ */
+class GcodeLine {
+private:
+	uint32_t letters;                   ///< Bit i is set when the letter 'A'+i is present
+	uint32_t numbers;                   ///< Bit i is set when the letter 'A'+i is followed by a number
+	float values[GCODE_LETTERS];        ///< Value of each letter, valid when its bit is set in numbers
+	
+	char commandLetter;                 ///< G, M or T, 0 when the line has no command
+	int32_t commandCode;
+	int32_t commandSubcode;             ///< Number after the dot as in G29.1, -1 if none
+	
+	int32_t lineNumber;                 ///< Value of the N prefix, -1 if none
+	int32_t checksum;                   ///< Value after the *, -1 if none
+	uint8_t computedChecksum;           ///< XOR of the characters before the *
+	
+	uint32_t textOffset;                ///< Offset of the first parameter in the line, for the commands taking a text
+	
+public:
+	GcodeLine();
+	
+	/**
+	 * @brief Parse a line
+	 * @details Everything after a ; is a comment. A line can start with a line number N and end with a checksum *.
+	 *
+	 * @param line The characters of the line, it does not have to be null terminated
+	 * @param length The number of characters
+	 * @return true if the line contains a command
+	 */
+	bool parse(const char* line, size_t length);
+	
+	/**
+	 * @brief Parse a line
+	 * @param line The line
+	 * @return true if the line contains a command
+	 */
+	bool parse(const std::string& line) {
+		return parse(line.data(), line.size());
+	}
+	
+	/**
+	 * @brief Return the command, as G1 or M105, or an empty string if the line has none
+	 */
+	std::string getCommand() const;
+	
+	inline char getCommandLetter() const {
+		return commandLetter;
+	}
+	
+	inline int getCommandCode() const {
+		return commandCode;
+	}
+	
+	/**
+	 * @brief Return true if the parameter letter is present in the line
+	 */
+	inline bool hasLetter(char letter) const {
+		unsigned int index = (unsigned int)((letter | 0x20) - 'a');
+		return index < GCODE_LETTERS && (letters & (1 << index));
+	}
+	
+	/**
+	 * @brief Return true if the parameter letter is present and followed by a number
+	 * @details Use this rather than testing getValue() for NaN, which is not reliable with -ffast-math.
+	 */
+	inline bool hasValue(char letter) const {
+		unsigned int index = (unsigned int)((letter | 0x20) - 'a');
+		return index < GCODE_LETTERS && (numbers & (1 << index));
+	}
+	
+	/**
+	 * @brief Return the value of a parameter letter
+	 * @return The value, NaN if the letter is not present or is not followed by a number
+	 */
+	float getValue(char letter) const;
+	
+	/**
+	 * @brief Return the number of parameters
+	 */
+	unsigned int getLettersCount() const;
+	
+	inline bool hasLineNumber() const {
+		return lineNumber >= 0;
+	}
+	
+	inline int getLineNumber() const {
+		return lineNumber;
+	}
+	
+	inline bool hasChecksum() const {
+		return checksum >= 0;
+	}
+	
+	/**
+	 * @brief Return true if the checksum of the line matches the one computed from its characters
+	 */
+	inline bool isChecksumValid() const {
+		return checksum == computedChecksum;
+	}
+	
+	/**
+	 * @brief Return the offset of the first parameter in the line
+	 * @details The commands such as M117 take a text instead of parameters, it starts at this offset.
+	 */
+	inline unsigned int getTextOffset() const {
+		return textOffset;
+	}
+};
+
+#endif /* defined(__PathPlanner__GcodeParser__) */
@@ -0,0 +1,151 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#include <math.h>
+#include "IncrementalRamp.h"
+#include "config.h"
+
+#define FIXED_32_32 4294967296.0
+
+/* High 64 bits of the 128 bits product, a single multiplication where the compiler has a 128 bits type. 32 bits ARM 
+ * does not have it and uses four 32x32 multiplications. */
+static inline uint64_t mulHigh64(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+	return (uint64_t)(((unsigned __int128)a * b) >> 64);
+#else
+	uint64_t aLow = (uint32_t)a, aHigh = a >> 32;
+	uint64_t bLow = (uint32_t)b, bHigh = b >> 32;
+	
+	uint64_t low = aLow * bLow;
+	uint64_t middle1 = aHigh * bLow;
+	uint64_t middle2 = aLow * bHigh;
+	uint64_t carry = ((low >> 32) + (uint32_t)middle1 + (uint32_t)middle2) >> 32;
+	
+	return aHigh * bHigh + (middle1 >> 32) + (middle2 >> 32) + carry;
+#endif
+}
+
+static inline uint64_t toFixed(double cycles) {
+	return (uint64_t)(cycles * FIXED_32_32 + 0.5);
+}
+
+IncrementalRamp::IncrementalRamp() {
+	interval = 0;
+	minInterval = 0;
+	maxInterval = UINT64_MAX;
+	k = 0;
+	fraction = 0;
+	sqrtAcceleration = 0;
+	decelerating = false;
+}
+
+void IncrementalRamp::accelerate(double vStart, double vMax, double acceleration) {
+	sqrtAcceleration = sqrt(acceleration);
+	k = (uint64_t)(sqrtAcceleration / F_CPU * 302231454903657293676544.0); // 2^78
+	
+	//Speed at the middle of the first step
+	interval = toFixed(F_CPU / sqrt(vStart * vStart + acceleration));
+	minInterval = toFixed(F_CPU / vMax);
+	maxInterval = UINT64_MAX;
+	fraction = 0;
+	decelerating = false;
+}
+
+void IncrementalRamp::decelerate(double vEnd, double vTop, double acceleration, uint32_t steps) {
+	sqrtAcceleration = sqrt(acceleration);
+	k = (uint64_t)(sqrtAcceleration / F_CPU * 302231454903657293676544.0); // 2^78
+	
+	//Speed at the middle of the first step, from the end speed so that the ramp ends at vEnd whatever vTop
+	interval = toFixed(F_CPU / sqrt(vEnd * vEnd + acceleration * (2.0 * steps - 1)));
+	minInterval = toFixed(F_CPU / vTop);
+	maxInterval = toFixed(F_CPU / vEnd);
+	fraction = 0;
+	decelerating = true;
+}
+
+uint64_t IncrementalRamp::nextStep() {
+	uint64_t time;
+	
+	//w = c*sqrt(a)/F_CPU in 18.46 fixed point
+	uint64_t w = mulHigh64(interval, k);
+	
+	if(w >= (1ULL << 43)) {
+		//p >= 1/64, only at very low speed: exact computation
+		double a = sqrtAcceleration * sqrtAcceleration;
+		double v = F_CPU / (interval / FIXED_32_32);
+		double v2 = v * v;
+		
+		time = toFixed(F_CPU * (sqrt(v2 + a) - sqrt(v2 > a ? v2 - a : 0)) / a);
+		
+		if(decelerating) {
+			interval = v2 > 2 * a ? toFixed(F_CPU / sqrt(v2 - 2 * a)) : maxInterval;
+		} else {
+			interval = toFixed(F_CPU / sqrt(v2 + 2 * a));
+		}
+		
+		return time;
+	}
+	
+	w <<= 18;
+	
+	//Terms of the series in 0.64 fixed point, p < 1/64
+	uint64_t p = mulHigh64(w, w);
+	uint64_t p2 = mulHigh64(p, p);
+	uint64_t p3 = mulHigh64(p2, p);
+	uint64_t p4 = mulHigh64(p3, p);
+	
+	//c is the interval at the speed of the middle of the step, the time of the step is c*(1 + p^2/8 + ...)
+	time = interval + mulHigh64(interval, p2 >> 3);
+	
+	uint64_t p2Term = p2 + (p2 >> 1);                       // 3/2 p^2
+	uint64_t p3Term = (p3 << 1) + (p3 >> 1);                // 5/2 p^3
+	uint64_t p4Term = (p4 << 2) + (p4 >> 2) + (p4 >> 3);    // 35/8 p^4
+	
+	if(decelerating) {
+		//(1-2p)^(-1/2) = 1 + p + 3/2 p^2 + 5/2 p^3 + 35/8 p^4 + ...
+		interval += mulHigh64(interval, p + p2Term + p3Term + p4Term);
+	} else {
+		//(1+2p)^(-1/2) = 1 - p + 3/2 p^2 - 5/2 p^3 + 35/8 p^4 - ...
+		interval -= mulHigh64(interval, p - p2Term + p3Term - p4Term);
+	}
+	
+	return time;
+}
+
+void IncrementalRamp::generate(uint32_t* delays, unsigned int count) {
+	for(unsigned int i=0; i<count; i++) {
+		uint64_t time;
+		
+		if(!decelerating && interval <= minInterval) {
+			//vMax is reached, the interval does not change anymore
+			time = minInterval;
+		} else {
+			time = nextStep();
+			if(time < minInterval) time = minInterval;
+			if(time > maxInterval) time = maxInterval;
+		}
+		
+		uint64_t total = time + fraction;
+		delays[i] = (uint32_t)(total >> 32);
+		fraction = (uint32_t)total;
+	}
+}
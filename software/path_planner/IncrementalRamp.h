@@ -0,0 +1,83 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#ifndef __PathPlanner__IncrementalRamp__
+#define __PathPlanner__IncrementalRamp__
+
+#include <stdint.h>
+
+/* Above this value of a*c^2/F_CPU^2 (in 0.64 fixed point, 1/64) the series is not precise enough and the exact interval is computed */
+#define INCREMENTAL_RAMP_MAX_SERIES_P (1ULL << 58)
+
+/**
+ * Intervals of a constant acceleration ramp, updated step by step without division.
+ *
+ * The interval of a step is F_CPU/v, with v the speed at the middle of the step given by v^2 = v0^2 + 2*a*x. 
+ * From one step to the next, v^2 changes by 2*a, so c' = c*(1+2p)^(-1/2) when accelerating and c' = c*(1-2p)^(-1/2) 
+ * when decelerating, with p = a*c^2/F_CPU^2. These factors are computed with their series in p, in 64 bits fixed point.
+ * The exact time of the step, c*(1+p^2/8), is generated rather than c. The interval is kept in 32.32 fixed point and its fractional part is carried to the next step, so the sum of the 
+ * generated delays stays within one cycle of the sum of the fixed point intervals.
+ */
+class IncrementalRamp {
+private:
+	uint64_t interval;          ///< Interval of the next step in cycles, 32.32 fixed point, not limited
+	uint64_t minInterval;       ///< Interval at the maximum speed, 32.32 fixed point
+	uint64_t maxInterval;       ///< Interval at the minimum speed, 32.32 fixed point
+	uint64_t k;                 ///< sqrt(a)/F_CPU, 0.78 fixed point, limits the acceleration to 1.4e8 steps/s^2
+	uint32_t fraction;          ///< Fractional cycles not yet generated, 0.32 fixed point
+	double sqrtAcceleration;
+	bool decelerating;
+	
+	uint64_t nextStep();
+	
+public:
+	IncrementalRamp();
+	
+	/**
+	 * @brief Start an acceleration ramp
+	 *
+	 * @param vStart Speed at the start of the ramp in steps/s
+	 * @param vMax Maximum speed in steps/s, the speed stays at vMax once reached
+	 * @param acceleration Acceleration in steps/s^2
+	 */
+	void accelerate(double vStart, double vMax, double acceleration);
+	
+	/**
+	 * @brief Start a deceleration ramp that ends at vEnd after the given number of steps
+	 *
+	 * @param vEnd Speed at the end of the ramp in steps/s
+	 * @param vTop Maximum speed in steps/s, the speed stays at vTop until the ramp reaches it
+	 * @param acceleration Deceleration in steps/s^2
+	 * @param steps Number of steps of the ramp
+	 */
+	void decelerate(double vEnd, double vTop, double acceleration, uint32_t steps);
+	
+	/**
+	 * @brief Generate the delays of the next steps of the ramp
+	 *
+	 * @param delays Receive the delays in PRU cycles
+	 * @param count Number of steps to generate
+	 */
+	void generate(uint32_t* delays, unsigned int count);
+};
+
+#endif /* defined(__PathPlanner__IncrementalRamp__) */
@@ -0,0 +1,262 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#include <cmath>
+#include <algorithm>
+#include "Kinematics.h"
+#include "Path.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+bool Kinematics::inverseBatch(const double* const cartesian[NUM_MOVING_AXIS], double* const motors[NUM_MOVING_AXIS], unsigned int count) const {
+	for(unsigned int n=0; n<count; n++) {
+		double point[NUM_MOVING_AXIS], pointMotors[NUM_MOVING_AXIS];
+		
+		for(int i=0; i<NUM_MOVING_AXIS; i++) {
+			point[i] = cartesian[i][n];
+		}
+		
+		if(!inverse(point, pointMotors))
+			return false;
+		
+		for(int i=0; i<NUM_MOVING_AXIS; i++) {
+			motors[i][n] = pointMotors[i];
+		}
+	}
+	
+	return true;
+}
+
+bool Kinematics::transformVector(const float position[NUM_AXIS], const float vec[NUM_AXIS], float motorVec[NUM_AXIS]) const {
+	double start[NUM_MOVING_AXIS], end[NUM_MOVING_AXIS];
+	double startMotors[NUM_MOVING_AXIS], endMotors[NUM_MOVING_AXIS];
+	
+	for(int i=0; i<NUM_MOVING_AXIS; i++) {
+		start[i] = position[i];
+		end[i] = (double)position[i] + vec[i];
+	}
+	
+	if(!inverse(start, startMotors) || !inverse(end, endMotors))
+		return false;
+	
+	for(int i=0; i<NUM_MOVING_AXIS; i++) {
+		motorVec[i] = endMotors[i] - startMotors[i];
+	}
+	for(int i=NUM_MOVING_AXIS; i<NUM_AXIS; i++) {
+		motorVec[i] = vec[i];
+	}
+	
+	return true;
+}
+
+bool Kinematics::reverseTransformVector(const float position[NUM_AXIS], const float motorVec[NUM_AXIS], float vec[NUM_AXIS]) const {
+	double start[NUM_MOVING_AXIS], end[NUM_MOVING_AXIS];
+	double startMotors[NUM_MOVING_AXIS], endMotors[NUM_MOVING_AXIS];
+	
+	for(int i=0; i<NUM_MOVING_AXIS; i++) {
+		start[i] = position[i];
+	}
+	
+	if(!inverse(start, startMotors))
+		return false;
+	
+	for(int i=0; i<NUM_MOVING_AXIS; i++) {
+		endMotors[i] = startMotors[i] + motorVec[i];
+	}
+	
+	//The start is computed back from the motors as well, so that the rounding errors cancel out
+	if(!forward(startMotors, start) || !forward(endMotors, end))
+		return false;
+	
+	for(int i=0; i<NUM_MOVING_AXIS; i++) {
+		vec[i] = end[i] - start[i];
+	}
+	for(int i=NUM_MOVING_AXIS; i<NUM_AXIS; i++) {
+		vec[i] = motorVec[i];
+	}
+	
+	return true;
+}
+
+bool CartesianKinematics::inverse(const double cartesian[NUM_MOVING_AXIS], double motors[NUM_MOVING_AXIS]) const {
+	motors[X_AXIS] = cartesian[X_AXIS];
+	motors[Y_AXIS] = cartesian[Y_AXIS];
+	motors[Z_AXIS] = cartesian[Z_AXIS];
+	return true;
+}
+
+bool CartesianKinematics::forward(const double motors[NUM_MOVING_AXIS], double cartesian[NUM_MOVING_AXIS]) const {
+	cartesian[X_AXIS] = motors[X_AXIS];
+	cartesian[Y_AXIS] = motors[Y_AXIS];
+	cartesian[Z_AXIS] = motors[Z_AXIS];
+	return true;
+}
+
+/* The inverse of the Path.matrix_H matrix */
+bool HBeltKinematics::inverse(const double cartesian[NUM_MOVING_AXIS], double motors[NUM_MOVING_AXIS]) const {
+	motors[X_AXIS] = -cartesian[X_AXIS] - cartesian[Y_AXIS];
+	motors[Y_AXIS] = cartesian[X_AXIS] - cartesian[Y_AXIS];
+	motors[Z_AXIS] = cartesian[Z_AXIS];
+	return true;
+}
+
+/* The Path.matrix_H matrix */
+bool HBeltKinematics::forward(const double motors[NUM_MOVING_AXIS], double cartesian[NUM_MOVING_AXIS]) const {
+	cartesian[X_AXIS] = -0.5*motors[X_AXIS] + 0.5*motors[Y_AXIS];
+	cartesian[Y_AXIS] = -0.5*motors[X_AXIS] - 0.5*motors[Y_AXIS];
+	cartesian[Z_AXIS] = motors[Z_AXIS];
+	return true;
+}
+
+/* The Path.matrix_XY matrix */
+bool CoreXYKinematics::inverse(const double cartesian[NUM_MOVING_AXIS], double motors[NUM_MOVING_AXIS]) const {
+	motors[X_AXIS] = cartesian[X_AXIS] + cartesian[Y_AXIS];
+	motors[Y_AXIS] = cartesian[X_AXIS] - cartesian[Y_AXIS];
+	motors[Z_AXIS] = cartesian[Z_AXIS];
+	return true;
+}
+
+/* The inverse of the Path.matrix_XY matrix */
+bool CoreXYKinematics::forward(const double motors[NUM_MOVING_AXIS], double cartesian[NUM_MOVING_AXIS]) const {
+	cartesian[X_AXIS] = 0.5*motors[X_AXIS] + 0.5*motors[Y_AXIS];
+	cartesian[Y_AXIS] = 0.5*motors[X_AXIS] - 0.5*motors[Y_AXIS];
+	cartesian[Z_AXIS] = motors[Z_AXIS];
+	return true;
+}
+
+DeltaKinematics::DeltaKinematics(double L, double r, double Ae, double Be, double Ce, double Hez) {
+	const double theta[NUM_MOVING_AXIS] = {M_PI/2.0, 7.0*M_PI/6.0, 11.0*M_PI/6.0};
+	const double effectorOffset[NUM_MOVING_AXIS] = {Ae, Be, Ce};
+	
+	this->L = L;
+	this->Hez = Hez;
+	
+	for(int i=0; i<NUM_MOVING_AXIS; i++) {
+		columnX[i] = (r - effectorOffset[i])*cos(theta[i]);
+		columnY[i] = (r - effectorOffset[i])*sin(theta[i]);
+	}
+}
+
+bool DeltaKinematics::inverse(const double cartesian[NUM_MOVING_AXIS], double motors[NUM_MOVING_AXIS]) const {
+	for(int i=0; i<NUM_MOVING_AXIS; i++) {
+		double dx = cartesian[X_AXIS] - columnX[i];
+		double dy = cartesian[Y_AXIS] - columnY[i];
+		double height = L*L - dx*dx - dy*dy;
+		
+		//The rod is too short to reach the position
+		if(height < 0)
+			return false;
+		
+		motors[i] = cartesian[Z_AXIS] + sqrt(height) + Hez;
+	}
+	
+	return true;
+}
+
+/* Same as inverse(), two points at a time with SSE2. The compilers only vectorize sqrt() with -ffast-math, as it sets 
+ * errno otherwise, so the square roots are written with the intrinsics. The Cortex-A8 NEON has no double precision: 
+ * without SSE2 the points are computed one by one, which is faster than a loop of scalar square roots by column. */
+bool DeltaKinematics::inverseBatch(const double* const cartesian[NUM_MOVING_AXIS], double* const motors[NUM_MOVING_AXIS], unsigned int count) const {
+#if defined(__SSE2__)
+	const double* x = cartesian[X_AXIS];
+	const double* y = cartesian[Y_AXIS];
+	const double* z = cartesian[Z_AXIS];
+	const __m128d L2 = _mm_set1_pd(L*L);
+	const __m128d hez = _mm_set1_pd(Hez);
+	const __m128d zero = _mm_setzero_pd();
+	__m128d unreachable = zero;
+	unsigned int n = 0;
+	
+	for(; n+2<=count; n+=2) {
+		__m128d px = _mm_loadu_pd(x+n);
+		__m128d py = _mm_loadu_pd(y+n);
+		__m128d pz = _mm_loadu_pd(z+n);
+		
+		for(int i=0; i<NUM_MOVING_AXIS; i++) {
+			__m128d dx = _mm_sub_pd(px, _mm_set1_pd(columnX[i]));
+			__m128d dy = _mm_sub_pd(py, _mm_set1_pd(columnY[i]));
+			__m128d height = _mm_sub_pd(_mm_sub_pd(L2, _mm_mul_pd(dx, dx)), _mm_mul_pd(dy, dy));
+			
+			unreachable = _mm_or_pd(unreachable, _mm_cmplt_pd(height, zero));
+			__m128d carriage = _mm_add_pd(pz, _mm_sqrt_pd(_mm_max_pd(height, zero)));
+			_mm_storeu_pd(motors[i]+n, _mm_add_pd(carriage, hez));
+		}
+	}
+	
+	//The rod is too short to reach one of the positions
+	if(_mm_movemask_pd(unreachable))
+		return false;
+	
+	//Odd count
+	const double* const last[NUM_MOVING_AXIS] = {x+n, y+n, z+n};
+	double* const lastMotors[NUM_MOVING_AXIS] = {motors[0]+n, motors[1]+n, motors[2]+n};
+	
+	return Kinematics::inverseBatch(last, lastMotors, count-n);
+#else
+	return Kinematics::inverseBatch(cartesian, motors, count);
+#endif
+}
+
+/* Intersection of the three spheres of radius L centered on the carriages, below them */
+bool DeltaKinematics::forward(const double motors[NUM_MOVING_AXIS], double cartesian[NUM_MOVING_AXIS]) const {
+	const double p1[3] = {columnX[0], columnY[0], motors[0]};
+	const double p12[3] = {columnX[1] - p1[0], columnY[1] - p1[1], motors[1] - p1[2]};
+	const double p13[3] = {columnX[2] - p1[0], columnY[2] - p1[1], motors[2] - p1[2]};
+	double ex[3], ey[3], ez[3];
+	
+	double d = sqrt(p12[0]*p12[0] + p12[1]*p12[1] + p12[2]*p12[2]);
+	for(int k=0; k<3; k++) {
+		ex[k] = p12[k]/d;
+	}
+	
+	double i = ex[0]*p13[0] + ex[1]*p13[1] + ex[2]*p13[2];
+	for(int k=0; k<3; k++) {
+		ey[k] = p13[k] - i*ex[k];
+	}
+	double eyNorm = sqrt(ey[0]*ey[0] + ey[1]*ey[1] + ey[2]*ey[2]);
+	for(int k=0; k<3; k++) {
+		ey[k] /= eyNorm;
+	}
+	
+	ez[0] = ex[1]*ey[2] - ex[2]*ey[1];
+	ez[1] = ex[2]*ey[0] - ex[0]*ey[2];
+	ez[2] = ex[0]*ey[1] - ex[1]*ey[0];
+	
+	double j = ey[0]*p13[0] + ey[1]*p13[1] + ey[2]*p13[2];
+	
+	double x = d/2;
+	double y = ((i*i + j*j)/2 - i*x)/j;
+	double height = L*L - x*x - y*y;
+	
+	if(height < 0)
+		return false;
+	
+	double z = sqrt(height);
+	
+	for(int k=0; k<3; k++) {
+		cartesian[k] = p1[k] + x*ex[k] + y*ey[k] - z*ez[k];
+	}
+	
+	return true;
+}
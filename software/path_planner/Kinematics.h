@@ -0,0 +1,165 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#ifndef __PathPlanner__Kinematics__
+#define __PathPlanner__Kinematics__
+
+#include "config.h"
+
+/* Axis configurations, same values as Path.axis_config */
+#define AXIS_CONFIG_XY 0
+#define AXIS_CONFIG_H_BELT 1
+#define AXIS_CONFIG_CORE_XY 2
+#define AXIS_CONFIG_DELTA 3
+
+/**
+ * Conversion between the cartesian position of the head and the position of the motors.
+ *
+ * Only the moving axis are transformed, the extruder always moves by its own amount. All the positions are in meters.
+ */
+class Kinematics {
+public:
+	virtual ~Kinematics() {}
+	
+	/**
+	 * @brief Compute the position of the motors for a position of the head
+	 *
+	 * @param cartesian The position of the head
+	 * @param motors The position of the motors
+	 * @return false if the position cannot be reached
+	 */
+	virtual bool inverse(const double cartesian[NUM_MOVING_AXIS], double motors[NUM_MOVING_AXIS]) const = 0;
+	
+	/**
+	 * @brief Compute the position of the head for a position of the motors
+	 *
+	 * @param motors The position of the motors
+	 * @param cartesian The position of the head
+	 * @return false if the position cannot be reached
+	 */
+	virtual bool forward(const double motors[NUM_MOVING_AXIS], double cartesian[NUM_MOVING_AXIS]) const = 0;
+	
+	/**
+	 * @brief Compute the position of the motors for several positions of the head
+	 * @details The coordinates are given axis by axis, so that the implementations can compute the positions in a single vectorized pass.
+	 *
+	 * @param cartesian The coordinates of the positions of the head, one array of count values per axis
+	 * @param motors The positions of the motors, one array of count values per axis
+	 * @param count The number of positions
+	 * @return false if one of the positions cannot be reached
+	 */
+	virtual bool inverseBatch(const double* const cartesian[NUM_MOVING_AXIS], double* const motors[NUM_MOVING_AXIS], unsigned int count) const;
+	
+	/**
+	 * @brief Return true if a straight move of the head is not a straight move of the motors
+	 * @details The moves have to be split in segments in that case.
+	 */
+	virtual bool needsSegmentation() const {
+		return false;
+	}
+	
+	/**
+	 * @brief Compute the move of the motors for a move of the head
+	 * @details Same as Path.transform_vector
+	 *
+	 * @param position The position of the head at the start of the move
+	 * @param vec The move of the head
+	 * @param motorVec The move of the motors
+	 * @return false if the move cannot be done
+	 */
+	bool transformVector(const float position[NUM_AXIS], const float vec[NUM_AXIS], float motorVec[NUM_AXIS]) const;
+	
+	/**
+	 * @brief Compute the move of the head for a move of the motors
+	 * @details Same as Path.reverse_transform_vector
+	 *
+	 * @param position The position of the head at the start of the move
+	 * @param motorVec The move of the motors
+	 * @param vec The move of the head
+	 * @return false if the move cannot be done
+	 */
+	bool reverseTransformVector(const float position[NUM_AXIS], const float motorVec[NUM_AXIS], float vec[NUM_AXIS]) const;
+};
+
+/**
+ * The motors move the head along X, Y and Z.
+ */
+class CartesianKinematics : public Kinematics {
+public:
+	virtual bool inverse(const double cartesian[NUM_MOVING_AXIS], double motors[NUM_MOVING_AXIS]) const;
+	virtual bool forward(const double motors[NUM_MOVING_AXIS], double cartesian[NUM_MOVING_AXIS]) const;
+};
+
+/**
+ * Both motors move the head along X and Y through a single belt shaped as a H.
+ */
+class HBeltKinematics : public Kinematics {
+public:
+	virtual bool inverse(const double cartesian[NUM_MOVING_AXIS], double motors[NUM_MOVING_AXIS]) const;
+	virtual bool forward(const double motors[NUM_MOVING_AXIS], double cartesian[NUM_MOVING_AXIS]) const;
+};
+
+/**
+ * The first motor moves the head along X+Y and the second one along X-Y.
+ */
+class CoreXYKinematics : public Kinematics {
+public:
+	virtual bool inverse(const double cartesian[NUM_MOVING_AXIS], double motors[NUM_MOVING_AXIS]) const;
+	virtual bool forward(const double motors[NUM_MOVING_AXIS], double cartesian[NUM_MOVING_AXIS]) const;
+};
+
+/**
+ * Three carriages moving along vertical columns hold the effector with rods of the same length.
+ *
+ * Same model as Delta.py, based on the work of Steve Graves on the Delta printer kinematics.
+ */
+class DeltaKinematics : public Kinematics {
+private:
+	double L;                           ///< Length of the rods
+	double Hez;                         ///< Distance of the head below the effector
+	double columnX[NUM_MOVING_AXIS];    ///< Position of the virtual columns, the columns moved by the effector offset
+	double columnY[NUM_MOVING_AXIS];
+	
+public:
+	/**
+	 * @brief Create the kinematics of a Delta printer
+	 * @details The columns A, B and C are at 90, 210 and 330 degrees.
+	 *
+	 * @param L The length of the rods
+	 * @param r The radius of the columns
+	 * @param Ae The offset of the effector joint of the column A
+	 * @param Be The offset of the effector joint of the column B
+	 * @param Ce The offset of the effector joint of the column C
+	 * @param Hez The distance of the head below the effector
+	 */
+	DeltaKinematics(double L, double r, double Ae, double Be, double Ce, double Hez);
+	
+	virtual bool inverse(const double cartesian[NUM_MOVING_AXIS], double motors[NUM_MOVING_AXIS]) const;
+	virtual bool forward(const double motors[NUM_MOVING_AXIS], double cartesian[NUM_MOVING_AXIS]) const;
+	virtual bool inverseBatch(const double* const cartesian[NUM_MOVING_AXIS], double* const motors[NUM_MOVING_AXIS], unsigned int count) const;
+	
+	virtual bool needsSegmentation() const {
+		return true;
+	}
+};
+
+#endif /* defined(__PathPlanner__Kinematics__) */
@@ -21,6 +21,227 @@
  */
 
 #include "Logger.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+#include <strings.h>
 
+static const char* categoryNames[LOG_CATEGORIES_COUNT] = {
+	"planner",
+	"stepgen",
+	"pru",
+	"ddr"
+};
 
-std::mutex Logger::coutMutex;
\ No newline at end of file
+std::atomic<int> Logger::levels[LOG_CATEGORIES_COUNT];
+
+static bool initLevels() {
+	Logger::setLevel("all", LOG_DEFAULT_LEVEL);
+	
+	const char* specification = getenv("REDEEM_LOG");
+	
+	if(specification)
+		Logger::setLevels(specification);
+	
+	return true;
+}
+
+static bool levelsInitialized = initLevels();
+
+const char* Logger::categoryName(uint8_t category) {
+	return category < LOG_CATEGORIES_COUNT ? categoryNames[category] : "?";
+}
+
+const char* Logger::levelName(uint8_t level) {
+	if(level >= LOG_LEVEL_ERROR)
+		return "ERROR";
+	if(level >= LOG_LEVEL_WARNING)
+		return "WARNING";
+	if(level >= LOG_LEVEL_INFO)
+		return "INFO";
+	
+	return "DEBUG";
+}
+
+bool Logger::setLevel(const std::string& category, int level) {
+	if(category == "all" || category.empty()) {
+		for(unsigned int i=0; i<LOG_CATEGORIES_COUNT; i++) {
+			levels[i].store(level, std::memory_order_relaxed);
+		}
+		return true;
+	}
+	
+	for(unsigned int i=0; i<LOG_CATEGORIES_COUNT; i++) {
+		if(category == categoryNames[i]) {
+			levels[i].store(level, std::memory_order_relaxed);
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+static bool parseLevel(const std::string& name, int& level) {
+	const char* names[] = {"debug", "info", "warning", "error"};
+	const int values[] = {LOG_LEVEL_DEBUG, LOG_LEVEL_INFO, LOG_LEVEL_WARNING, LOG_LEVEL_ERROR};
+	
+	for(unsigned int i=0; i<sizeof(names)/sizeof(names[0]); i++) {
+		if(!strcasecmp(name.c_str(), names[i])) {
+			level = values[i];
+			return true;
+		}
+	}
+	
+	char* end;
+	level = strtol(name.c_str(), &end, 10);
+	
+	return !name.empty() && *end == 0;
+}
+
+bool Logger::setLevels(const std::string& specification) {
+	bool valid = true;
+	size_t start = 0;
+	
+	while(start <= specification.size()) {
+		size_t end = specification.find(',', start);
+		if(end == std::string::npos)
+			end = specification.size();
+		
+		std::string part = specification.substr(start, end - start);
+		size_t equal = part.find('=');
+		int level;
+		
+		if(equal == std::string::npos) {
+			valid = parseLevel(part, level) && setLevel("all", level) && valid;
+		} else {
+			valid = parseLevel(part.substr(equal + 1), level) && setLevel(part.substr(0, equal), level) && valid;
+		}
+		
+		start = end + 1;
+	}
+	
+	return valid;
+}
+
+LogSink::LogSink() {
+	for(uint32_t i=0; i<LOGGER_RING_SIZE; i++) {
+		records[i].sequence.store(i, std::memory_order_relaxed);
+	}
+	
+	enqueuePos = 0;
+	dequeuePos = 0;
+	overflows = 0;
+	overflowsReported = 0;
+	running = true;
+	
+	runningThread = std::thread([this]() {
+		this->run();
+	});
+	
+	atexit(stopAtExit);
+}
+
+LogSink& LogSink::instance() {
+	static LogSink* sink = new LogSink();
+	
+	return *sink;
+}
+
+void LogSink::stopAtExit() {
+	instance().stop();
+}
+
+void LogSink::push(uint64_t time, uint8_t category, uint8_t level, const char* text, size_t length) {
+	if(length > LOGGER_RECORD_SIZE)
+		length = LOGGER_RECORD_SIZE;
+	
+	if(!running.load(std::memory_order_relaxed)) {
+		//The thread is stopped when the program exits
+		fprintf(stderr, "[ %llu ]\t%s\t%s\t%.*s", (unsigned long long)time, Logger::levelName(level), Logger::categoryName(category), (int)length, text);
+		return;
+	}
+	
+	//A record is free for the position pos when its sequence is pos, see the bounded queue of D. Vyukov
+	uint32_t pos = enqueuePos.load(std::memory_order_relaxed);
+	LogRecord* record;
+	
+	for(;;) {
+		record = &records[pos & (LOGGER_RING_SIZE-1)];
+		int32_t diff = (int32_t)(record->sequence.load(std::memory_order_acquire) - pos);
+		
+		if(diff == 0) {
+			if(enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if(diff < 0) {
+			//Not consumed yet, the ring is full
+			overflows.fetch_add(1, std::memory_order_relaxed);
+			return;
+		} else {
+			pos = enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+	
+	record->time = time;
+	record->length = length;
+	record->category = category;
+	record->level = level;
+	memcpy(record->text, text, length);
+	
+	record->sequence.store(pos + 1, std::memory_order_release);
+}
+
+bool LogSink::writePending() {
+	std::string output;
+	
+	for(;;) {
+		LogRecord& record = records[dequeuePos & (LOGGER_RING_SIZE-1)];
+		
+		if(record.sequence.load(std::memory_order_acquire) != dequeuePos + 1)
+			break;
+		
+		output += "[ " + std::to_string((unsigned long long)record.time) + " ]\t";
+		output += Logger::levelName(record.level);
+		output += "\t";
+		output += Logger::categoryName(record.category);
+		output += "\t";
+		output.append(record.text, record.length);
+		
+		record.sequence.store(dequeuePos + LOGGER_RING_SIZE, std::memory_order_release);
+		dequeuePos++;
+	}
+	
+	uint64_t dropped = overflows.load(std::memory_order_relaxed);
+	
+	if(dropped != overflowsReported) {
+		output += std::to_string((unsigned long long)(dropped - overflowsReported)) + " log messages dropped, the log ring was full\n";
+		overflowsReported = dropped;
+	}
+	
+	if(output.empty())
+		return false;
+	
+	fwrite(output.data(), 1, output.size(), stderr);
+	fflush(stderr);
+	
+	return true;
+}
+
+void LogSink::run() {
+	while(running.load(std::memory_order_relaxed)) {
+		if(!writePending()) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(LOGGER_FLUSH_INTERVAL));
+		}
+	}
+}
+
+void LogSink::stop() {
+	if(!running.exchange(false))
+		return;
+	
+	if(runningThread.joinable())
+		runningThread.join();
+	
+	//The thread is stopped, the messages pushed while it was exiting are written from here
+	writePending();
+}
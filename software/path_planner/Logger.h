@@ -24,26 +24,200 @@
 #define __PathPlanner__Logger__
 
 #include <iostream>
-#include <mutex>
+#include <streambuf>
+#include <atomic>
+#include <thread>
 #include <chrono>
-#include <ctime>
-#include <sstream>
+#include <string>
+#include <stdint.h>
+#include "config.h"
+
+/**
+ * Categories of the log messages, each one has its own level
+ */
+enum LogCategory {
+	LOG_PLANNER,        ///< Path planner: moves queued, planning, metrics
+	LOG_STEPGEN,        ///< Step generation and sending of the moves
+	LOG_PRU,            ///< PRU or virtual PRU, and PruTimer
+	LOG_DDR,            ///< DDR shared with the PRU: blocks written and executed
+	LOG_CATEGORIES_COUNT
+};
+
+/* Levels of the log messages, the same values as the Python logging module */
+#define LOG_LEVEL_DEBUG 10
+#define LOG_LEVEL_INFO 20
+#define LOG_LEVEL_WARNING 30
+#define LOG_LEVEL_ERROR 40
+
+/**
+ * A message waiting in the ring of the LogSink
+ */
+struct LogRecord {
+	std::atomic<uint32_t> sequence;   ///< Position of the record in the ring, see LogSink::push()
+	uint64_t time;                    ///< ms since epoch
+	uint32_t length;
+	uint8_t category;                 ///< LogCategory
+	uint8_t level;
+	char text[LOGGER_RECORD_SIZE];
+};
+
+/**
+ * Writes the log messages to stderr from a background thread. The threads logging only copy their message in a 
+ * lock-free multiple producers single consumer ring, they never wait for the output. When the ring is full the 
+ * message is dropped and counted.
+ */
+class LogSink {
+private:
+	LogRecord records[LOGGER_RING_SIZE];
+	std::atomic<uint32_t> enqueuePos;
+	uint32_t dequeuePos;                        ///< Only used by the consumer
+	std::atomic<uint64_t> overflows;
+	uint64_t overflowsReported;                 ///< Only used by the consumer
+	std::atomic<bool> running;
+	std::thread runningThread;
+	
+	LogSink();
+	
+	void run();
+	
+	/**
+	 * @brief Write the messages in the ring to stderr
+	 * @return true if there were any
+	 */
+	bool writePending();
+	
+	static void stopAtExit();
+	
+public:
+	/**
+	 * @brief Return the sink, started by the first message
+	 * @details It is never destroyed so that the messages logged while the program exits are still valid, the 
+	 * messages left are written by an atexit handler.
+	 */
+	static LogSink& instance();
+	
+	/**
+	 * @brief Queue a message for output, never blocks
+	 * 
+	 * @param time The time of the message in ms since epoch
+	 * @param category The LogCategory of the message
+	 * @param level The level of the message
+	 * @param text The message, truncated to LOGGER_RECORD_SIZE
+	 * @param length The length of the message
+	 */
+	void push(uint64_t time, uint8_t category, uint8_t level, const char* text, size_t length);
+	
+	/**
+	 * @brief Return the number of messages dropped because the ring was full
+	 */
+	uint64_t getOverflows() {
+		return overflows.load(std::memory_order_relaxed);
+	}
+	
+	/**
+	 * @brief Write the messages left and stop the thread, the next messages are written synchronously
+	 */
+	void stop();
+};
+
+/**
+ * Stream buffer writing in a fixed size array, the characters beyond are dropped
+ */
+class LogBuffer : public std::streambuf {
+public:
+	LogBuffer(char* buffer, size_t size) {
+		setp(buffer, buffer + size);
+	}
+	
+	size_t length() const {
+		return pptr() - pbase();
+	}
+};
+
+/**
+ * Limits the messages of a call site to one per interval, see LOG_RATE_LIMITED
+ */
+class LogRateLimit {
+private:
+	std::atomic<uint64_t> next;             ///< steady_clock ms from which the next message is allowed
+	std::atomic<uint32_t> suppressed;
+	
+public:
+	constexpr LogRateLimit() : next(0), suppressed(0) {}
+	
+	/**
+	 * @brief Return true if the message can be logged
+	 * 
+	 * @param intervalMs Minimum time between two messages
+	 * @param suppressedBefore Set to the number of messages dropped since the last one allowed
+	 */
+	bool allow(unsigned int intervalMs, uint32_t& suppressedBefore) {
+		uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		uint64_t allowed = next.load(std::memory_order_relaxed);
+		
+		if(now < allowed || !next.compare_exchange_strong(allowed, now + intervalMs, std::memory_order_relaxed)) {
+			suppressed.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		
+		suppressedBefore = suppressed.exchange(0, std::memory_order_relaxed);
+		return true;
+	}
+};
 
 class Logger {
 private:
-	static std::mutex coutMutex;
+	static std::atomic<int> levels[LOG_CATEGORIES_COUNT];
 	
-	std::stringstream internalStream;
+	char text[LOGGER_RECORD_SIZE];
+	LogBuffer buffer;
+	std::ostream internalStream;
+	uint64_t time;
+	uint8_t category;
+	uint8_t level;
 	
 public:
 	
-	Logger()  {
-		std::chrono::time_point<std::chrono::system_clock> timestamp = std::chrono::system_clock::now();
+	Logger(LogCategory category, int level, uint32_t suppressed = 0) : buffer(text, sizeof(text)), internalStream(&buffer), category(category), level(level) {
+		time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
 		
-		internalStream << "[ " <<  std::chrono::duration_cast<std::chrono::milliseconds>(timestamp.time_since_epoch()).count()
-		<< " ]\t";
+		if(suppressed)
+			internalStream << "(" << suppressed << " similar messages suppressed) ";
+	}
+	
+	/**
+	 * @brief Return true if the messages of the category at this level are logged
+	 */
+	static inline bool isEnabled(LogCategory category, int level) {
+		return level >= levels[category].load(std::memory_order_relaxed);
+	}
+	
+	/**
+	 * @brief Set the minimum level of the messages logged
+	 * 
+	 * @param category The name of the category (planner, stepgen, pru, ddr), or all
+	 * @param level The level, LOG_LEVEL_DEBUG to log everything
+	 * 
+	 * @return false if the category is unknown
+	 */
+	static bool setLevel(const std::string& category, int level);
+	
+	/**
+	 * @brief Set the levels from a specification such as "20" or "warning,pru=debug,ddr=10"
+	 * @details The levels are set at startup from the REDEEM_LOG environment variable.
+	 * 
+	 * @return false if a part of the specification is invalid, the other parts are applied
+	 */
+	static bool setLevels(const std::string& specification);
+	
+	static int getLevel(LogCategory category) {
+		return levels[category].load(std::memory_order_relaxed);
 	}
 	
+	static const char* categoryName(uint8_t category);
+	
+	static const char* levelName(uint8_t level);
+	
 	template <typename TToken>
 	Logger& operator << (const TToken& s) {
 		internalStream << s;
@@ -67,15 +241,25 @@ public:
 	}
 	
 	virtual ~Logger() {
-		std::unique_lock<std::mutex> lk(coutMutex);
-		std::cerr << internalStream.str();
+		LogSink::instance().push(time, category, level, text, buffer.length());
 	}
 };
 
-#ifndef NDEBUG
-#define LOG(x) Logger() << x
-#else
-#define LOG(X)
-#endif
+/* The message is only formatted when its category logs its level, otherwise it costs a branch */
+#define LOG_AT(category, level, x) do { if(Logger::isEnabled(category, level)) { Logger(category, level) << x; } } while(0)
+
+#define LOG_DEBUG(category, x) LOG_AT(category, LOG_LEVEL_DEBUG, x)
+#define LOG_INFO(category, x) LOG_AT(category, LOG_LEVEL_INFO, x)
+#define LOG_WARNING(category, x) LOG_AT(category, LOG_LEVEL_WARNING, x)
+#define LOG_ERROR(category, x) LOG_AT(category, LOG_LEVEL_ERROR, x)
+
+/* At most one message every intervalMs from this call site, for the messages of the hot loops */
+#define LOG_RATE_LIMITED(category, level, intervalMs, x) do { \
+	static LogRateLimit logRateLimit; \
+	uint32_t logSuppressed; \
+	if(Logger::isEnabled(category, level) && logRateLimit.allow(intervalMs, logSuppressed)) { \
+		Logger(category, level, logSuppressed) << x; \
+	} \
+} while(0)
 
 #endif /* defined(__PathPlanner__Logger__) */
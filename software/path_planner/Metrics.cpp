@@ -0,0 +1,189 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#include "Metrics.h"
+
+#include <sstream>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "Logger.h"
+#include "config.h"
+
+static void writeMetric(std::ostringstream& out, const char* name, const char* type, const char* help, double value) {
+	out << "# HELP redeem_planner_" << name << " " << help << "\n";
+	out << "# TYPE redeem_planner_" << name << " " << type << "\n";
+	out << "redeem_planner_" << name << " " << value << "\n";
+}
+
+std::string formatPrometheus(const PlannerMetrics& metrics) {
+	std::ostringstream out;
+	
+	out.precision(12);
+	
+	writeMetric(out, "lines", "gauge", "Moves in the ring of the path planner.", metrics.linesCount);
+	writeMetric(out, "buffer_waits_total", "counter", "Waits for the ring to fill up before printing.", metrics.bufferWaits);
+	writeMetric(out, "buffer_wait_seconds_total", "counter", "Time spent waiting for the ring to fill up.", metrics.bufferWaitTime);
+	writeMetric(out, "low_move_time_wait_seconds_total", "counter", "Time blocked until the PRU needs more moves.", metrics.lowMoveTimeWaitTime);
+	writeMetric(out, "ddr_space_wait_seconds_total", "counter", "Time blocked waiting for space in the DDR.", metrics.ddrSpaceWaitTime);
+	writeMetric(out, "ddr_used_bytes", "gauge", "Bytes of the DDR used by the queued blocks.", metrics.ddrMemUsed);
+	writeMetric(out, "ddr_used_high_water_bytes", "gauge", "Maximum of the bytes of the DDR used.", metrics.ddrMemHighWater);
+	writeMetric(out, "ddr_size_bytes", "gauge", "Size of the DDR shared with the PRU.", metrics.ddrSize);
+	writeMetric(out, "queued_moves_seconds", "gauge", "Time of the moves queued in the PRU.", metrics.queuedMovesTime);
+	writeMetric(out, "queued_moves_min_seconds", "gauge", "Minimum time of the moves queued in the PRU while printing, -1 if none yet.", metrics.queuedMovesTimeMin);
+	writeMetric(out, "starvations_total", "counter", "Times the PRU ran out of moves while printing.", metrics.starvations);
+	writeMetric(out, "moves_total", "counter", "Moves sent to the PRU.", metrics.movesExecuted);
+	writeMetric(out, "steps_total", "counter", "Steps sent to the PRU.", metrics.stepsGenerated);
+	writeMetric(out, "moves_per_second", "gauge", "Moves sent to the PRU per second.", metrics.movesPerSecond);
+	writeMetric(out, "steps_per_second", "gauge", "Steps sent to the PRU per second.", metrics.stepsPerSecond);
+	writeMetric(out, "buffer_target_seconds", "gauge", "Time of the moves kept queued in the PRU.", metrics.bufferTarget);
+	writeMetric(out, "buffer_fill_wait_seconds", "gauge", "Time waited for a new line before printing.", metrics.bufferFillWait);
+	writeMetric(out, "host_latency_seconds", "gauge", "Peak time between the PRU needing moves and the planner pushing them.", metrics.hostLatency);
+	
+	return out.str();
+}
+
+MetricsServer::MetricsServer() {
+	socketFd = -1;
+	running = false;
+}
+
+MetricsServer::~MetricsServer() {
+	stop();
+}
+
+bool MetricsServer::start(const std::string& path, std::function<PlannerMetrics()> snapshot) {
+	stop();
+	
+	struct sockaddr_un address;
+	
+	if(path.size() >= sizeof(address.sun_path)) {
+		LOG_ERROR(LOG_PLANNER, "Metrics socket path too long: " << path << std::endl);
+		return false;
+	}
+	
+	socketFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	
+	if(socketFd < 0) {
+		LOG_ERROR(LOG_PLANNER, "Unable to create the metrics socket: " << strerror(errno) << std::endl);
+		return false;
+	}
+	
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path.c_str());
+	
+	unlink(path.c_str());
+	
+	if(bind(socketFd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(socketFd, METRICS_SOCKET_BACKLOG) < 0) {
+		LOG_ERROR(LOG_PLANNER, "Unable to listen on the metrics socket " << path << ": " << strerror(errno) << std::endl);
+		close(socketFd);
+		socketFd = -1;
+		return false;
+	}
+	
+	this->path = path;
+	this->snapshot = snapshot;
+	running = true;
+	
+	runningThread = std::thread([this]() {
+		this->run();
+	});
+	
+	LOG_INFO(LOG_PLANNER, "Serving the path planner metrics on " << path << std::endl);
+	
+	return true;
+}
+
+void MetricsServer::stop() {
+	if(!running)
+		return;
+	
+	running = false;
+	
+	if(runningThread.joinable())
+		runningThread.join();
+	
+	close(socketFd);
+	socketFd = -1;
+	unlink(path.c_str());
+}
+
+void MetricsServer::run() {
+	struct pollfd listening;
+	listening.fd = socketFd;
+	listening.events = POLLIN;
+	
+	while(running) {
+		//The timeout lets stop() end the thread
+		if(poll(&listening, 1, METRICS_SOCKET_POLL_TIMEOUT) <= 0)
+			continue;
+		
+		int client = accept(socketFd, NULL, NULL);
+		
+		if(client < 0)
+			continue;
+		
+		serve(client);
+		close(client);
+	}
+}
+
+void MetricsServer::serve(int client) {
+	//An HTTP client sends its request first, a plain one such as socat sends nothing
+	struct pollfd request;
+	request.fd = client;
+	request.events = POLLIN;
+	
+	bool http = false;
+	
+	if(poll(&request, 1, METRICS_SOCKET_REQUEST_TIMEOUT) > 0) {
+		char buffer[512];
+		ssize_t length = recv(client, buffer, sizeof(buffer), MSG_DONTWAIT);
+		http = length >= 4 && !memcmp(buffer, "GET ", 4);
+	}
+	
+	std::string body = formatPrometheus(snapshot());
+	std::string response;
+	
+	if(http) {
+		response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+	}
+	
+	response += body;
+	
+	const char* data = response.data();
+	size_t left = response.size();
+	
+	while(left) {
+		ssize_t written = send(client, data, left, MSG_NOSIGNAL);
+		
+		if(written <= 0)
+			break;
+		
+		data += written;
+		left -= written;
+	}
+}
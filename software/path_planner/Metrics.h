@@ -0,0 +1,93 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#ifndef __PathPlanner__Metrics__
+#define __PathPlanner__Metrics__
+
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+/**
+ * Snapshot of the counters of the path planner and of the PRU, returned by PathPlanner::getMetrics().
+ * The times are in seconds, the counters count since the path planner was created.
+ */
+struct PlannerMetrics {
+	uint64_t linesCount;             ///< Moves in the ring of the path planner
+	uint64_t bufferWaits;            ///< Times run() waited for the ring to fill up before printing
+	double bufferWaitTime;           ///< Time spent in these waits
+	double lowMoveTimeWaitTime;      ///< Time blocked in waitUntilLowMoveTime(), the PRU has enough moves queued
+	double ddrSpaceWaitTime;         ///< Time blocked in push_block() waiting for space in the DDR
+	uint64_t ddrMemUsed;             ///< Bytes of the DDR used by the queued blocks
+	uint64_t ddrMemHighWater;        ///< Maximum of ddrMemUsed
+	uint64_t ddrSize;                ///< Size of the DDR shared with the PRU
+	double queuedMovesTime;          ///< Time of the moves queued in the PRU
+	double queuedMovesTimeMin;       ///< Minimum of queuedMovesTime while more moves were waiting to be sent, -1 if none yet
+	uint64_t starvations;            ///< Times the PRU ran out of moves while more moves were waiting to be sent
+	uint64_t movesExecuted;          ///< Moves sent to the PRU
+	uint64_t stepsGenerated;         ///< Steps of the primary axis of the moves sent to the PRU
+	double movesPerSecond;           ///< Moves sent to the PRU per second, over the last METRICS_RATE_INTERVAL
+	double stepsPerSecond;           ///< Steps sent to the PRU per second, over the last METRICS_RATE_INTERVAL
+	double bufferTarget;             ///< Time of the moves run() keeps queued in the PRU, see setAdaptiveBuffering()
+	double bufferFillWait;           ///< Time run() waits for a new line before printing
+	double hostLatency;              ///< Peak time between the PRU needing moves and run() pushing them, 0 if not adaptive
+};
+
+/**
+ * @brief Format the metrics in the Prometheus text exposition format
+ */
+std::string formatPrometheus(const PlannerMetrics& metrics);
+
+/**
+ * Serves the metrics on a local Unix socket: each client connecting receives the metrics in the Prometheus text 
+ * format, behind an HTTP header if it sent an HTTP request, then the connection is closed.
+ */
+class MetricsServer {
+private:
+	std::string path;
+	int socketFd;
+	std::thread runningThread;
+	std::atomic<bool> running;
+	std::function<PlannerMetrics()> snapshot;
+	
+	void run();
+	void serve(int client);
+	
+public:
+	MetricsServer();
+	~MetricsServer();
+	
+	/**
+	 * @brief Start serving the metrics
+	 *
+	 * @param path The path of the socket, an existing file at this path is replaced
+	 * @param snapshot Returns the metrics, called from the thread of the server
+	 * @return false if the socket cannot be created
+	 */
+	bool start(const std::string& path, std::function<PlannerMetrics()> snapshot);
+	
+	void stop();
+};
+
+#endif /* defined(__PathPlanner__Metrics__) */
@@ -0,0 +1,153 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#include <cmath>
+#include <algorithm>
+#include <assert.h>
+#include "MoveSegmenter.h"
+#include "Path.h"
+
+MoveSegmenter::MoveSegmenter() {
+	kinematics = 0;
+	segments = 0;
+	segment = 0;
+}
+
+bool MoveSegmenter::begin(const Kinematics* kinematics, const float start[NUM_AXIS], const float target[NUM_AXIS], float speed, 
+						  const float stepsPerMeter[NUM_AXIS], const float maxFeedrate[NUM_MOVING_AXIS]) {
+	double motors[NUM_MOVING_AXIS];
+	double length = 0;
+	
+	this->kinematics = kinematics;
+	this->speed = speed;
+	segments = 0;
+	segment = 0;
+	
+	for(int i=0; i<NUM_AXIS; i++) {
+		this->start[i] = start[i];
+		vec[i] = (double)target[i] - start[i];
+		this->stepsPerMeter[i] = stepsPerMeter[i];
+	}
+	for(int i=0; i<NUM_MOVING_AXIS; i++) {
+		this->maxFeedrate[i] = maxFeedrate[i];
+		length += vec[i]*vec[i];
+	}
+	length = sqrt(length);
+	
+	if(!kinematics->inverse(this->start, motors))
+		return false;
+	
+	for(int i=0; i<NUM_MOVING_AXIS; i++) {
+		position[i] = llround(motors[i]*this->stepsPerMeter[i]);
+	}
+	for(int i=NUM_MOVING_AXIS; i<NUM_AXIS; i++) {
+		position[i] = llround(this->start[i]*this->stepsPerMeter[i]);
+	}
+	
+	//Segments per second, but not shorter than the minimum length
+	double duration = speed > 0 ? length/speed : 0;
+	double count = std::min(ceil(duration*DELTA_SEGMENTS_PER_SECOND), floor(length/DELTA_MIN_SEGMENT_LENGTH));
+	segments = (unsigned int)std::max(count, 1.0);
+	segmentLength = length/segments;
+	
+	return true;
+}
+
+unsigned int MoveSegmenter::next(SegmentMove* moves, unsigned int count) {
+	double x[DELTA_SEGMENTS_BATCH], y[DELTA_SEGMENTS_BATCH], z[DELTA_SEGMENTS_BATCH];
+	double a[DELTA_SEGMENTS_BATCH], b[DELTA_SEGMENTS_BATCH], c[DELTA_SEGMENTS_BATCH];
+	const double* const cartesian[NUM_MOVING_AXIS] = {x, y, z};
+	double* const motors[NUM_MOVING_AXIS] = {a, b, c};
+	
+	assert(count <= DELTA_SEGMENTS_BATCH);
+	count = std::min(count, segments - segment);
+	
+	if(!count)
+		return 0;
+	
+	for(unsigned int n=0; n<count; n++) {
+		double t = (double)(segment + n + 1)/segments;
+		x[n] = start[X_AXIS] + vec[X_AXIS]*t;
+		y[n] = start[Y_AXIS] + vec[Y_AXIS]*t;
+		z[n] = start[Z_AXIS] + vec[Z_AXIS]*t;
+	}
+	
+	if(!kinematics->inverseBatch(cartesian, motors, count)) {
+		//The rest of the move cannot be reached, stop at the end of the previous segment
+		segments = segment;
+		return 0;
+	}
+	
+	for(unsigned int n=0; n<count; n++) {
+		SegmentMove& move = moves[n];
+		double t = (double)(segment + n + 1)/segments;
+		double motorLength = 0;
+		double time = segmentLength/speed;
+		
+		for(int i=0; i<NUM_AXIS; i++) {
+			double target = i < NUM_MOVING_AXIS ? motors[i][n] : start[i] + vec[i]*t;
+			int64_t steps = llround(target*stepsPerMeter[i]);
+			
+			move.motorVec[i] = (steps - position[i])/stepsPerMeter[i];
+			move.steps[i] = std::abs(steps - position[i]);
+			position[i] = steps;
+		}
+		
+		for(int i=0; i<NUM_MOVING_AXIS; i++) {
+			//The carriages move faster than the head close to the towers
+			time = std::max(time, fabs(move.motorVec[i])/maxFeedrate[i]);
+			motorLength += move.motorVec[i]*move.motorVec[i];
+		}
+		
+		//Same distance as the one of the path planner, the extruder alone moves at the speed of the move
+		motorLength = std::max(sqrt(motorLength), (double)fabs(move.motorVec[E_AXIS]));
+		if(segmentLength == 0)
+			time = motorLength/speed;
+		
+		move.speed = time > 0 ? motorLength/time : speed;
+	}
+	
+	segment += count;
+	
+	return count;
+}
+
+bool MoveSegmenter::getPosition(float position[NUM_AXIS]) const {
+	double motors[NUM_MOVING_AXIS];
+	double cartesian[NUM_MOVING_AXIS];
+	
+	for(int i=0; i<NUM_MOVING_AXIS; i++) {
+		motors[i] = this->position[i]/stepsPerMeter[i];
+	}
+	
+	if(!kinematics->forward(motors, cartesian))
+		return false;
+	
+	for(int i=0; i<NUM_MOVING_AXIS; i++) {
+		position[i] = cartesian[i];
+	}
+	for(int i=NUM_MOVING_AXIS; i<NUM_AXIS; i++) {
+		position[i] = this->position[i]/stepsPerMeter[i];
+	}
+	
+	return true;
+}
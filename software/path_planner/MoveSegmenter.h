@@ -0,0 +1,114 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#ifndef __PathPlanner__MoveSegmenter__
+#define __PathPlanner__MoveSegmenter__
+
+#include <stdint.h>
+#include "Kinematics.h"
+#include "config.h"
+
+/**
+ * A segment of a move, in the units of PathPlanner::queueMove()
+ */
+struct SegmentMove {
+	float motorVec[NUM_AXIS];           ///< Move of each motor in meters, a whole number of steps
+	float steps[NUM_AXIS];              ///< Number of steps of each motor
+	float speed;                        ///< Speed of the motors in m/s, so that the head moves at the speed of the move
+};
+
+/**
+ * Split a straight move of the head into segments for the kinematics whose motors do not move in straight lines.
+ *
+ * The move is split in DELTA_SEGMENTS_PER_SECOND segments per second, but not in segments shorter than 
+ * DELTA_MIN_SEGMENT_LENGTH. The motor positions of the ends of the segments are computed DELTA_SEGMENTS_BATCH at 
+ * a time with Kinematics::inverseBatch(), and rounded to whole steps from the absolute positions so that the 
+ * rounding errors do not add up along the move.
+ *
+ * The speed of each segment is lowered where a carriage would exceed its maximum feedrate, which happens when 
+ * the head gets close to a tower of a Delta.
+ */
+class MoveSegmenter {
+private:
+	const Kinematics* kinematics;
+	double stepsPerMeter[NUM_AXIS];
+	double maxFeedrate[NUM_MOVING_AXIS];
+	
+	double start[NUM_AXIS];
+	double vec[NUM_AXIS];
+	double segmentLength;               ///< Length of the move of the head in each segment
+	float speed;
+	unsigned int segments;
+	unsigned int segment;               ///< Number of segments already returned
+	
+	int64_t position[NUM_AXIS];         ///< Position of the motors at the end of the last segment, in steps
+	
+public:
+	MoveSegmenter();
+	
+	/**
+	 * @brief Start splitting a move
+	 *
+	 * @param kinematics The kinematics of the printer
+	 * @param start The position of the head at the start of the move, in meters
+	 * @param target The position of the head at the end of the move, in meters
+	 * @param speed The speed of the head in m/s
+	 * @param stepsPerMeter The number of steps per meter of each motor
+	 * @param maxFeedrate The maximum speed of each moving axis motor in m/s
+	 * @return false if the start of the move cannot be reached
+	 */
+	bool begin(const Kinematics* kinematics, const float start[NUM_AXIS], const float target[NUM_AXIS], float speed, 
+			   const float stepsPerMeter[NUM_AXIS], const float maxFeedrate[NUM_MOVING_AXIS]);
+	
+	/**
+	 * @brief Compute the next segments of the move
+	 *
+	 * @param moves The segments
+	 * @param count The maximum number of segments to compute, at most DELTA_SEGMENTS_BATCH
+	 * @return The number of segments computed, 0 once the move is done or when the rest of it cannot be reached
+	 */
+	unsigned int next(SegmentMove* moves, unsigned int count);
+	
+	/**
+	 * @brief Return the position of the head at the end of the segments computed so far, once rounded to whole steps
+	 *
+	 * @param position The position in meters
+	 * @return false if the position cannot be computed
+	 */
+	bool getPosition(float position[NUM_AXIS]) const;
+	
+	/**
+	 * @brief Return true if the whole move has been split
+	 */
+	inline bool isDone() const {
+		return segment == segments;
+	}
+	
+	/**
+	 * @brief Return the number of segments of the move
+	 */
+	inline unsigned int getSegmentsCount() const {
+		return segments;
+	}
+};
+
+#endif /* defined(__PathPlanner__MoveSegmenter__) */
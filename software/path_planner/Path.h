@@ -31,6 +31,7 @@
 #include <atomic>
 #include "config.h"
 #include "StepperCommand.h"
+#include "CommandArena.h"
 
 #define FLAG_WARMUP 1
 #define FLAG_NOMINAL 2
@@ -39,8 +40,13 @@
 #define FLAG_CHECK_ENDSTOPS 16
 #define FLAG_SKIP_ACCELERATING 32
 #define FLAG_SKIP_DEACCELERATING 64
-#define FLAG_BLOCKED 128
 #define FLAG_CANCELABLE 256
+#define FLAG_COMMANDS_GENERATING 512
+#define FLAG_COMMANDS_GENERATED 1024
+/** The bits of the flags above this one hold the low bits of the sequence number of the line in the slot, so that a 
+ * claim on a slot reused by a newer line fails */
+#define FLAG_LINE_SHIFT 12
+#define FLAG_LINE_MASK 0xFFFFF
 
 /** Are the step parameter computed */
 #define FLAG_JOIN_STEPPARAMS_COMPUTED 1
@@ -158,17 +164,40 @@ private:
     {
         return (dir & 136)==136;
     }
-    inline void block()
+    inline bool isFixed()
     {
-        flags |= FLAG_BLOCKED;
+        return isStartSpeedFixed() && isEndSpeedFixed() && areParameterUpToDate();
     }
-    inline void unblock()
+    /** Start the flags of the line with this sequence number, before writing the rest of the line */
+    inline void resetFlags(uint32_t line)
     {
-        flags &= ~FLAG_BLOCKED;
+        flags = (uint_fast32_t)(line & FLAG_LINE_MASK) << FLAG_LINE_SHIFT;
     }
-    inline bool isBlocked()
+    /** Reserve the generation of the commands of the line with this sequence number, return false if they are already 
+     * generated or being generated, or if the slot holds another line */
+    inline bool claimCommandsGeneration(uint32_t line)
     {
-        return flags & FLAG_BLOCKED;
+        uint_fast32_t current = flags;
+        do {
+            if(((current >> FLAG_LINE_SHIFT) & FLAG_LINE_MASK) != (line & FLAG_LINE_MASK))
+                return false;
+            if(current & (FLAG_COMMANDS_GENERATING | FLAG_COMMANDS_GENERATED))
+                return false;
+        } while(!flags.compare_exchange_weak(current, current | FLAG_COMMANDS_GENERATING));
+        return true;
+    }
+    inline void setCommandsGenerated()
+    {
+        flags |= FLAG_COMMANDS_GENERATED;
+    }
+    inline bool areCommandsGenerated()
+    {
+        return flags & FLAG_COMMANDS_GENERATED;
+    }
+    /** The commands of the long moves are generated chunk by chunk while being sent instead of in advance */
+    inline bool isStreamed()
+    {
+        return stepsRemaining > COMMAND_STREAMING_STEPS;
     }
     inline bool isCheckEndstops()
     {
@@ -308,8 +337,8 @@ private:
 	void updateStepsParameter();
 	
 	
-	SteppersCommand *commands;
-	size_t commandBufferSize;
+	CommandChunk *commands;          ///< Chunks of the command arena holding the commands generated for this line
+	size_t commandsCount;            ///< Number of commands generated in commands, repeated steps are merged in one command
 	
 public:
 	
@@ -25,6 +25,10 @@
  */
 
 #include "PathPlanner.h"
+#include "StepperTrapezoid.h"
+#include "StepGenerator.h"
+#include "CommandStream.h"
+#include "Trace.h"
 #include <cmath>
 #include <assert.h>
 #include <thread>
@@ -120,6 +124,27 @@ void PathPlanner::setAxisStepsPerMeter(unsigned long stepPerM[NUM_MOVING_AXIS])
 	recomputeParameters();
 }
 
+void PathPlanner::setAxisConfig(int axisConfig) {
+	switch(axisConfig) {
+		case AXIS_CONFIG_H_BELT:
+			kinematics = &hBeltKinematics;
+			break;
+		case AXIS_CONFIG_CORE_XY:
+			kinematics = &coreXYKinematics;
+			break;
+		case AXIS_CONFIG_DELTA:
+			kinematics = &deltaKinematics;
+			break;
+		default:
+			kinematics = &cartesianKinematics;
+			break;
+	}
+}
+
+void PathPlanner::setDeltaKinematics(float L, float r, float Ae, float Be, float Ce, float Hez) {
+	deltaKinematics = DeltaKinematics(L, r, Ae, Be, Ce, Hez);
+}
+
 void PathPlanner::recomputeParameters() {
 	for(uint8_t i=0; i<NUM_MOVING_AXIS; i++)
     {
@@ -138,9 +163,11 @@ void PathPlanner::recomputeParameters() {
 
 }
 
-PathPlanner::PathPlanner() {
-	linesPos = 0;
+PathPlanner::PathPlanner() : deltaKinematics(0.135, 0.144, 0.026, 0.026, 0.026, 0.0) {
+	linesQueued = 0;
+	linesExecuted = 0;
 	linesWritePos = 0;
+	planSequence = 0;
 	
 	//Default settings for debug mode
 
@@ -155,11 +182,29 @@ PathPlanner::PathPlanner() {
 	
 	recomputeParameters();
 	
-	linesCount = 0;
-	
 	currentExtruder = &extruders[0];
 	
+	kinematics = &cartesianKinematics;
+	arcTolerance = ARC_CHORD_TOLERANCE;
+	
+	queuedLinesTime = 0;
+	bufferWaits = 0;
+	bufferWaitTime = 0;
+	movesExecuted = 0;
+	stepsGenerated = 0;
+	rateTime = std::chrono::steady_clock::now();
+	rateMoves = 0;
+	rateSteps = 0;
+	movesPerSecond = 0;
+	stepsPerSecond = 0;
+	bzero(position, sizeof(position));
+	
 	stop = false;
+	trapezoidCommands = false;
+	incrementalRamp = INCREMENTAL_RAMP_DEFAULT;
+	
+	unsigned int cores = std::thread::hardware_concurrency();
+	generationWorkersCount = cores > 1 ? cores - 1 : 0;
 	bzero(lines, sizeof(lines));
 }
 
@@ -169,16 +214,207 @@ void PathPlanner::queueMove(float axis_diff[NUM_AXIS], float num_steps[NUM_AXIS]
 	Py_BEGIN_ALLOW_THREADS
 #endif
 	
-	// wait for the worker
-    {
-        std::unique_lock<std::mutex> lk(line_mutex);
-		//LOG( "Waiting for free move command space... Current: " << linesCount << std::endl);
-        lineAvailable.wait(lk, [this]{return linesCount<MOVE_CACHE_SIZE || stop;});
-    }
+	queueLine(axis_diff, num_steps, speed, cancelable, optimize);
+	
+#ifdef BUILD_PYTHON_EXT
+	Py_END_ALLOW_THREADS
+#endif
+}
+
+void PathPlanner::queueMoves(const float* axisDiffs, const float* numSteps, const float* speeds, const uint8_t* flags, unsigned int count) {
+	
+	//Called without the GIL by the Python binding, the arrays stay owned by the caller
+	for(unsigned int i=0; i<count && !stop; i++) {
+		float axis_diff[NUM_AXIS];
+		memcpy(axis_diff, axisDiffs + i*NUM_AXIS, sizeof(axis_diff));
+		
+		queueLine(axis_diff, numSteps + i*NUM_AXIS, speeds[i], flags[i] & MOVE_FLAG_CANCELABLE, flags[i] & MOVE_FLAG_OPTIMIZE);
+	}
+}
+
+void PathPlanner::queueMoveTo(float target[NUM_AXIS], float speed, bool cancelable, bool optimize) {
+
+#ifdef BUILD_PYTHON_EXT
+	Py_BEGIN_ALLOW_THREADS
+#endif
+	
+	queueCartesianLine(target, speed, cancelable, optimize);
+	
+#ifdef BUILD_PYTHON_EXT
+	Py_END_ALLOW_THREADS
+#endif
+}
+
+void PathPlanner::queueCartesianLine(const float target[NUM_AXIS], float speed, bool cancelable, bool optimize) {
+	float vec[NUM_AXIS];
+	float motorVec[NUM_AXIS];
+	float num_steps[NUM_AXIS];
+	
+	if(kinematics->needsSegmentation()) {
+		queueSegments(target, speed, cancelable, optimize);
+		return;
+	}
+	
+	for(uint8_t axis=0; axis < NUM_AXIS; axis++) {
+		vec[axis] = target[axis] - position[axis];
+	}
+	
+	if(!kinematics->transformVector(position, vec, motorVec)) {
+		LOG_WARNING(LOG_PLANNER, "Cannot reach " << target[X_AXIS] << " " << target[Y_AXIS] << " " << target[Z_AXIS] << ", move ignored" << std::endl);
+		return;
+	}
+	
+	//Round the motors to the nearest whole steps, axisStepsPerMM is in steps per mm. The position is always on a step, 
+	//rounding up would turn the float error of an axis that doesn't move into a step forth and back.
+	for(uint8_t axis=0; axis < NUM_AXIS; axis++) {
+		float stepsPerMeter = axisStepsPerMM[axis]*1000.0;
+		float steps = roundf(motorVec[axis]*stepsPerMeter);
+		num_steps[axis] = fabsf(steps);
+		motorVec[axis] = steps/stepsPerMeter;
+	}
+	
+	//The position actually reached once rounded
+	if(!kinematics->reverseTransformVector(position, motorVec, vec)) {
+		LOG_WARNING(LOG_PLANNER, "Cannot reach " << target[X_AXIS] << " " << target[Y_AXIS] << " " << target[Z_AXIS] << ", move ignored" << std::endl);
+		return;
+	}
+	
+	for(uint8_t axis=0; axis < NUM_AXIS; axis++) {
+		position[axis] += vec[axis];
+	}
+	
+	queueLine(motorVec, num_steps, speed, cancelable, optimize);
+}
+
+void PathPlanner::queueSegments(const float target[NUM_AXIS], float speed, bool cancelable, bool optimize) {
+	float stepsPerMeter[NUM_AXIS];
+	float maxMotorFeedrate[NUM_MOVING_AXIS];
+	SegmentMove moves[DELTA_SEGMENTS_BATCH];
+	unsigned int count;
+	
+	//Here the units are meters, the path planner ones are mm
+	for(uint8_t axis=0; axis < NUM_AXIS; axis++) {
+		stepsPerMeter[axis] = axisStepsPerMM[axis]*1000.0;
+	}
+	for(uint8_t axis=0; axis < NUM_MOVING_AXIS; axis++) {
+		maxMotorFeedrate[axis] = maxFeedrate[axis]/1000.0;
+	}
+	
+	if(!segmenter.begin(kinematics, position, target, speed, stepsPerMeter, maxMotorFeedrate)) {
+		LOG_WARNING(LOG_PLANNER, "Cannot reach " << position[X_AXIS] << " " << position[Y_AXIS] << " " << position[Z_AXIS] << ", move ignored" << std::endl);
+		return;
+	}
+	
+	//The segments go to the lookahead queue as soon as they are computed
+	while(!stop && (count = segmenter.next(moves, DELTA_SEGMENTS_BATCH))) {
+		for(unsigned int i=0; i<count; i++) {
+			queueLine(moves[i].motorVec, moves[i].steps, moves[i].speed, cancelable, optimize);
+		}
+	}
+	
+	if(!segmenter.isDone()) {
+		LOG_WARNING(LOG_PLANNER, "Cannot reach " << target[X_AXIS] << " " << target[Y_AXIS] << " " << target[Z_AXIS] << ", move stopped" << std::endl);
+	}
+	
+	segmenter.getPosition(position);
+}
+
+void PathPlanner::queueArc(float target[NUM_AXIS], float offsetI, float offsetJ, bool clockwise, float speed, bool cancelable, bool optimize) {
+
+#ifdef BUILD_PYTHON_EXT
+	Py_BEGIN_ALLOW_THREADS
+#endif
+	
+	queueCartesianArc(target, offsetI, offsetJ, clockwise, speed, cancelable, optimize);
 	
 #ifdef BUILD_PYTHON_EXT
 	Py_END_ALLOW_THREADS
 #endif
+}
+
+void PathPlanner::queueArcRadius(float target[NUM_AXIS], float radius, bool clockwise, float speed, bool cancelable, bool optimize) {
+	float x = target[X_AXIS] - position[X_AXIS];
+	float y = target[Y_AXIS] - position[Y_AXIS];
+	float distance = sqrtf(x*x + y*y);
+	float height = 4*radius*radius - x*x - y*y;
+	
+	//A half circle can end a little further than the diameter once the start is rounded to whole steps
+	if(distance == 0 || distance > 2*fabsf(radius) + arcTolerance) {
+		LOG_WARNING(LOG_PLANNER, "Arc radius " << radius << " too small for the move, move ignored" << std::endl);
+		return;
+	}
+	
+	//Distance of the center from the middle of the chord, relative to the chord length
+	float h = -sqrtf(std::max(height, 0.0f))/distance;
+	
+	if(!clockwise)
+		h = -h;
+	
+	//Negative radius for the arcs longer than a half circle
+	if(radius < 0)
+		h = -h;
+	
+	queueArc(target, 0.5f*(x - y*h), 0.5f*(y + x*h), clockwise, speed, cancelable, optimize);
+}
+
+void PathPlanner::queueCartesianArc(const float target[NUM_AXIS], float offsetI, float offsetJ, bool clockwise, float speed, bool cancelable, bool optimize) {
+	float start[NUM_AXIS];
+	float chord[NUM_AXIS];
+	
+	memcpy(start, position, sizeof(start));
+	
+	float centerX = start[X_AXIS] + offsetI;
+	float centerY = start[Y_AXIS] + offsetJ;
+	float radius = sqrtf(offsetI*offsetI + offsetJ*offsetJ);
+	
+	//Vectors from the center to the start and to the target
+	float startX = -offsetI;
+	float startY = -offsetJ;
+	float targetX = target[X_AXIS] - centerX;
+	float targetY = target[Y_AXIS] - centerY;
+	
+	float angularTravel = atan2f(startX*targetY - startY*targetX, startX*targetX + startY*targetY);
+	if(clockwise) {
+		if(angularTravel >= -1e-6f)
+			angularTravel -= 2*M_PI;
+	} else {
+		if(angularTravel <= 1e-6f)
+			angularTravel += 2*M_PI;
+	}
+	
+	//Angle of the chords whose sagitta is the tolerance
+	unsigned int segments = 1;
+	if(radius > arcTolerance) {
+		float segmentAngle = 2*acosf(1 - arcTolerance/radius);
+		segments = std::max(1.0f, ceilf(fabsf(angularTravel)/segmentAngle));
+	}
+	
+	float startAngle = atan2f(startY, startX);
+	
+	for(unsigned int i=1; i<segments && !stop; i++) {
+		float t = (float)i/segments;
+		float angle = startAngle + angularTravel*t;
+		
+		chord[X_AXIS] = centerX + radius*cosf(angle);
+		chord[Y_AXIS] = centerY + radius*sinf(angle);
+		for(uint8_t axis=Z_AXIS; axis < NUM_AXIS; axis++) {
+			chord[axis] = start[axis] + (target[axis] - start[axis])*t;
+		}
+		
+		queueCartesianLine(chord, speed, cancelable, optimize);
+	}
+	
+	//The last chord ends exactly on the target
+	queueCartesianLine(target, speed, cancelable, optimize);
+}
+
+void PathPlanner::queueLine(float axis_diff[NUM_AXIS], const float num_steps[NUM_AXIS], float speed, bool cancelable, bool optimize) {
+	
+	TRACE_SCOPE(TRACE_QUEUE_MOVE, linesQueued);
+
+	// wait for the worker, only blocks when the ring is full
+	//LOG( "Waiting for free move command space... Current: " << linesCount() << std::endl);
+	linesExecutedEvent.waitUntil([this]{return linesCount()<MOVE_CACHE_SIZE || stop;});
 	
 	if(stop) 
         return;
@@ -187,7 +423,7 @@ void PathPlanner::queueMove(float axis_diff[NUM_AXIS], float num_steps[NUM_AXIS]
 	
 	p->speed = speed*1000; //Speed is in m/s
     p->joinFlags = 0;
-	p->flags = 0;
+	p->resetFlags(linesQueued);
 	p->setCancelable(cancelable);
 	p->setWaitMS(optimize ? PRINT_MOVE_BUFFER_WAIT : 0);
     p->dir = 0;
@@ -207,7 +443,7 @@ void PathPlanner::queueMove(float axis_diff[NUM_AXIS], float num_steps[NUM_AXIS]
 	
     if(p->isNoMove())
 	{
-		LOG( "Warning: no move path" << std::endl);
+		LOG_WARNING(LOG_PLANNER, "No move path" << std::endl);
 		return; // No steps included
 	}
 	   
@@ -241,14 +477,16 @@ void PathPlanner::queueMove(float axis_diff[NUM_AXIS], float num_steps[NUM_AXIS]
 	if(linesWritePos>=MOVE_CACHE_SIZE)
 		linesWritePos = 0;
 	
-	// send data to the worker thread
-    {
-        std::lock_guard<std::mutex> lk(line_mutex);
-        linesCount++;
-    }
-    lineAvailable.notify_all();
+	queuedLinesTime += p->timeInTicks;
+	bufferController.lineQueued();
+	
+	// send data to the worker thread, the line has to be fully written before being published
+	linesQueued++;
 	
-	LOG( "End queuing move command" << std::endl);
+	linesQueuedEvent.notifyAll();
+	generationNeeded.notifyAll();
+	
+	LOG_DEBUG(LOG_PLANNER, "End queuing move command" << std::endl);
 }
 
 float PathPlanner::safeSpeed(Path* p)
@@ -373,7 +611,7 @@ void PathPlanner::calculateMove(Path* p,float axis_diff[NUM_AXIS])
             slowest_axis_plateau_time_repro = std::min(slowest_axis_plateau_time_repro,(float)axisInterval[i] * (float)accel[i]); //  steps/s^2 * step/tick  Ticks/s^2
     }
     // Errors for delta move are initialized in timer (except extruder)
-    p->error[0] = p->error[1] = p->error[2] = p->delta[p->primaryAxis] >> 1;
+    p->error[0] = p->error[1] = p->error[2] = p->error[3] = p->delta[p->primaryAxis] >> 1;
     p->invFullSpeed = 1.0/p->fullSpeed;
     p->accelerationPrim = slowest_axis_plateau_time_repro / axisInterval[p->primaryAxis]; // a = v/t = F_CPU/(c*t): Steps/s^2
     //Now we can calculate the new primary axis acceleration, so that the slowest axis max acceleration is not violated
@@ -386,7 +624,12 @@ void PathPlanner::calculateMove(Path* p,float axis_diff[NUM_AXIS])
 	
     p->vMax = F_CPU / p->fullInterval; // maximum steps per second, we can reach
 
+    //The sequence is odd during the pass, see waitForPlanning()
+    TRACE_BEGIN(TRACE_UPDATE_TRAPEZOIDS, linesQueued);
+    planSequence++;
     updateTrapezoids();
+    planSequence++;
+    TRACE_END(TRACE_UPDATE_TRAPEZOIDS, linesQueued);
     // how much steps on primary axis do we need to reach target feedrate
     //p->plateauSteps = (long) (((float)p->acceleration *0.5f / slowest_axis_plateau_time_repro + p->vMin) *1.01f/slowest_axis_plateau_time_repro);
 	
@@ -433,10 +676,9 @@ void Path::updateStepsParameter()
 void PathPlanner::updateTrapezoids()
 {
 	unsigned int first = linesWritePos;
-    Path *firstLine;
     Path *act = &lines[linesWritePos];
     //BEGIN_INTERRUPT_PROTECTED;
-    unsigned int maxfirst = linesPos; // first non fixed segment
+    unsigned int maxfirst = lineIndex(linesExecuted); // first non fixed segment
     if(maxfirst != linesWritePos)
         nextPlannerIndex(maxfirst); // don't touch the line printing
 
@@ -447,20 +689,14 @@ void PathPlanner::updateTrapezoids()
         nextPlannerIndex(first);
     if(first == linesWritePos)   // Nothing to plan
     {
-        act->block();
-        //ESCAPE_INTERRUPT_PROTECTED
         act->setStartSpeedFixed(true);
         act->updateStepsParameter();
-        act->unblock();
         return;
     }
     // now we have at least one additional move for optimization
     // that is not a wait move
     // First is now the new element or the first element with non fixed end speed.
     // anyhow, the start speed of first is fixed
-    firstLine = &lines[first];
-    firstLine->block(); // don't let printer touch this or following segments during update
-	// END_INTERRUPT_PROTECTED;
     unsigned int previousIndex = linesWritePos;
     previousPlannerIndex(previousIndex);
     Path *previous = &lines[previousIndex];
@@ -471,7 +707,6 @@ void PathPlanner::updateTrapezoids()
         previous->setEndSpeedFixed(true);
         act->setStartSpeedFixed(true);
         act->updateStepsParameter();
-        firstLine->unblock();
         return;
     }
 	
@@ -482,7 +717,6 @@ void PathPlanner::updateTrapezoids()
         previous->setEndSpeedFixed(true);
         act->setStartSpeedFixed(true);
         act->updateStepsParameter();
-        firstLine->unblock();
         return;
     }
     backwardPlanner(linesWritePos,first);
@@ -493,15 +727,10 @@ void PathPlanner::updateTrapezoids()
     do
     {
         lines[first].updateStepsParameter();
-        //BEGIN_INTERRUPT_PROTECTED;
-        lines[first].unblock();  // Flying block to release next used segment as early as possible
         nextPlannerIndex(first);
-        lines[first].block();
-        //END_INTERRUPT_PROTECTED;
     }
     while(first!=linesWritePos);
     act->updateStepsParameter();
-    act->unblock();
 }
 
 void PathPlanner::computeMaxJunctionSpeed(Path *previous,Path *current)
@@ -632,7 +861,15 @@ void PathPlanner::runThread() {
 	
 	pru.runThread();
 	
+	for(unsigned int i=0; i<generationWorkersCount; i++) {
+		generationWorkers.push_back(std::thread([this]() {
+			Tracer::setThreadName("step generation");
+			this->runGenerationWorker();
+		}));
+	}
+	
 	runningThread = std::thread([this]() {
+		Tracer::setThreadName("path planner");
 		this->run();
 	});
 }
@@ -642,22 +879,32 @@ void PathPlanner::stopThread(bool join) {
 	pru.stopThread(join);
 	
 	stop=true;
-	lineAvailable.notify_all();
+	linesQueuedEvent.notifyAll();
+	linesExecutedEvent.notifyAll();
+	generationNeeded.notifyAll();
+	generationDone.notifyAll();
 	if(join && runningThread.joinable()) {
 		runningThread.join();
 	}
+	
+	if(join) {
+		for(std::thread& worker : generationWorkers) {
+			worker.join();
+		}
+		generationWorkers.clear();
+	}
 }
 
 PathPlanner::~PathPlanner() {
+	metricsServer.stop();
+	
 	if(runningThread.joinable()) {
 		stopThread(true);
 	}
 	
 	for(unsigned i = 0;i<MOVE_CACHE_SIZE;i++) {
-		if(lines[i].commands) {
-			delete[] lines[i].commands;
-			lines[i].commands=NULL;
-		}
+		commandArena.release(lines[i].commands);
+		lines[i].commands=NULL;
 	}
 }
 
@@ -666,9 +913,8 @@ void PathPlanner::waitUntilFinished() {
 #ifdef BUILD_PYTHON_EXT
 	Py_BEGIN_ALLOW_THREADS
 #endif
-	std::unique_lock<std::mutex> lk(line_mutex);
-	lineAvailable.wait(lk, [this]{
-        return linesCount==0 || stop;
+	linesExecutedEvent.waitUntil([this]{
+        return linesCount()==0 || stop;
     });
 	
 #ifdef BUILD_PYTHON_EXT
@@ -681,198 +927,402 @@ void PathPlanner::waitUntilFinished() {
 	}
 }
 
+PlannerMetrics PathPlanner::getMetrics() {
+	PlannerMetrics metrics;
+	
+	metrics.linesCount = linesCount();
+	metrics.bufferWaits = bufferWaits;
+	metrics.bufferWaitTime = bufferWaitTime/1e9;
+	metrics.movesExecuted = movesExecuted;
+	metrics.stepsGenerated = stepsGenerated;
+	metrics.bufferTarget = bufferController.getTargetTime()/(double)F_CPU;
+	metrics.bufferFillWait = bufferController.getFillWait()/1000.0;
+	metrics.hostLatency = bufferController.getLatency();
+	
+	pru.getMetrics(metrics);
+	
+	std::lock_guard<std::mutex> lk(metricsMutex);
+	
+	auto now = std::chrono::steady_clock::now();
+	double elapsed = std::chrono::duration_cast<std::chrono::duration<double> >(now - rateTime).count();
+	
+	if(elapsed*1000 >= METRICS_RATE_INTERVAL) {
+		movesPerSecond = (metrics.movesExecuted - rateMoves)/elapsed;
+		stepsPerSecond = (metrics.stepsGenerated - rateSteps)/elapsed;
+		rateTime = now;
+		rateMoves = metrics.movesExecuted;
+		rateSteps = metrics.stepsGenerated;
+	}
+	
+	metrics.movesPerSecond = movesPerSecond;
+	metrics.stepsPerSecond = stepsPerSecond;
+	
+	return metrics;
+}
+
+bool PathPlanner::startMetricsServer(const std::string& path) {
+	return metricsServer.start(path, [this]() {
+		return this->getMetrics();
+	});
+}
+
+void PathPlanner::stopMetricsServer() {
+	metricsServer.stop();
+}
+
 void PathPlanner::reset() {
 	pru.reset();
 }
 
+void PathPlanner::buildTrapezoid(Path* cur, SteppersTrapezoid& trapezoid, uint8_t directionMask, uint8_t cancellableMask) {
+	trapezoid.step = 0;
+	trapezoid.direction = directionMask;
+	trapezoid.cancellableMask = cancellableMask;
+	trapezoid.options = STEPPER_COMMAND_OPTION_TRAPEZOID;
+	trapezoid.steps = cur->stepsRemaining;
+	
+	bzero(trapezoid.delta, sizeof(trapezoid.delta));
+	trapezoid.delta[X_AXIS] = cur->isXMove() ? cur->delta[X_AXIS] : 0;
+	trapezoid.delta[Y_AXIS] = cur->isYMove() ? cur->delta[Y_AXIS] : 0;
+	trapezoid.delta[Z_AXIS] = cur->isZMove() ? cur->delta[Z_AXIS] : 0;
+	trapezoid.delta[currentExtruder->stepperCommandPosition] = cur->isEMove() ? cur->delta[E_AXIS] : 0;
+	
+	for(unsigned int i=0; i<NUM_STEPPERS; i++) {
+		if(trapezoid.delta[i])
+			trapezoid.step |= (1 << i);
+	}
+	
+	trapezoid.accelSteps = cur->accelSteps;
+	trapezoid.decelSteps = cur->decelSteps;
+	trapezoid.vStart = cur->vStart;
+	trapezoid.vMax = cur->vMax;
+	trapezoid.vEnd = cur->vEnd;
+	trapezoid.fAcceleration = cur->fAcceleration;
+	trapezoid.fullInterval = cur->fullInterval;
+}
+
+void PathPlanner::stepperMasks(Path* cur, uint8_t& directionMask, uint8_t& cancellableMask) {
+	directionMask = 0; //0b000HEZYX
+	directionMask|=((uint8_t)cur->isXPositiveMove() << X_AXIS);
+	directionMask|=((uint8_t)cur->isYPositiveMove() << Y_AXIS);
+	directionMask|=((uint8_t)cur->isZPositiveMove() << Z_AXIS);
+	directionMask|=((uint8_t)cur->isEPositiveMove() << currentExtruder->stepperCommandPosition);
+	
+	cancellableMask = 0;
+	
+	if(cur->isCancelable()) {
+		cancellableMask|=((uint8_t)cur->isXMove() << X_AXIS);
+		cancellableMask|=((uint8_t)cur->isYMove() << Y_AXIS);
+		cancellableMask|=((uint8_t)cur->isZMove() << Z_AXIS);
+		cancellableMask|=((uint8_t)cur->isEMove() << currentExtruder->stepperCommandPosition);
+	}
+}
+
+void PathPlanner::generateCommands(Path* cur, size_t reservedChunks) {
+	TRACE_SCOPE(TRACE_STEP_GENERATION, cur->stepsRemaining);
+	
+	SteppersTrapezoid trapezoid;
+	uint8_t directionMask;
+	uint8_t cancellableMask;
+	
+	stepperMasks(cur, directionMask, cancellableMask);
+	
+	//The chunks are released once sent, there should be none left
+	commandArena.release(cur->commands);
+	cur->commands = commandArena.allocate(reservedChunks > 0);
+	if(reservedChunks)
+		reservedChunks--;
+	
+	CommandChunk* chunk = cur->commands;
+	
+	buildTrapezoid(cur, trapezoid, directionMask, cancellableMask);
+	
+	CommandStream stream(trapezoid, &rampCache, incrementalRamp ? RAMP_INCREMENTAL : RAMP_TIMER, cur->accelerationPrim);
+	
+	cur->commandsCount = 0;
+	
+	while(stream.fill(chunk)) {
+		cur->commandsCount += chunk->count;
+		chunk->next = commandArena.allocate(reservedChunks > 0);
+		if(reservedChunks)
+			reservedChunks--;
+		chunk = chunk->next;
+	}
+	cur->commandsCount += chunk->count;
+	
+	//The repeated commands can make the line use less chunks than reserved
+	commandArena.cancelReservation(reservedChunks);
+	
+#ifdef CHECK_TRAPEZOID_COMMANDS
+	if(!incrementalRamp) {
+		//The descriptor sent in trapezoid mode must give exactly the same steps
+		SteppersCommand* expected = new SteppersCommand[cur->stepsRemaining];
+		expandSteppersTrapezoid(trapezoid, expected);
+		
+		unsigned int stepNumber = 0;
+		for(CommandChunk* checked = cur->commands; checked; checked = checked->next) {
+			for(unsigned int i=0; i<checked->count; i++) {
+				for(unsigned int r=0; r<stepperCommandSteps(checked->commands[i]); r++, stepNumber++) {
+					assert(stepNumber < cur->stepsRemaining);
+					assert(expected[stepNumber].step == checked->commands[i].step);
+					assert(expected[stepNumber].delay == checked->commands[i].delay);
+				}
+			}
+		}
+		assert(stepNumber == cur->stepsRemaining);
+		
+		delete[] expected;
+	}
+#endif
+	
+	cur->setCommandsGenerated();
+}
+
+void PathPlanner::streamCommands(Path* cur) {
+	TRACE_SCOPE(TRACE_STEP_GENERATION, cur->stepsRemaining);
+	
+	SteppersTrapezoid trapezoid;
+	uint8_t directionMask;
+	uint8_t cancellableMask;
+	
+	stepperMasks(cur, directionMask, cancellableMask);
+	buildTrapezoid(cur, trapezoid, directionMask, cancellableMask);
+	
+	CommandStream stream(trapezoid, &rampCache, incrementalRamp ? RAMP_INCREMENTAL : RAMP_TIMER, cur->accelerationPrim);
+	
+	//A single chunk is reused: push_block copies it to the DDR before we compute the next commands
+	CommandChunk* chunk = commandArena.allocate();
+	bool more = stream.fill(chunk);
+	
+	//Wait until we need to push some lines so that the path planner can fill up
+	waitForRefill();
+	
+	unsigned int linesPos = lineIndex(linesExecuted);
+	
+	LOG_DEBUG(LOG_STEPGEN, "Streaming " << std::dec << linesPos << ", Start speed=" << cur->startSpeed << ", end speed="<<cur->endSpeed << ", nb steps = " << cur->stepsRemaining << std::endl);
+	
+	cur->commandsCount = 0;
+	
+	while(!stop) {
+		cur->commandsCount += chunk->count;
+		
+		pru.push_block((uint8_t*)chunk->commands, sizeof(SteppersCommand)*chunk->count, sizeof(SteppersCommand),linesPos);
+		
+		if(!more)
+			break;
+		
+		chunk->count = 0;
+		chunk->steps = 0;
+		more = stream.fill(chunk);
+	}
+	
+	commandArena.release(chunk);
+	
+	LOG_DEBUG(LOG_STEPGEN, "Done streaming with " << std::dec << linesPos << ", nb commands = " << cur->commandsCount << std::endl);
+}
+
+Path* PathPlanner::claimFixedLine() {
+	//Only saves the work, run() waits for and releases the commands of a line claimed before the mode changed
+	if(trapezoidCommands)
+		return NULL;
+	
+	//Seqlock read: the lines are only trusted if no replanning pass ran meanwhile
+	uint32_t sequence = planSequence.load(std::memory_order_acquire);
+	if(sequence & 1)
+		return NULL;
+	
+	//The line executed is fixed by run() itself, it generates its commands if no worker did
+	uint32_t last = linesQueued;
+	
+	for(uint32_t line = linesExecuted + 1; (int32_t)(last - line) > 0; line++) {
+		Path* p = &lines[lineIndex(line)];
+		
+		//The commands of the long lines are generated while being sent
+		if(!p->isFixed() || p->isStreamed())
+			continue;
+		
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(planSequence.load(std::memory_order_relaxed) != sequence)
+			return NULL;
+		
+		//The lines are generated in order: the next ones wait until run() releases the chunks of the lines sent
+		if(!commandArena.reserve(CommandArena::chunksForSteps(p->stepsRemaining)))
+			return NULL;
+		
+		//A fixed line is not changed by the next passes anymore. With a stale linesExecuted, the slot may already be 
+		//refilled by queueLine(): the claim then fails on the sequence number of the line held in the flags.
+		if(p->claimCommandsGeneration(line))
+			return p;
+		
+		commandArena.cancelReservation(CommandArena::chunksForSteps(p->stepsRemaining));
+	}
+	
+	return NULL;
+}
+
+void PathPlanner::runGenerationWorker() {
+	while(!stop) {
+		Path* p = NULL;
+		
+		generationNeeded.waitUntil([this,&p]{return stop || (p = claimFixedLine()) != NULL;});
+		
+		if(!p)
+			continue;
+		
+		generateCommands(p, CommandArena::chunksForSteps(p->stepsRemaining));
+		
+		generationDone.notifyAll();
+	}
+}
+
+void PathPlanner::waitForRefill() {
+	uint64_t latency = pru.waitUntilLowMoveTime(bufferController.getTargetTime());
+	
+	//What remains queued when the next moves are pushed tells how close the PRU came to running out of moves
+	bufferController.refill(latency, pru.getTotalQueuedMovesTime(), pru.getStarvations());
+}
+
+void PathPlanner::waitForPlanning() {
+	//linesExecuted has been increased before, so a pass starting now does not touch the line to execute. 
+	//A pass in progress may have read the previous value, it only lasts a few microseconds.
+	uint32_t sequence = planSequence;
+	
+	if(sequence & 1) {
+		while(planSequence == sequence && !stop) {
+			std::this_thread::yield();
+		}
+	}
+}
+
 void PathPlanner::run() {
 	
 	bool waitUntilFilledUp = true;
 	
 	while(!stop) {
 		
-		std::unique_lock<std::mutex> lk(line_mutex);
-
-		lineAvailable.wait(lk, [this]{return linesCount>0 || stop;});
+		//Nothing left to send, the PRU running out of moves is not a starvation
+		if(!linesCount())
+			pru.setMovesPending(false);
+		
+		//Only blocks when the ring is empty
+		linesQueuedEvent.waitUntil([this]{return linesCount()>0 || stop;});
 		
+		unsigned int linesPos = lineIndex(linesExecuted);
 		Path* cur = &lines[linesPos];
 		
-		//If the buffer is half or more empty and the line to print is an optimized one , wait for 500 ms again so that we can get some other path in the path planner buffer, and we do that until the buffer is not anymore half empty.
-		if(linesCount<MOVE_CACHE_SIZE/2 && cur->getWaitMS()>0 && waitUntilFilledUp) {
+		//Read once, so that the whole line is sent the same way even if Python changes the mode meanwhile
+		bool trapezoids = trapezoidCommands;
+		
+		//If the buffer is not filled up and the line to print is an optimized one, wait for the next line so that we can get some other path in the path planner buffer, and we do that until the buffer is filled up or no line comes anymore.
+		//The buffer is filled up when half full or, with the adaptive buffering, when its lines last long enough.
+		auto filledUp = [this]{return linesCount()>=MOVE_CACHE_SIZE/2 || queuedLinesTime>=bufferController.getFillTime();};
+		
+		if(!filledUp() && cur->getWaitMS()>0 && waitUntilFilledUp) {
+			unsigned long fillWait = bufferController.getFillWait();
+			auto waitStart = std::chrono::steady_clock::now();
+			bufferWaits++;
+			TRACE_BEGIN(TRACE_BUFFER_WAIT, linesCount());
+			
 			unsigned lastCount = 0;
 			do {
-				lastCount = linesCount;
-				LOG("Waiting for buffer to fill up... " << linesCount  << ", before " << lastCount << std::endl);
+				lastCount = linesCount();
+				LOG_DEBUG(LOG_PLANNER, "Waiting for buffer to fill up... " << linesCount()  << ", before " << lastCount << std::endl);
 				
 				
-				lineAvailable.wait_for(lk,  std::chrono::milliseconds(PRINT_MOVE_BUFFER_WAIT), [this,lastCount]{return linesCount>lastCount || stop;});
+				linesQueuedEvent.waitUntilFor([this,lastCount]{return linesCount()>lastCount || stop;}, fillWait);
 				
-			} while(lastCount<linesCount && linesCount<MOVE_CACHE_SIZE/2 && !stop);
+			} while(lastCount<linesCount() && !filledUp() && !stop);
 			
+			TRACE_END(TRACE_BUFFER_WAIT, linesCount());
+			bufferWaitTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-waitStart).count();
 			waitUntilFilledUp = false;
 		}
 		
 		//The buffer is empty, we enable again the "wait until buffer is enough full" timing procedure.
-		if(linesCount<=1) {
+		if(linesCount()<=1) {
 			waitUntilFilledUp = true;
 		}
 		
-		
-		lk.unlock();
-		
-		if(!linesCount || stop){
+		if(!linesCount() || stop){
 			continue;
 		}
 		
+		pru.setMovesPending(linesCount()>1);
 		
+		waitForPlanning();
 		
+		//The workers only claim fixed lines, claiming the line before fixing it makes sure that none of them reads it meanwhile
+		bool generate = cur->claimCommandsGeneration(linesExecuted);
 		
-		long cur_errupd=0;
-		uint8_t directionMask = 0; //0b000HEZYX
-		uint8_t cancellableMask;
-		unsigned long vMaxReached;
-        unsigned long timer_accel = 0;
-		unsigned long timer_decel = 0;
-
-		if(cur->isBlocked())   // This step is in computation - shouldn't happen
-		{
-			cur = NULL;
-			LOG( "Path planner thread: path " <<  std::dec << linesPos<< " is blocked, waiting... " << std::endl);
-			std::this_thread::sleep_for( std::chrono::milliseconds(100) );
-			continue;
-		}
-		
-		//Only enable axis that are moving. If the axis doesn't need to move then it can stay disabled depending on configuration.
-		cur->fixStartAndEndSpeed();		
-		cur_errupd = cur->delta[cur->primaryAxis];
-		if(!cur->areParameterUpToDate())  // should never happen, but with bad timings???
-		{
-			cur->updateStepsParameter();
-		}		
-		
-		vMaxReached = cur->vStart;
-		
-		//Determine direction of movement,check if endstop was hit
-		if(cur->commands && (cur->commandBufferSize<cur->stepsRemaining || (cur->commandBufferSize-cur->stepsRemaining)>1024*1024)) { //Delete the buffer if the delta in MB is more than commandSize.
-			delete[] cur->commands;
-			cur->commandBufferSize = 0;
-			cur->commands = NULL;
-		}
-		
-		if(!cur->commands) {
-			cur->commands = new SteppersCommand[cur->stepsRemaining];
-			cur->commandBufferSize = cur->stepsRemaining;
+		if(!cur->isFixed()) {
+			//Only enable axis that are moving. If the axis doesn't need to move then it can stay disabled depending on configuration.
+			cur->fixStartAndEndSpeed();
+			if(!cur->areParameterUpToDate())  // should never happen, but with bad timings???
+			{
+				cur->updateStepsParameter();
+			}
 		}
 		
-		directionMask|=((uint8_t)cur->isXPositiveMove() << X_AXIS);
-		directionMask|=((uint8_t)cur->isYPositiveMove() << Y_AXIS);
-		directionMask|=((uint8_t)cur->isZPositiveMove() << Z_AXIS);
-		directionMask|=((uint8_t)cur->isEPositiveMove() << currentExtruder->stepperCommandPosition);
-     
-		cancellableMask = 0;
-		
-		if(cur->isCancelable()) {
-			cancellableMask|=((uint8_t)cur->isXMove() << X_AXIS);
-			cancellableMask|=((uint8_t)cur->isYMove() << Y_AXIS);
-			cancellableMask|=((uint8_t)cur->isZMove() << Z_AXIS);
-			cancellableMask|=((uint8_t)cur->isEMove() << currentExtruder->stepperCommandPosition);
+		if(!generate) {
+			//A worker is generating the commands of this line, also in trapezoid mode as it may have claimed the line 
+			//before the mode changed: the commands must be released before the slot is reused
+			generationDone.waitUntil([this,cur]{return cur->areCommandsGenerated() || stop;});
+			if(stop) continue;
+		} else if(!trapezoids && !cur->isStreamed()) {
+			generateCommands(cur);
 		}
 		
-		assert(cur);
-		assert(cur->commands);
-		
-		
-		
-		for(unsigned int stepNumber=0; stepNumber<cur->stepsRemaining; stepNumber++){
-			SteppersCommand& cmd = cur->commands[stepNumber];
-			cmd.direction = directionMask;
-			cmd.cancellableMask = cancellableMask;
-			cmd.options = 0;
-			cmd.step = 0;
-			if(cur->isEMove())
-			{
-				if((cur->error[E_AXIS] -= cur->delta[E_AXIS]) < 0)
-				{
-					cmd.step |= (1 << currentExtruder->stepperCommandPosition);
-					cur->error[E_AXIS] += cur_errupd;
-				}
-			}
-			if(cur->isXMove())
-			{
-				if((cur->error[X_AXIS] -= cur->delta[X_AXIS]) < 0)
-				{
-					cmd.step |= (1 << X_AXIS);
-					cur->error[X_AXIS] += cur_errupd;
-				}
-			}
-			if(cur->isYMove())
-			{
-				if((cur->error[Y_AXIS] -= cur->delta[Y_AXIS]) < 0)
-				{
-					cmd.step |= (1 << Y_AXIS);
-					cur->error[Y_AXIS] += cur_errupd;
-				}
+		if(trapezoids) {
+			if(cur->commands) {
+				commandArena.release(cur->commands);
+				cur->commands = NULL;
 			}
 			
-			if(cur->isZMove())
-			{
-				if((cur->error[Z_AXIS] -= cur->delta[Z_AXIS]) < 0)
-				{
-					cmd.step |= (1 << Z_AXIS);
-					cur->error[Z_AXIS] += cur_errupd;
-				}
-			}
+			//The PRU computes the steps itself, we only send the descriptor of the move
+			SteppersTrapezoid trapezoid;
+			uint8_t directionMask;
+			uint8_t cancellableMask;
 			
-#define ComputeV(timer,accel)  (((timer>>8)*accel)>>10)
+			stepperMasks(cur, directionMask, cancellableMask);
+			buildTrapezoid(cur, trapezoid, directionMask, cancellableMask);
 			
-			unsigned long interval;
+			waitForRefill();
 			
-			//If acceleration is enabled on this move and we are in the acceleration segment, calculate the current interval
-			if (cur->moveAccelerating(stepNumber))   // we are accelerating
-			{
-				vMaxReached = ComputeV(timer_accel,cur->fAcceleration)+cur->vStart;
-				if(vMaxReached>cur->vMax) vMaxReached = cur->vMax;
-				unsigned long v = vMaxReached;
-				interval = F_CPU/(v);
-				timer_accel+=interval;
-			}
-			else if (cur->moveDecelerating(stepNumber))     // time to slow down
-			{
-				unsigned long v = ComputeV(timer_decel,cur->fAcceleration);
-				if (v > vMaxReached)   // if deceleration goes too far it can become too large
-					v = cur->vEnd;
-			 	else{
-					v=vMaxReached - v;
-					if (v < cur->vEnd) 
-                        v = cur->vEnd; // extra steps at the end of desceleration due to rounding erros
-				}
-				
-				interval = F_CPU/(v);
-				timer_decel += interval;
-			}
-			else // full speed reached
-			{
-				// constant speed reached
-				interval = cur->fullInterval;
-			}
+			LOG_DEBUG(LOG_STEPGEN, "Sending trapezoid " << std::dec << linesPos << ", Start speed=" << cur->startSpeed << ", end speed="<<cur->endSpeed << ", nb steps = " << cur->stepsRemaining << std::endl);
 			
-			assert(interval < F_CPU*4);
-			cmd.delay = (uint32_t)interval;
-		} // stepsRemaining
+			pru.push_block((uint8_t*)&trapezoid, sizeof(SteppersTrapezoid), sizeof(SteppersTrapezoid),linesPos);
+			
+			removeCurrentLine();
+			continue;
+		}
+		
+		if(cur->isStreamed()) {
+			streamCommands(cur);
+			
+			removeCurrentLine();
+			continue;
+		}
 		
 		//LOG("Current move time " << pru.getTotalQueuedMovesTime() / (double) F_CPU << std::endl);
 		
 		//Wait until we need to push some lines so that the path planner can fill up
-		pru.waitUntilLowMoveTime((F_CPU/1000)*MIN_BUFFERED_MOVE_TIME); //in seconds
+		waitForRefill();
 		
-		LOG( "Sending " << std::dec << linesPos << ", Start speed=" << cur->startSpeed << ", end speed="<<cur->endSpeed << ", nb steps = " << cur->stepsRemaining << std::endl);
+		LOG_DEBUG(LOG_STEPGEN, "Sending " << std::dec << linesPos << ", Start speed=" << cur->startSpeed << ", end speed="<<cur->endSpeed << ", nb steps = " << cur->stepsRemaining << ", nb commands = " << cur->commandsCount << std::endl);
 		
-		pru.push_block((uint8_t*)cur->commands, sizeof(SteppersCommand)*cur->stepsRemaining, sizeof(SteppersCommand),linesPos,cur->timeInTicks);
+		//One block per chunk
+		for(CommandChunk* chunk = cur->commands; chunk; chunk = chunk->next) {
+			pru.push_block((uint8_t*)chunk->commands, sizeof(SteppersCommand)*chunk->count, sizeof(SteppersCommand),linesPos);
+		}
 		
-		LOG( "Done sending with " << std::dec << linesPos << std::endl);
+		commandArena.release(cur->commands);
+		cur->commands = NULL;
+		
+		//The workers waiting for free chunks can claim the next lines
+		generationNeeded.notifyAll();
+		
+		LOG_DEBUG(LOG_STEPGEN, "Done sending with " << std::dec << linesPos << std::endl);
 		
 		removeCurrentLine();
-
-		lineAvailable.notify_all();
 	}
 }
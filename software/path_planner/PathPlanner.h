@@ -29,15 +29,30 @@
 
 #include <iostream>
 #include <atomic>
-#include <thread>
 #include <mutex>
+#include <chrono>
+#include <thread>
+#include <vector>
 #include <string.h>
 #include <strings.h>
 #include <assert.h>
 #include "PruTimer.h"
+#include "VirtualPru.h"
 #include "Path.h"
+#include "RampCache.h"
+#include "CommandArena.h"
+#include "EventCount.h"
+#include "Kinematics.h"
+#include "MoveSegmenter.h"
+#include "Metrics.h"
+#include "BufferController.h"
+#include "Trace.h"
 #include "config.h"
 
+/* Flags of the moves given to PathPlanner::queueMoves() */
+#define MOVE_FLAG_CANCELABLE 1
+#define MOVE_FLAG_OPTIMIZE 2
+
 class Extruder {
 private:
 	float maxStartFeedrate;
@@ -109,6 +124,10 @@ public:
 
 class PathPlanner {
 private:
+	void queueLine(float axis_diff[NUM_AXIS], const float num_steps[NUM_AXIS], float speed, bool cancelable, bool optimize);
+	void queueCartesianLine(const float target[NUM_AXIS], float speed, bool cancelable, bool optimize);
+	void queueSegments(const float target[NUM_AXIS], float speed, bool cancelable, bool optimize);
+	void queueCartesianArc(const float target[NUM_AXIS], float offsetI, float offsetJ, bool clockwise, float speed, bool cancelable, bool optimize);
 	void calculateMove(Path* p,float axis_diff[NUM_AXIS]);
 	float safeSpeed(Path *p);
 	void updateTrapezoids();
@@ -134,14 +153,40 @@ private:
 			
 	float invAxisStepsPerMM[NUM_AXIS];
 	unsigned long axisStepsPerMM[NUM_AXIS];
-
 	
-	std::atomic_uint_fast32_t linesPos; // Position for executing line movement
-	std::atomic_uint_fast32_t linesWritePos; // Position where we write the next cached line move
-	std::atomic_uint_fast32_t linesCount;      ///< Number of lines cached 0 = nothing to do.
+	CartesianKinematics cartesianKinematics;
+	HBeltKinematics hBeltKinematics;
+	CoreXYKinematics coreXYKinematics;
+	DeltaKinematics deltaKinematics;
+	Kinematics* kinematics;                     ///< One of the above, selected by setAxisConfig()
+	MoveSegmenter segmenter;
+	float arcTolerance;
+	float position[NUM_AXIS];                   ///< Cartesian position of the head at the end of the last move queued by queueMoveTo(), in meters
 
+	
+	/* The lines form a single producer (queueMove()), single consumer (run()) ring indexed by sequence numbers. 
+	 * A line is published by increasing linesQueued after it has been written, and freed by increasing linesExecuted 
+	 * once it has been sent to the PRU. */
+	std::atomic<uint32_t> linesQueued;          ///< Sequence number of the next line written by queueMove()
+	std::atomic<uint32_t> linesExecuted;        ///< Sequence number of the line executed by run()
+	unsigned int linesWritePos;                 ///< Position where we write the next cached line move, only used by queueMove()
+	
+	/* Seqlock of the replanning: odd while updateTrapezoids() changes the lines. It never changes the line executed, 
+	 * but it may have read linesExecuted before run() went to the next line, so run() waits for the end of such a pass. */
+	std::atomic<uint32_t> planSequence;
+	
 	Path lines[MOVE_CACHE_SIZE];
-
+	
+	static_assert((MOVE_CACHE_SIZE & (MOVE_CACHE_SIZE - 1)) == 0, "MOVE_CACHE_SIZE must be a power of 2 so that the sequence numbers can wrap around");
+	
+	inline unsigned int lineIndex(uint32_t sequence)
+	{
+		return sequence % MOVE_CACHE_SIZE;
+	}
+	inline unsigned int linesCount()
+	{
+		return linesQueued - linesExecuted;
+	}
 	inline void previousPlannerIndex(unsigned int &p)
     {
         p = (p ? p-1 : MOVE_CACHE_SIZE-1);
@@ -153,21 +198,56 @@ private:
 	
 	inline void removeCurrentLine()
     {
-        linesPos++;
-        if(linesPos>=MOVE_CACHE_SIZE) linesPos=0;
-
-        --linesCount;
+		//The line has been sent to the PRU
+		movesExecuted.fetch_add(1, std::memory_order_relaxed);
+		stepsGenerated.fetch_add(lines[lineIndex(linesExecuted)].stepsRemaining, std::memory_order_relaxed);
+		queuedLinesTime.fetch_sub(lines[lineIndex(linesExecuted)].timeInTicks, std::memory_order_relaxed);
 		
+        linesExecuted++;
+		linesExecutedEvent.notifyAll();
     }
 	
-	std::mutex line_mutex;
-	std::condition_variable lineAvailable;
+	EventCount linesQueuedEvent;                ///< Notified when a line is published, run() waits on it when the ring is empty
+	EventCount linesExecutedEvent;              ///< Notified when a line is freed, queueMove() waits on it when the ring is full
 	
 	std::thread runningThread;
-	bool stop;
+	std::atomic<bool> stop;
+	
+	EventCount generationNeeded;                ///< Notified when new lines may have become fixed
+	EventCount generationDone;                  ///< Notified when a worker has generated the commands of a line
+	std::vector<std::thread> generationWorkers;
+	unsigned int generationWorkersCount;
 	
 	PruTimer pru;
+	std::atomic<bool> trapezoidCommands;        ///< Set from Python at any time, read once per line by run()
+	bool incrementalRamp;
+	RampCache rampCache;
+	CommandArena commandArena;
+	BufferController bufferController;
+	std::atomic<uint64_t> queuedLinesTime;      ///< Time of the lines in the ring at full speed, in PRU cycles
+	
+	/* Metrics, see PlannerMetrics. The rates are computed by getMetrics() over METRICS_RATE_INTERVAL */
+	std::atomic<uint64_t> bufferWaits;
+	std::atomic<uint64_t> bufferWaitTime; //in ns
+	std::atomic<uint64_t> movesExecuted;
+	std::atomic<uint64_t> stepsGenerated;
+	std::mutex metricsMutex;
+	std::chrono::steady_clock::time_point rateTime;
+	uint64_t rateMoves;
+	uint64_t rateSteps;
+	double movesPerSecond;
+	double stepsPerSecond;
+	MetricsServer metricsServer;                ///< Last so that it is stopped before the rest is destroyed
+	
 	void recomputeParameters();
+	void buildTrapezoid(Path* cur, SteppersTrapezoid& trapezoid, uint8_t directionMask, uint8_t cancellableMask);
+	void stepperMasks(Path* cur, uint8_t& directionMask, uint8_t& cancellableMask);
+	void generateCommands(Path* cur, size_t reservedChunks = 0);
+	void streamCommands(Path* cur);
+	Path* claimFixedLine();
+	void waitForPlanning();
+	void waitForRefill();
+	void runGenerationWorker();
 	void run();
 
 public:
@@ -190,7 +270,87 @@ public:
 	bool initPRU(const std::string& firmware_stepper, const std::string& firmware_endstops) {
 		return pru.initPRU(firmware_stepper, firmware_endstops);
 	}
+	
+	/**
+	 * @brief Init a virtual PRU instead of the PRU co-processors
+	 * @details The commands are executed by a thread following the same protocol as the PRU firmware, so the path 
+	 * planner can run on a computer without PRU. Use it instead of initPRU().
+	 * 
+	 * @param realTime true to execute the steps at their real speed, false to run them as fast as possible
+	 * 
+	 * @return true in case of success, false otherwise.
+	 */
+	bool initVirtualPRU(bool realTime) {
+		return pru.initVirtualPRU(realTime);
+	}
+	
+	/**
+	 * @brief Init the path planner with a custom PRU backend
+	 * @details Lets a program observe the commands, with a VirtualPru and a VirtualPruObserver for example.
+	 * 
+	 * @param backend The backend, owned by the path planner afterwards
+	 * 
+	 * @return true in case of success, false otherwise.
+	 */
+	bool initPRU(PruBackend* backend) {
+		return pru.initPRU(backend);
+	}
+	
+	/**
+	 * @brief Return the virtual PRU initialized by initVirtualPRU(), NULL when running on the PRU
+	 */
+	VirtualPru* getVirtualPRU() {
+		return dynamic_cast<VirtualPru*>(pru.getBackend());
+	}
 
+	/**
+	 * @brief Return a snapshot of the counters of the path planner and of the PRU
+	 * @details The rates are the ones of the last METRICS_RATE_INTERVAL.
+	 */
+	PlannerMetrics getMetrics();
+	
+	/**
+	 * @brief Serve the metrics in the Prometheus text format on a local Unix socket
+	 * 
+	 * @param path The path of the socket
+	 * 
+	 * @return true in case of success, false otherwise.
+	 */
+	bool startMetricsServer(const std::string& path);
+	
+	void stopMetricsServer();
+	
+	/**
+	 * @brief Record the events of the path planner and PRU threads in the trace rings
+	 * @details An event costs about a read of the monotonic clock, it can stay enabled while printing.
+	 */
+	void setTraceEnabled(bool enable) {
+		Tracer::setEnabled(enable);
+	}
+	
+	/**
+	 * @brief Write the last events recorded by each thread to a file in the Chrome trace JSON format
+	 * 
+	 * @param path The path of the file to write
+	 * 
+	 * @return true in case of success, false otherwise.
+	 */
+	bool dumpTrace(const std::string& path) {
+		return Tracer::dump(path);
+	}
+	
+	/**
+	 * @brief Set the minimum level of the messages of the path planner
+	 * 
+	 * @param category The name of the category (planner, stepgen, pru, ddr), or all
+	 * @param level The level, with the values of the Python logging module: 10 for debug to 40 for errors
+	 * 
+	 * @return false if the category is unknown
+	 */
+	bool setLogLevel(const std::string& category, int level) {
+		return Logger::setLevel(category, level);
+	}
+	
 	/**
 	 * @brief Queue a line move for execution
 	 * @details Queue a line move execution in the path planner. Note that the path planner 
@@ -205,6 +365,114 @@ public:
 	 */
 	//void queueAbsolute(float startPos[NUM_AXIS], float endPos[NUM_AXIS], float speed, bool cancelable, bool optimize=true );
     void queueMove(float axis_diff[NUM_AXIS], float num_steps[NUM_AXIS], float speed, bool cancelable, bool optimize);
+	
+	/**
+	 * @brief Queue several line moves at once
+	 * @details Same as calling queueMove() for each move, but the Python binding reads the arrays in place through the 
+	 * buffer protocol and releases the GIL once for the whole batch.
+	 * 
+	 * @param axisDiffs The moves of each axis in meters, NUM_AXIS values per move
+	 * @param numSteps The number of steps of each axis, NUM_AXIS values per move
+	 * @param speeds The feedrate of each move in m/s
+	 * @param flags MOVE_FLAG_CANCELABLE and MOVE_FLAG_OPTIMIZE combination for each move
+	 * @param count The number of moves
+	 */
+	void queueMoves(const float* axisDiffs, const float* numSteps, const float* speeds, const uint8_t* flags, unsigned int count);
+	
+	/**
+	 * @brief Queue a line move to a cartesian position
+	 * @details The move of each motor is computed by the kinematics set with setAxisConfig(), and rounded to a whole number 
+	 * of steps. The position actually reached after the rounding is the start of the next move.
+	 * A target that the printer cannot reach is ignored. On a Delta, the move is split in segments that are queued 
+	 * one after the other, see MoveSegmenter.
+	 * 
+	 * @param target The end position of the move in meters
+	 * @param speed The feedrate (aka speed) of the move in m/s
+	 * @param cancelable true if the move can be cancelled by an end stop
+	 * @param optimize true to wait for the next moves before planning this one
+	 */
+	void queueMoveTo(float target[NUM_AXIS], float speed, bool cancelable, bool optimize);
+	
+	/**
+	 * @brief Queue an arc move in the XY plane, as G2 and G3 with the center form
+	 * @details The arc is split into chords that are queued with queueMoveTo(), so that the chords never get further 
+	 * from the arc than the tolerance set with setArcTolerance(). Z and the extruder move linearly along the arc, 
+	 * for helical moves. An arc ending at its start position is a full circle.
+	 * 
+	 * @param target The end position of the arc in meters
+	 * @param offsetI The X offset of the center from the start position in meters
+	 * @param offsetJ The Y offset of the center from the start position in meters
+	 * @param clockwise true for G2, false for G3
+	 * @param speed The feedrate (aka speed) of the move in m/s
+	 * @param cancelable true if the move can be cancelled by an end stop
+	 * @param optimize true to wait for the next moves before planning this one
+	 */
+	void queueArc(float target[NUM_AXIS], float offsetI, float offsetJ, bool clockwise, float speed, bool cancelable, bool optimize);
+	
+	/**
+	 * @brief Queue an arc move in the XY plane, as G2 and G3 with the radius form
+	 * @details Same as queueArc(), the center is computed from the radius. A negative radius selects the arc 
+	 * longer than a half circle. The move is ignored if the target is further than the diameter.
+	 * 
+	 * @param target The end position of the arc in meters
+	 * @param radius The radius of the arc in meters
+	 * @param clockwise true for G2, false for G3
+	 * @param speed The feedrate (aka speed) of the move in m/s
+	 * @param cancelable true if the move can be cancelled by an end stop
+	 * @param optimize true to wait for the next moves before planning this one
+	 */
+	void queueArcRadius(float target[NUM_AXIS], float radius, bool clockwise, float speed, bool cancelable, bool optimize);
+	
+	/**
+	 * @brief Set the maximum distance between an arc and the chords it is split into
+	 * @details Defaults to ARC_CHORD_TOLERANCE.
+	 * 
+	 * @param tolerance The distance in meters
+	 */
+	void setArcTolerance(float tolerance) {
+		arcTolerance = tolerance;
+	}
+	
+	/**
+	 * @brief Set the cartesian position of the head, as with G92
+	 * 
+	 * @param pos The position in meters
+	 */
+	void setPosition(float pos[NUM_AXIS]) {
+		memcpy(position, pos, sizeof(position));
+	}
+	
+	/**
+	 * @brief Return the cartesian position of the head at the end of the moves queued by queueMoveTo()
+	 * 
+	 * @param axis The axis
+	 * @return The position in meters
+	 */
+	float getPosition(int axis) {
+		assert(axis < NUM_AXIS);
+		return position[axis];
+	}
+	
+	/**
+	 * @brief Select the kinematics used by queueMoveTo()
+	 * @details Takes the values of Path.axis_config. AXIS_CONFIG_DELTA uses the parameters given to setDeltaKinematics().
+	 * 
+	 * @param axisConfig AXIS_CONFIG_XY, AXIS_CONFIG_H_BELT, AXIS_CONFIG_CORE_XY or AXIS_CONFIG_DELTA
+	 */
+	void setAxisConfig(int axisConfig);
+	
+	/**
+	 * @brief Use the kinematics of a Delta printer in queueMoveTo()
+	 * @details Same parameters as Delta.py, all in meters.
+	 * 
+	 * @param L The length of the rods
+	 * @param r The radius of the columns
+	 * @param Ae The offset of the effector joint of the column A
+	 * @param Be The offset of the effector joint of the column B
+	 * @param Ce The offset of the effector joint of the column C
+	 * @param Hez The distance of the head below the effector
+	 */
+	void setDeltaKinematics(float L, float r, float Ae, float Be, float Ce, float Hez);
 
 
 	
@@ -311,6 +579,122 @@ public:
 	 */
 	void setMaxJerk(float maxJerk, float maxZJerk);
 	
+	/**
+	 * @brief Send the moves as trapezoid descriptors instead of one command per step
+	 * @details When enabled, the PRU computes the Bresenham algorithm and the acceleration ramp of each move itself, 
+	 * so that a move only takes a few dozen bytes in DDR whatever its number of steps. 
+	 * The per step commands are used when disabled, which is the default. Can be changed while printing, it applies 
+	 * from the next line sent to the PRU.
+	 *
+	 * @param enabled true to send trapezoid descriptors
+	 */
+	void setTrapezoidCommands(bool enabled) {
+		trapezoidCommands = enabled;
+	}
+	
+	/**
+	 * @brief Adapt the buffering of the moves to the measured latency of the host
+	 * @details When enabled, the PRU time kept queued follows the wake-up latency of the path planner thread and the 
+	 * times the PRU ran out of moves, between ADAPTIVE_BUFFERED_MOVE_TIME_MIN and ADAPTIVE_BUFFERED_MOVE_TIME_MAX. 
+	 * Before printing, the ring is filled with twice that time of moves, waiting for each new line a few times the 
+	 * longest time measured between two lines. When disabled, which is the default, MIN_BUFFERED_MOVE_TIME of moves 
+	 * is kept queued and the ring is filled by half, waiting up to PRINT_MOVE_BUFFER_WAIT for each line.
+	 *
+	 * @param enabled true to adapt the buffering
+	 */
+	void setAdaptiveBuffering(bool enabled) {
+		bufferController.setAdaptive(enabled);
+	}
+	
+	/**
+	 * @brief Compute the acceleration ramps with the incremental fixed point algorithm
+	 * @details When enabled, the intervals of the acceleration and deceleration phases are updated step by step without 
+	 * division from the exact acceleration of the move, instead of being computed from the elapsed time with a division 
+	 * per step. The move times are then within a few cycles of the theoretical ones. Only applies to the per step 
+	 * commands, the PRU always uses the time based ramp for the trapezoid descriptors. Disabled by default, see 
+	 * INCREMENTAL_RAMP_DEFAULT: it is more accurate, not faster.
+	 *
+	 * @param enabled true to use the incremental ramp
+	 */
+	void setIncrementalRamp(bool enabled) {
+		incrementalRamp = enabled;
+	}
+	
+	/**
+	 * @brief Set the number of threads generating the step commands of the moves in advance
+	 * @details The commands of a move do not change anymore once its start and end speeds are fixed, so the workers 
+	 * generate them in parallel for the moves waiting in the queue while the path planner thread sends them to the PRU in order.
+	 * With 0 workers, the commands are generated by the path planner thread just before being sent. Defaults to one worker 
+	 * per core beside the one of the path planner thread, takes effect at the next call to runThread().
+	 *
+	 * @param workers The number of worker threads
+	 */
+	void setStepGenerationWorkers(unsigned int workers) {
+		generationWorkersCount = workers;
+	}
+	
+	/**
+	 * @brief Return the number of moves whose acceleration ramp was found in the ramp cache
+	 * @details Moves sharing the same acceleration, speeds and ramp lengths reuse the intervals computed for a previous move.
+	 *
+	 * @return The number of cache hits since the creation of the path planner
+	 */
+	unsigned long getRampCacheHits() {
+		return rampCache.getHits();
+	}
+	
+	/**
+	 * @brief Return the number of moves whose acceleration ramp had to be computed
+	 * @details Moves with ramps longer than RAMP_CACHE_MAX_STEPS are neither counted as hits nor as misses.
+	 *
+	 * @return The number of cache misses since the creation of the path planner
+	 */
+	unsigned long getRampCacheMisses() {
+		return rampCache.getMisses();
+	}
+	
+	/**
+	 * @brief Return the hit rate of the ramp cache
+	 * @details Ratio of the hits over all the lookups, 0 if no lookup has been done yet.
+	 *
+	 * @return The hit rate, between 0 and 1
+	 */
+	float getRampCacheHitRate() {
+		unsigned long hits = rampCache.getHits();
+		unsigned long lookups = hits + rampCache.getMisses();
+		return lookups ? (float)hits / lookups : 0;
+	}
+	
+	/**
+	 * @brief Return the memory of the command arena used by the lines of the path planner
+	 * @details The step commands of the lines are stored in fixed size chunks allocated from an arena created with the path planner.
+	 *
+	 * @return The memory used in bytes
+	 */
+	unsigned long getCommandArenaUsage() {
+		return commandArena.getChunksUsed()*sizeof(CommandChunk);
+	}
+	
+	/**
+	 * @brief Return the maximum memory of the command arena used at the same time
+	 * @details Can be compared with COMMAND_ARENA_CHUNKS to size the arena.
+	 *
+	 * @return The high water mark in bytes
+	 */
+	unsigned long getCommandArenaHighWater() {
+		return commandArena.getHighWater()*sizeof(CommandChunk);
+	}
+	
+	/**
+	 * @brief Return the number of chunks allocated on the heap because the command arena was full
+	 * @details Should stay 0, the generation workers wait for free chunks instead of filling the arena.
+	 *
+	 * @return The number of heap allocations
+	 */
+	unsigned long getCommandArenaHeapAllocations() {
+		return commandArena.getHeapAllocations();
+	}
+	
 	void suspend() {
 		pru.suspend();
 	}
@@ -11,12 +11,78 @@
 
 %{
 #include "PathPlanner.h"
+#include "GcodeParser.h"
+#include "VirtualPru.h"
+#include "Metrics.h"
 %}
 
 %include "config.h"
 
 %rename(PathPlannerNative) PathPlanner;
 
+%{
+/* Get a C contiguous buffer of count items of the given format, sets a Python exception and returns false otherwise */
+static bool getMovesBuffer(PyObject* obj, Py_buffer* view, const char* format, Py_ssize_t itemSize, const char* name) {
+  if(PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+    return false;
+  
+  const char* viewFormat = view->format ? view->format : "B";
+  if(viewFormat[0] == '<' || viewFormat[0] == '=' || viewFormat[0] == '@')
+    viewFormat++;
+  
+  if(view->itemsize != itemSize || strcmp(viewFormat, format) != 0) {
+    PyErr_Format(PyExc_TypeError, "%s must be an array of type '%s'", name, format);
+    PyBuffer_Release(view);
+    return false;
+  }
+  
+  return true;
+}
+
+/* Implementation of queueMoves() with buffers */
+static PyObject* PathPlanner_queueMoves(PathPlanner* self, PyObject* deltas, PyObject* steps, PyObject* speeds, PyObject* flags) {
+  Py_buffer deltasView, stepsView, speedsView, flagsView;
+  
+  if(!getMovesBuffer(deltas, &deltasView, "f", sizeof(float), "deltas"))
+    return NULL;
+  if(!getMovesBuffer(steps, &stepsView, "f", sizeof(float), "steps")) {
+    PyBuffer_Release(&deltasView);
+    return NULL;
+  }
+  if(!getMovesBuffer(speeds, &speedsView, "f", sizeof(float), "speeds")) {
+    PyBuffer_Release(&deltasView);
+    PyBuffer_Release(&stepsView);
+    return NULL;
+  }
+  if(!getMovesBuffer(flags, &flagsView, "B", sizeof(uint8_t), "flags")) {
+    PyBuffer_Release(&deltasView);
+    PyBuffer_Release(&stepsView);
+    PyBuffer_Release(&speedsView);
+    return NULL;
+  }
+  
+  Py_ssize_t count = speedsView.len / sizeof(float);
+  
+  if(flagsView.len != count || deltasView.len != count*NUM_AXIS*(Py_ssize_t)sizeof(float) || stepsView.len != deltasView.len) {
+    PyErr_SetString(PyExc_ValueError, "deltas and steps must have NUM_AXIS values per move, speeds and flags one");
+  } else {
+    Py_BEGIN_ALLOW_THREADS
+    self->queueMoves((const float*)deltasView.buf, (const float*)stepsView.buf, (const float*)speedsView.buf, (const uint8_t*)flagsView.buf, (unsigned int)count);
+    Py_END_ALLOW_THREADS
+  }
+  
+  PyBuffer_Release(&deltasView);
+  PyBuffer_Release(&stepsView);
+  PyBuffer_Release(&speedsView);
+  PyBuffer_Release(&flagsView);
+  
+  if(PyErr_Occurred())
+    return NULL;
+  
+  Py_RETURN_NONE;
+}
+%}
+
 
 // Grab a 4 element array as a Python 4-tuple
 %typemap(in) float[4](float temp[4]) {   // temp[4] becomes a local variable
@@ -127,6 +193,121 @@ public:
 
 
 
+class GcodeLine {
+public:
+  GcodeLine();
+  
+  /**
+   * @brief Parse a line
+   * @details Everything after a ; is a comment. A line can start with a line number N and end with a checksum *.
+   *
+   * @param line The line
+   * @return true if the line contains a command
+   */
+  bool parse(const std::string& line);
+  
+  /**
+   * @brief Return the command, as G1 or M105, or an empty string if the line has none
+   */
+  std::string getCommand() const;
+  
+  /**
+   * @brief Return true if the parameter letter is present in the line
+   */
+  bool hasLetter(char letter) const;
+  
+  /**
+   * @brief Return true if the parameter letter is present and followed by a number
+   */
+  bool hasValue(char letter) const;
+  
+  /**
+   * @brief Return the value of a parameter letter
+   * @return The value, NaN if the letter is not present or is not followed by a number
+   */
+  float getValue(char letter) const;
+  
+  /**
+   * @brief Return the number of parameters
+   */
+  unsigned int getLettersCount() const;
+  
+  bool hasLineNumber() const;
+  
+  int getLineNumber() const;
+  
+  bool hasChecksum() const;
+  
+  /**
+   * @brief Return true if the checksum of the line matches the one computed from its characters
+   */
+  bool isChecksumValid() const;
+  
+  /**
+   * @brief Return the offset of the first parameter in the line
+   * @details The commands such as M117 take a text instead of parameters, it starts at this offset.
+   */
+  unsigned int getTextOffset() const;
+};
+
+
+
+class VirtualPru {
+public:
+  /**
+   * @brief Set the masks of the steppers allowed to move, as PRU1 does from the end stops
+   *
+   * @param positive Steppers allowed to move in the positive direction, defined as 0b000HEZYX
+   * @param negative Steppers allowed to move in the negative direction, defined as 0b000HEZYX
+   */
+  void setEndstopMasks(uint8_t positive, uint8_t negative);
+  
+  /**
+   * @brief Return the position of a stepper in steps since start()
+   */
+  int64_t getPosition(int stepper);
+  
+  /**
+   * @brief Return the number of PRU cycles executed since start()
+   */
+  uint64_t getCycles();
+  
+  uint64_t getStepsDone();
+  
+  uint64_t getBlocksDone();
+  
+  uint64_t getBlocksCancelled();
+};
+
+
+
+/**
+ * Snapshot of the counters of the path planner and of the PRU, returned by PathPlanner::getMetrics().
+ * The times are in seconds, the counters count since the path planner was created.
+ */
+struct PlannerMetrics {
+  uint64_t linesCount;             ///< Moves in the ring of the path planner
+  uint64_t bufferWaits;            ///< Times run() waited for the ring to fill up before printing
+  double bufferWaitTime;           ///< Time spent in these waits
+  double lowMoveTimeWaitTime;      ///< Time blocked in waitUntilLowMoveTime(), the PRU has enough moves queued
+  double ddrSpaceWaitTime;         ///< Time blocked in push_block() waiting for space in the DDR
+  uint64_t ddrMemUsed;             ///< Bytes of the DDR used by the queued blocks
+  uint64_t ddrMemHighWater;        ///< Maximum of ddrMemUsed
+  uint64_t ddrSize;                ///< Size of the DDR shared with the PRU
+  double queuedMovesTime;          ///< Time of the moves queued in the PRU
+  double queuedMovesTimeMin;       ///< Minimum of queuedMovesTime while more moves were waiting to be sent, -1 if none yet
+  uint64_t starvations;            ///< Times the PRU ran out of moves while more moves were waiting to be sent
+  uint64_t movesExecuted;          ///< Moves sent to the PRU
+  uint64_t stepsGenerated;         ///< Steps of the primary axis of the moves sent to the PRU
+  double movesPerSecond;           ///< Moves sent to the PRU per second, over the last METRICS_RATE_INTERVAL
+  double stepsPerSecond;           ///< Steps sent to the PRU per second, over the last METRICS_RATE_INTERVAL
+  double bufferTarget;             ///< Time of the moves run() keeps queued in the PRU, see setAdaptiveBuffering()
+  double bufferFillWait;           ///< Time run() waits for a new line before printing
+  double hostLatency;              ///< Peak time between the PRU needing moves and run() pushing them, 0 if not adaptive
+};
+
+
+
 class PathPlanner {
   
 public:
@@ -148,6 +329,64 @@ public:
   bool initPRU(const std::string& firmware_stepper, const std::string& firmware_endstops) {
     return pru.initPRU(firmware_stepper, firmware_endstops);
   }
+  
+  /**
+   * @brief Init a virtual PRU instead of the PRU co-processors
+   * @details The commands are executed by a thread following the same protocol as the PRU firmware, so the path 
+   * planner can run on a computer without PRU. Use it instead of initPRU().
+   * 
+   * @param realTime true to execute the steps at their real speed, false to run them as fast as possible
+   * 
+   * @return true in case of success, false otherwise.
+   */
+  bool initVirtualPRU(bool realTime);
+  
+  /**
+   * @brief Return the virtual PRU initialized by initVirtualPRU(), NULL when running on the PRU
+   */
+  VirtualPru* getVirtualPRU();
+  
+  /**
+   * @brief Return a snapshot of the counters of the path planner and of the PRU
+   * @details The rates are the ones of the last METRICS_RATE_INTERVAL.
+   */
+  PlannerMetrics getMetrics();
+  
+  /**
+   * @brief Serve the metrics in the Prometheus text format on a local Unix socket
+   * 
+   * @param path The path of the socket
+   * 
+   * @return true in case of success, false otherwise.
+   */
+  bool startMetricsServer(const std::string& path);
+  
+  void stopMetricsServer();
+  
+  /**
+   * @brief Record the events of the path planner and PRU threads in the trace rings
+   * @details An event costs about a read of the monotonic clock, it can stay enabled while printing.
+   */
+  void setTraceEnabled(bool enable);
+  
+  /**
+   * @brief Write the last events recorded by each thread to a file in the Chrome trace JSON format
+   * 
+   * @param path The path of the file to write
+   * 
+   * @return true in case of success, false otherwise.
+   */
+  bool dumpTrace(const std::string& path);
+  
+  /**
+   * @brief Set the minimum level of the messages of the path planner
+   * 
+   * @param category The name of the category (planner, stepgen, pru, ddr), or all
+   * @param level The level, with the values of the Python logging module: 10 for debug to 40 for errors
+   * 
+   * @return false if the category is unknown
+   */
+  bool setLogLevel(const std::string& category, int level);
 
   /**
    * @brief Queue a line move for execution
@@ -163,6 +402,94 @@ public:
    */
   void queueMove(float axis_diff[NUM_AXIS], float num_steps[NUM_AXIS], float speed, bool cancelable, bool optimize);
   
+  /**
+   * @brief Queue a line move to a cartesian position
+   * @details The move of each motor is computed by the kinematics set with setAxisConfig(), and rounded to a whole number 
+   * of steps. The position actually reached after the rounding is the start of the next move.
+   * A target that the printer cannot reach is ignored. On a Delta, the move is split in segments that are queued 
+   * one after the other.
+   * 
+   * @param target The end position of the move in meters
+   * @param speed The feedrate (aka speed) of the move in m/s
+   * @param cancelable true if the move can be cancelled by an end stop
+   * @param optimize true to wait for the next moves before planning this one
+   */
+  void queueMoveTo(float target[NUM_AXIS], float speed, bool cancelable, bool optimize);
+  
+  /**
+   * @brief Queue an arc move in the XY plane, as G2 and G3 with the center form
+   * @details The arc is split into chords that are queued with queueMoveTo(), so that the chords never get further 
+   * from the arc than the tolerance set with setArcTolerance(). Z and the extruder move linearly along the arc, 
+   * for helical moves. An arc ending at its start position is a full circle.
+   * 
+   * @param target The end position of the arc in meters
+   * @param offsetI The X offset of the center from the start position in meters
+   * @param offsetJ The Y offset of the center from the start position in meters
+   * @param clockwise true for G2, false for G3
+   * @param speed The feedrate (aka speed) of the move in m/s
+   * @param cancelable true if the move can be cancelled by an end stop
+   * @param optimize true to wait for the next moves before planning this one
+   */
+  void queueArc(float target[NUM_AXIS], float offsetI, float offsetJ, bool clockwise, float speed, bool cancelable, bool optimize);
+  
+  /**
+   * @brief Queue an arc move in the XY plane, as G2 and G3 with the radius form
+   * @details Same as queueArc(), the center is computed from the radius. A negative radius selects the arc 
+   * longer than a half circle. The move is ignored if the target is further than the diameter.
+   * 
+   * @param target The end position of the arc in meters
+   * @param radius The radius of the arc in meters
+   * @param clockwise true for G2, false for G3
+   * @param speed The feedrate (aka speed) of the move in m/s
+   * @param cancelable true if the move can be cancelled by an end stop
+   * @param optimize true to wait for the next moves before planning this one
+   */
+  void queueArcRadius(float target[NUM_AXIS], float radius, bool clockwise, float speed, bool cancelable, bool optimize);
+  
+  /**
+   * @brief Set the maximum distance between an arc and the chords it is split into
+   * @details Defaults to ARC_CHORD_TOLERANCE.
+   * 
+   * @param tolerance The distance in meters
+   */
+  void setArcTolerance(float tolerance);
+  
+  /**
+   * @brief Set the cartesian position of the head, as with G92
+   * 
+   * @param pos The position in meters
+   */
+  void setPosition(float pos[NUM_AXIS]);
+  
+  /**
+   * @brief Return the cartesian position of the head at the end of the moves queued by queueMoveTo()
+   * 
+   * @param axis The axis
+   * @return The position in meters
+   */
+  float getPosition(int axis);
+  
+  /**
+   * @brief Select the kinematics used by queueMoveTo()
+   * @details Takes the values of Path.axis_config. AXIS_CONFIG_DELTA uses the parameters given to setDeltaKinematics().
+   * 
+   * @param axisConfig AXIS_CONFIG_XY, AXIS_CONFIG_H_BELT, AXIS_CONFIG_CORE_XY or AXIS_CONFIG_DELTA
+   */
+  void setAxisConfig(int axisConfig);
+  
+  /**
+   * @brief Use the kinematics of a Delta printer in queueMoveTo()
+   * @details Same parameters as Delta.py, all in meters.
+   * 
+   * @param L The length of the rods
+   * @param r The radius of the columns
+   * @param Ae The offset of the effector joint of the column A
+   * @param Be The offset of the effector joint of the column B
+   * @param Ce The offset of the effector joint of the column C
+   * @param Hez The distance of the head below the effector
+   */
+  void setDeltaKinematics(float L, float r, float Ae, float Be, float Ce, float Hez);
+  
   /**
    * @brief Run the path planner thread
    * @details Run the path planner thread that is in charge to compute the different delays and submit it to the PRU for execution.
@@ -261,6 +588,100 @@ public:
    */
   void setMaxJerk(float maxJerk, float maxZJerk);
 
+  /**
+   * @brief Send the moves as trapezoid descriptors instead of one command per step
+   * @details When enabled, the PRU computes the Bresenham algorithm and the acceleration ramp of each move itself, 
+   * so that a move only takes a few dozen bytes in DDR whatever its number of steps. 
+   * The per step commands are used when disabled, which is the default. Can be changed while printing, it applies 
+   * from the next line sent to the PRU.
+   *
+   * @param enabled true to send trapezoid descriptors
+   */
+  void setTrapezoidCommands(bool enabled);
+
+  /**
+   * @brief Adapt the buffering of the moves to the measured latency of the host
+   * @details When enabled, the PRU time kept queued follows the wake-up latency of the path planner thread and the 
+   * times the PRU ran out of moves, between ADAPTIVE_BUFFERED_MOVE_TIME_MIN and ADAPTIVE_BUFFERED_MOVE_TIME_MAX. 
+   * Before printing, the ring is filled with twice that time of moves, waiting for each new line a few times the 
+   * longest time measured between two lines. When disabled, which is the default, MIN_BUFFERED_MOVE_TIME of moves 
+   * is kept queued and the ring is filled by half, waiting up to PRINT_MOVE_BUFFER_WAIT for each line.
+   *
+   * @param enabled true to adapt the buffering
+   */
+  void setAdaptiveBuffering(bool enabled);
+  
+  /**
+   * @brief Compute the acceleration ramps with the incremental fixed point algorithm
+   * @details When enabled, the intervals of the acceleration and deceleration phases are updated step by step without 
+   * division from the exact acceleration of the move, instead of being computed from the elapsed time with a division 
+   * per step. The move times are then within a few cycles of the theoretical ones. Only applies to the per step 
+   * commands, the PRU always uses the time based ramp for the trapezoid descriptors. Disabled by default, see 
+   * INCREMENTAL_RAMP_DEFAULT: it is more accurate, not faster.
+   *
+   * @param enabled true to use the incremental ramp
+   */
+  void setIncrementalRamp(bool enabled);
+
+  /**
+   * @brief Set the number of threads generating the step commands of the moves in advance
+   * @details The commands of a move do not change anymore once its start and end speeds are fixed, so the workers 
+   * generate them in parallel for the moves waiting in the queue while the path planner thread sends them to the PRU in order.
+   * With 0 workers, the commands are generated by the path planner thread just before being sent. Defaults to one worker 
+   * per core beside the one of the path planner thread, takes effect at the next call to runThread().
+   *
+   * @param workers The number of worker threads
+   */
+  void setStepGenerationWorkers(unsigned int workers);
+
+  /**
+   * @brief Return the number of moves whose acceleration ramp was found in the ramp cache
+   * @details Moves sharing the same acceleration, speeds and ramp lengths reuse the intervals computed for a previous move.
+   *
+   * @return The number of cache hits since the creation of the path planner
+   */
+  unsigned long getRampCacheHits();
+
+  /**
+   * @brief Return the number of moves whose acceleration ramp had to be computed
+   * @details Moves with ramps longer than RAMP_CACHE_MAX_STEPS are neither counted as hits nor as misses.
+   *
+   * @return The number of cache misses since the creation of the path planner
+   */
+  unsigned long getRampCacheMisses();
+
+  /**
+   * @brief Return the hit rate of the ramp cache
+   * @details Ratio of the hits over all the lookups, 0 if no lookup has been done yet.
+   *
+   * @return The hit rate, between 0 and 1
+   */
+  float getRampCacheHitRate();
+
+  /**
+   * @brief Return the memory of the command arena used by the lines of the path planner
+   * @details The step commands of the lines are stored in fixed size chunks allocated from an arena created with the path planner.
+   *
+   * @return The memory used in bytes
+   */
+  unsigned long getCommandArenaUsage();
+
+  /**
+   * @brief Return the maximum memory of the command arena used at the same time
+   * @details Can be compared with COMMAND_ARENA_CHUNKS to size the arena.
+   *
+   * @return The high water mark in bytes
+   */
+  unsigned long getCommandArenaHighWater();
+
+  /**
+   * @brief Return the number of chunks allocated on the heap because the command arena was full
+   * @details Should stay 0, the generation workers wait for free chunks instead of filling the arena.
+   *
+   * @return The number of heap allocations
+   */
+  unsigned long getCommandArenaHeapAllocations();
+
   void suspend();
   
   void resume();
@@ -271,4 +692,27 @@ public:
 
 };
 
+/* Axis configurations of setAxisConfig(), same values as Path.axis_config */
+#define AXIS_CONFIG_XY 0
+#define AXIS_CONFIG_H_BELT 1
+#define AXIS_CONFIG_CORE_XY 2
+#define AXIS_CONFIG_DELTA 3
+
+/* Flags of the moves given to queueMoves() */
+#define MOVE_FLAG_CANCELABLE 1
+#define MOVE_FLAG_OPTIMIZE 2
+
+%extend PathPlanner {
+  /**
+   * @brief Queue several line moves at once
+   * @details Same as calling queueMove() for each move, but the arrays are read in place through the buffer protocol 
+   * and the GIL is released once for the whole batch. The arrays must be C contiguous, numpy arrays for instance.
+   * 
+   * @param deltas float32 array of N*NUM_AXIS values, the moves of each axis in meters
+   * @param steps float32 array of N*NUM_AXIS values, the number of steps of each axis
+   * @param speeds float32 array of N values, the feedrate of each move in m/s
+   * @param flags uint8 array of N values, MOVE_FLAG_CANCELABLE and MOVE_FLAG_OPTIMIZE combination for each move
+   */
+  PyObject* queueMoves(PyObject* deltas, PyObject* steps, PyObject* speeds, PyObject* flags);
+};
 
@@ -0,0 +1,173 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#include "PruBackend.h"
+
+#include <unistd.h>
+#include <fstream>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "prussdrv.h"
+#include "pruss_intc_mapping.h"
+#include "Logger.h"
+
+#define PRU_NUM0	  0
+#define PRU_NUM1	  1
+
+HardwarePru::HardwarePru() {
+	ddr_mem = 0;
+	mem_fd=-1;
+	ddr_addr = 0;
+	ddr_size = 0;
+}
+
+bool HardwarePru::init(const std::string &firmware_stepper, const std::string &firmware_endstops) {
+	unsigned int ret;
+    tpruss_intc_initdata pruss_intc_initdata = PRUSS_INTC_INITDATA;
+	
+	firmwareStepper = firmware_stepper;
+	firmwareEndstop = firmware_endstops;
+	
+    LOG_INFO(LOG_PRU, "Initializing PRU..." << std::endl);
+	
+    /* Initialize the PRU */
+    prussdrv_init ();
+	
+    /* Open PRU Interrupt */
+    ret = prussdrv_open(PRU_EVTOUT_0);
+    if (ret)
+    {
+        LOG_ERROR(LOG_PRU, "prussdrv_open failed" << std::endl);
+        return false;
+    }
+	
+    /* Get the interrupt initialized */
+    prussdrv_pruintc_init(&pruss_intc_initdata);
+	
+	
+	std::ifstream faddr("/sys/class/uio/uio0/maps/map1/addr");
+	
+	if(!faddr.good()) {
+		LOG_ERROR(LOG_DDR, "Failed to read /sys/class/uio/uio0/maps/map1/addr\n");
+        return false;
+	}
+	
+	std::ifstream fsize("/sys/class/uio/uio0/maps/map1/size");
+	
+	if(!faddr.good()) {
+		LOG_ERROR(LOG_DDR, "Failed to read /sys/class/uio/uio0/maps/map1/size\n");
+        return false;
+	}
+	
+	std::string s;
+	
+	std::getline(faddr, s);
+	
+	ddr_addr = std::stoul(s, nullptr, 16);
+	
+	std::getline(fsize, s);
+	
+	ddr_size = std::stoul(s, nullptr, 16);
+	
+	if(!ddr_size || !ddr_addr) {
+		LOG_ERROR(LOG_DDR, "Unable to find DDR address and size for PRU" << std::endl);
+		return false;
+	}
+	
+	LOG_INFO(LOG_DDR, "The DDR memory reserved for the PRU is 0x" << std::hex <<  ddr_size << " and has addr 0x" <<  std::hex <<  ddr_addr << std::endl);
+	
+    /* open the device */
+    mem_fd = open("/dev/mem", O_RDWR | O_SYNC);
+    if (mem_fd < 0) {
+        LOG_ERROR(LOG_DDR, "Failed to open /dev/mem " << strerror(errno) << std::endl);;
+        return false;
+    }
+	
+    /* map the memory */
+    ddr_mem = (uint8_t*)mmap(0, ddr_size, PROT_WRITE | PROT_READ, MAP_SHARED, mem_fd, ddr_addr);
+    
+	if (ddr_mem == NULL) {
+        LOG_ERROR(LOG_DDR, "Failed to map the device "<< strerror(errno) << std::endl);
+        close(mem_fd);
+        return false;
+    }
+	
+	LOG_DEBUG(LOG_DDR, "Mapped memory starting at 0x" << std::hex << (unsigned long)ddr_mem << std::endl << std::dec);
+	
+	return true;
+}
+
+void HardwarePru::start() {
+	//Set DDR location for PRU
+	//pypruss.pru_write_memory(0, 0, [self.ddr_addr, self.ddr_nr_events, 0])
+	uint32_t ddrstartData[3];
+	ddrstartData[0] = (uint32_t)ddr_addr;
+	ddrstartData[1] = (uint32_t)(ddr_addr+ddr_size-4);
+	ddrstartData[2] = (uint32_t)(ddr_addr+ddr_size-8); //PRU control register address
+	
+	prussdrv_pru_write_memory(PRUSS0_PRU0_DATARAM, 0, ddrstartData, sizeof(ddrstartData));
+	
+	/* Execute firmwares on PRU */
+    LOG_INFO(LOG_PRU, "Starting stepper firmware on PRU0" << std::endl);
+	unsigned int ret = prussdrv_exec_program (PRU_NUM0, firmwareStepper.c_str());
+	if(ret!=0) {
+		LOG_WARNING(LOG_PRU, "Unable to execute firmware on PRU0" << std::endl);
+	}
+	
+    LOG_INFO(LOG_PRU, "Starting endstop firmware on PRU1" << std::endl);
+    ret=prussdrv_exec_program (PRU_NUM1, firmwareEndstop.c_str());
+	if(ret!=0) {
+		LOG_WARNING(LOG_PRU, "Unable to execute firmware on PRU1" << std::endl);
+	}
+}
+
+void HardwarePru::halt() {
+	prussdrv_pru_disable(PRU_NUM0);
+	prussdrv_pru_disable(PRU_NUM1);
+}
+
+bool HardwarePru::waitEvent(unsigned int timeoutMs) {
+	unsigned int nbWaitedEvent = prussdrv_pru_wait_event (PRU_EVTOUT_0,timeoutMs);
+	
+	if(nbWaitedEvent)
+		prussdrv_pru_clear_event (PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+	
+	return nbWaitedEvent != 0;
+}
+
+void HardwarePru::release() {
+	/* Disable PRU and close memory mapping*/
+    prussdrv_pru_disable (PRU_NUM0);
+    prussdrv_pru_disable (PRU_NUM1);
+    prussdrv_exit ();
+	
+	if(ddr_mem) {
+		munmap(ddr_mem, ddr_size);
+		close(mem_fd);
+		ddr_mem = NULL;
+		mem_fd=-1;
+	}
+}
@@ -0,0 +1,147 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#ifndef __PathPlanner__PruBackend__
+#define __PathPlanner__PruBackend__
+
+#include <stdint.h>
+#include <string>
+
+/* Written by the host at the end of the last block before the end of the DDR, the PRU then reads from the start again */
+#define DDR_MAGIC			0xbabe7175
+
+/**
+ * @brief Store a word of the DDR read by the PRU, after all the previous stores to the DDR
+ * @details The C++ fences only order the accesses of the inner shareable domain on ARM, the PRU is outside of it so 
+ * the barrier covers the full system.
+ */
+static inline void ddrPublish(uint32_t* location, uint32_t value) {
+#ifdef __arm__
+	__asm__ __volatile__("dmb st" ::: "memory");
+#endif
+	__atomic_store_n(location, value, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Load a word of the DDR written by the PRU, before the next loads from the DDR
+ */
+static inline uint32_t ddrAcquire(const uint32_t* location) {
+	uint32_t value = __atomic_load_n(location, __ATOMIC_ACQUIRE);
+#ifdef __arm__
+	__asm__ __volatile__("dmb sy" ::: "memory");
+#endif
+	return value;
+}
+
+/**
+ * What executes the commands written by PruTimer in the DDR memory.
+ *
+ * The DDR holds the blocks of commands, each starting with its number of commands, followed by the stepper commands 
+ * or the trapezoid descriptors. A block count of 0 makes the PRU wait, DDR_MAGIC makes it start again at the beginning 
+ * of the DDR. The last 4 bytes of the DDR are the number of blocks done, incremented by the PRU after each block, and 
+ * the 4 bytes before are the control register, the PRU is suspended while it is not 0.
+ *
+ * A block is published by writing its commands, then the count following them (0, or DDR_MAGIC to wrap), then its own 
+ * count with ddrPublish(). The PRU only reads a block after finding a non zero count, so it never sees a partial block.
+ */
+class PruBackend {
+public:
+	virtual ~PruBackend() {}
+	
+	/**
+	 * @brief Allocate the DDR memory shared with the PRU
+	 *
+	 * @param firmwareStepper The firmware of the PRU executing the commands
+	 * @param firmwareEndstop The firmware of the PRU watching the end stops
+	 * @return false if the memory cannot be allocated
+	 */
+	virtual bool init(const std::string& firmwareStepper, const std::string& firmwareEndstop) = 0;
+	
+	virtual uint8_t* getDDRMemory() = 0;
+	
+	/**
+	 * @brief Return the address of the DDR memory as seen by the PRU
+	 */
+	virtual unsigned long getDDRAddress() = 0;
+	
+	virtual unsigned long getDDRSize() = 0;
+	
+	/**
+	 * @brief Start executing the commands from the beginning of the DDR
+	 * @details The DDR registers have been reset by PruTimer before.
+	 */
+	virtual void start() = 0;
+	
+	/**
+	 * @brief Stop executing the commands, start() can be called again after
+	 */
+	virtual void halt() = 0;
+	
+	/**
+	 * @brief Wait until the PRU signals that a block is done
+	 *
+	 * @param timeoutMs The maximum time to wait in ms
+	 * @return false on timeout
+	 */
+	virtual bool waitEvent(unsigned int timeoutMs) = 0;
+	
+	/**
+	 * @brief Stop executing the commands and free the DDR memory
+	 */
+	virtual void release() = 0;
+};
+
+/**
+ * The PRUs of the BeagleBone, through prussdrv and /dev/mem.
+ */
+class HardwarePru : public PruBackend {
+private:
+	std::string firmwareStepper, firmwareEndstop;
+	unsigned long ddr_addr;
+	unsigned long ddr_size;
+	int mem_fd;
+	uint8_t *ddr_mem;
+	
+public:
+	HardwarePru();
+	
+	virtual bool init(const std::string& firmwareStepper, const std::string& firmwareEndstop);
+	
+	virtual uint8_t* getDDRMemory() {
+		return ddr_mem;
+	}
+	
+	virtual unsigned long getDDRAddress() {
+		return ddr_addr;
+	}
+	
+	virtual unsigned long getDDRSize() {
+		return ddr_size;
+	}
+	
+	virtual void start();
+	virtual void halt();
+	virtual bool waitEvent(unsigned int timeoutMs);
+	virtual void release();
+};
+
+#endif /* defined(__PathPlanner__PruBackend__) */
@@ -25,130 +25,61 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <fstream>
-#include <sys/mman.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
 #include <assert.h>
-#include "prussdrv.h"
-#include "pruss_intc_mapping.h"
 #include <cmath>
+#include <climits>
 #include "StepperCommand.h"
-
-#define PRU_NUM0	  0
-#define PRU_NUM1	  1
-
-#define DDR_MAGIC			0xbabe7175
+#include "StepperTrapezoid.h"
+#include "VirtualPru.h"
+#include "Trace.h"
+#include "config.h"
 
 PruTimer::PruTimer() {
+	backend = NULL;
 	ddr_mem = 0;
-	mem_fd=-1;
-	ddr_addr = 0;
 	ddr_size = 0;
 	totalQueuedMovesTime = 0;
 	ddr_mem_used = 0;
 	stop = false;
+	
+	ddrMemHighWater = 0;
+	queuedMovesTimeMin = ULONG_MAX;
+	starvations = 0;
+	starving = false;
+	lowMoveTimeWaitTime = 0;
+	ddrSpaceWaitTime = 0;
+	movesPending = false;
 }
 
 bool PruTimer::initPRU(const std::string &firmware_stepper, const std::string &firmware_endstops) {
-	std::unique_lock<std::mutex> lk(mutex_memory);
-	
-	firmwareStepper = firmware_stepper;
-	firmwareEndstop = firmware_endstops;
-	
 #ifdef DEMO_PRU
-	ddr_size=0x40000;
-	
-	ddr_mem = (uint8_t*)malloc(ddr_size);
-	ddr_addr = (unsigned long)ddr_mem;
-	
-	LOG( "The DDR memory reserved for the PRU is 0x" << std::hex <<  ddr_size << " and has addr 0x" <<  std::hex <<  ddr_addr << std::endl);
-	
-	if (ddr_mem == NULL) {
-        return false;
-    }
-	
-	ddr_write_location  = ddr_mem;
-	ddr_nr_events  = (uint32_t*)(ddr_mem+ddr_size-4);
-	ddr_mem_end = ddr_mem+ddr_size-8;
-	pru_control = (uint32_t*)(ddr_mem+ddr_size-8);
-	
-	*((uint32_t*)ddr_write_location)=0; //So that the PRU waits
-	*ddr_nr_events = 0;
-	
-	currentReadingAddress = ddr_write_location;
+	return initBackend(new VirtualPru(true), firmware_stepper, firmware_endstops);
 #else
-	unsigned int ret;
-    tpruss_intc_initdata pruss_intc_initdata = PRUSS_INTC_INITDATA;
-	
-    LOG( "Initializing PRU..." << std::endl);
-	
-    /* Initialize the PRU */
-    prussdrv_init ();
-	
-    /* Open PRU Interrupt */
-    ret = prussdrv_open(PRU_EVTOUT_0);
-    if (ret)
-    {
-        LOG( "prussdrv_open failed" << std::endl);
-        return false;
-    }
-	
-    /* Get the interrupt initialized */
-    prussdrv_pruintc_init(&pruss_intc_initdata);
-	
-	
-	std::ifstream faddr("/sys/class/uio/uio0/maps/map1/addr");
-	
-	if(!faddr.good()) {
-		LOG( "Failed to read /sys/class/uio/uio0/maps/map1/addr\n");
-        return false;
-	}
-	
-	std::ifstream fsize("/sys/class/uio/uio0/maps/map1/size");
+	return initBackend(new HardwarePru(), firmware_stepper, firmware_endstops);
+#endif
+}
+
+bool PruTimer::initVirtualPRU(bool realTime) {
+	return initBackend(new VirtualPru(realTime), "", "");
+}
+
+bool PruTimer::initBackend(PruBackend* pru, const std::string &firmware_stepper, const std::string &firmware_endstops) {
+	std::unique_lock<std::mutex> lk(mutex_memory);
 	
-	if(!faddr.good()) {
-		LOG( "Failed to read /sys/class/uio/uio0/maps/map1/size\n");
-        return false;
+	if(backend) {
+		backend->release();
+		delete backend;
 	}
 	
-	std::string s;
-	
-	std::getline(faddr, s);
-	
-	ddr_addr = std::stoul(s, nullptr, 16);
-	
-	std::getline(fsize, s);
+	backend = pru;
+	ddr_mem = NULL;
 	
-	ddr_size = std::stoul(s, nullptr, 16);
-	
-	if(!ddr_size || !ddr_addr) {
-		LOG("[ERROR] Unable to find DDR address and size for PRU" << std::endl);
+	if(!backend->init(firmware_stepper, firmware_endstops)) {
 		return false;
 	}
 	
-	LOG( "The DDR memory reserved for the PRU is 0x" << std::hex <<  ddr_size << " and has addr 0x" <<  std::hex <<  ddr_addr << std::endl);
-	
-    /* open the device */
-    mem_fd = open("/dev/mem", O_RDWR | O_SYNC);
-    if (mem_fd < 0) {
-        LOG( "Failed to open /dev/mem " << strerror(errno) << std::endl);;
-        return false;
-    }
-	
-    /* map the memory */
-    ddr_mem = (uint8_t*)mmap(0, ddr_size, PROT_WRITE | PROT_READ, MAP_SHARED, mem_fd, ddr_addr);
-    
-	if (ddr_mem == NULL) {
-        LOG( "Failed to map the device "<< strerror(errno) << std::endl);
-        close(mem_fd);
-        return false;
-    }
-	
-	LOG( "Mapped memory starting at 0x" << std::hex << (unsigned long)ddr_mem << std::endl << std::dec);
-	
-	
+	ddr_mem = backend->getDDRMemory();
+	ddr_size = backend->getDDRSize();
 	
 	ddr_write_location  = ddr_mem;
 	ddr_nr_events  = (uint32_t*)(ddr_mem+ddr_size-4);
@@ -157,30 +88,7 @@ bool PruTimer::initPRU(const std::string &firmware_stepper, const std::string &f
 	
 	initalizePRURegisters();
 	
-	//bzero(ddr_mem, ddr_size);
-	
-    /* Execute firmwares on PRU */
-    LOG( ("\tINFO: Starting stepper firmware on PRU0\r\n"));
-	ret = prussdrv_exec_program (PRU_NUM0, firmware_stepper.c_str());
-	if(ret!=0) {
-		LOG( "[WARNING] Unable to execute firmware on PRU0" << std::endl);
-	}
-	
-    LOG( ("\tINFO: Starting endstop firmware on PRU1\r\n"));
-    ret=prussdrv_exec_program (PRU_NUM1, firmware_endstops.c_str());
-	if(ret!=0) {
-		LOG( "[WARNING] Unable to execute firmware on PRU1" << std::endl);
-	}
-	
-	//std::this_thread::sleep_for( std::chrono::milliseconds( 1000 ) );
-	
-	/*prussdrv_pru_wait_event (PRU_EVTOUT_0);
-	 
-	 printf("\tINFO: PRU0 completed transfer of endstop.\r\n");
-	 
-	 prussdrv_pru_clear_event (PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);*/
-	
-#endif
+	backend->start();
 	
 	ddr_mem_used = 0;
 	blocksID = std::queue<BlockDef>();
@@ -191,46 +99,27 @@ bool PruTimer::initPRU(const std::string &firmware_stepper, const std::string &f
 }
 
 void PruTimer::initalizePRURegisters() {
+	ddr_write_location = ddr_mem;
+	
 	*((uint32_t*)ddr_write_location)=0; //So that the PRU waits
 	*ddr_nr_events = 0;
 	*pru_control = 0;
-	
-	//Set DDR location for PRU
-	//pypruss.pru_write_memory(0, 0, [self.ddr_addr, self.ddr_nr_events, 0])
-	uint32_t ddrstartData[3];
-	ddrstartData[0] = (uint32_t)ddr_addr;
-	ddrstartData[1] = (uint32_t)(ddr_addr+ddr_size-4);
-	ddrstartData[2] = (uint32_t)(ddr_addr+ddr_size-8); //PRU control register address
-	
-	prussdrv_pru_write_memory(PRUSS0_PRU0_DATARAM, 0, ddrstartData, sizeof(ddrstartData));
-	
-	
 }
 
 PruTimer::~PruTimer() {
-	
+	delete backend;
 }
 
 void PruTimer::reset() {
 	std::unique_lock<std::mutex> lk(mutex_memory);
 	
-	prussdrv_pru_disable(0);
-	prussdrv_pru_disable(1);
+	if(!backend || !ddr_mem) return;
 	
-	initalizePRURegisters();
+	backend->halt();
 	
-	/* Execute firmwares on PRU */
-    LOG( ("\tINFO: Starting stepper firmware on PRU0\r\n"));
-	unsigned int ret = prussdrv_exec_program (PRU_NUM0, firmwareStepper.c_str());
-	if(ret!=0) {
-		LOG( "[WARNING] Unable to execute firmware on PRU0" << std::endl);
-	}
+	initalizePRURegisters();
 	
-    LOG( ("\tINFO: Starting endstop firmware on PRU1\r\n"));
-    ret=prussdrv_exec_program (PRU_NUM1, firmwareEndstop.c_str());
-	if(ret!=0) {
-		LOG( "[WARNING] Unable to execute firmware on PRU1" << std::endl);
-	}
+	backend->start();
 	
 	totalQueuedMovesTime = 0;
 	ddr_mem_used = 0;
@@ -243,51 +132,66 @@ void PruTimer::runThread() {
 	stop=false;
 	
 	if(!ddr_nr_events || !ddr_mem) {
-		LOG( "Cannot run PruTimer when not initialized" << std::endl);
+		LOG_ERROR(LOG_PRU, "Cannot run PruTimer when not initialized" << std::endl);
 		return;
 	}
 	
 	runningThread = std::thread([this]() {
+		Tracer::setThreadName("PRU events");
 		this->run();
 	});
 }
 
 void PruTimer::stopThread(bool join) {
-	LOG( "Stopping PruTimer..." << std::endl);
+	LOG_INFO(LOG_PRU, "Stopping PruTimer..." << std::endl);
 	stop=true;
 	
-	/* Disable PRU and close memory mapping*/
-    prussdrv_pru_disable (PRU_NUM0);
-    prussdrv_pru_disable (PRU_NUM1);
-    prussdrv_exit ();
+	if(backend)
+		backend->halt();
 	
-	if(ddr_mem) {
-#ifdef DEMO_PRU
-		free(ddr_mem);
-		ddr_mem = NULL;
-#else
-		munmap(ddr_mem, ddr_size);
-		close(mem_fd);
+	blockAvailable.notify_all();
+	if(join && runningThread.joinable()) {
+		runningThread.join();
+	}
+	
+	{
+		std::lock_guard<std::mutex> lk(mutex_memory);
+		
+		/* Disable PRU and close memory mapping*/
+		if(backend)
+			backend->release();
+		
 		ddr_mem = NULL;
-		mem_fd=-1;
-#endif
 	}
     
-	LOG( "PRU disabled, DDR released, FD closed." << std::endl);
+	LOG_INFO(LOG_PRU, "PRU disabled, DDR released, FD closed." << std::endl);
 	
+	LOG_INFO(LOG_PRU, "PruTimer stopped." << std::endl);
+}
+
+/* PRU cycles taken by the execution of the commands of a block, a block of trapezoids only contains trapezoids */
+static unsigned long blockCycles(const uint8_t* commands, size_t size, unsigned int unit) {
+	if(!size)
+		return 0;
 	
-	blockAvailable.notify_all();
-	if(join && runningThread.joinable()) {
-		runningThread.join();
+	if(!(((const SteppersCommand*)commands)->options & STEPPER_COMMAND_OPTION_TRAPEZOID))
+		return steppersCommandsCycles((const SteppersCommand*)commands, size/sizeof(SteppersCommand));
+	
+	uint64_t cycles = 0;
+	
+	for(size_t i=0; i<size; i+=unit) {
+		cycles += steppersTrapezoidCycles(*(const SteppersTrapezoid*)(commands+i));
 	}
 	
-	LOG( "PruTimer stopped." << std::endl);
+	return cycles;
 }
 
-void PruTimer::push_block(uint8_t* blockMemory, size_t blockLen, unsigned int unit, unsigned int pathID, unsigned long totalTime) {
+void PruTimer::push_block(uint8_t* blockMemory, size_t blockLen, unsigned int unit, unsigned int pathID) {
 	
 	if(!ddr_write_location) return;
 	
+	TRACE_SCOPE(TRACE_PUSH_BLOCK, pathID);
+	
 	//Split the block in smaller blocks if needed
 	size_t nbBlocks = ceil((blockLen+12)/(float)(ddr_size-12));
 	
@@ -301,7 +205,7 @@ void PruTimer::push_block(uint8_t* blockMemory, size_t blockLen, unsigned int un
 	
 	assert(blockSize*nbBlocks>=blockLen);
 	
-	size_t nbStepsWritten = 0;
+	size_t nbCommandsWritten = 0;
 	
 	for(unsigned int i=0;i<nbBlocks;i++) {
 		
@@ -321,7 +225,15 @@ void PruTimer::push_block(uint8_t* blockMemory, size_t blockLen, unsigned int un
 			//LOG( "Waiting for " << std::dec << currentBlockSize+12 << " bytes available. Currently: " << getFreeMemory() << std::endl);
 			
 			std::unique_lock<std::mutex> lk(mutex_memory);
-			blockAvailable.wait(lk, [this,currentBlockSize]{ return ddr_size-ddr_mem_used-8>=currentBlockSize+12 || stop; });
+			auto spaceAvailable = [this,currentBlockSize]{ return ddr_size-ddr_mem_used-8>=currentBlockSize+12 || stop; };
+			
+			if(!spaceAvailable()) {
+				auto start = std::chrono::steady_clock::now();
+				TRACE_BEGIN(TRACE_DDR_SPACE_WAIT, currentBlockSize);
+				blockAvailable.wait(lk, spaceAvailable);
+				TRACE_END(TRACE_DDR_SPACE_WAIT, currentBlockSize);
+				ddrSpaceWaitTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-start).count();
+			}
 			
 			if(!ddr_mem || stop) return;
 			
@@ -343,15 +255,11 @@ void PruTimer::push_block(uint8_t* blockMemory, size_t blockLen, unsigned int un
 					//LOG( "No more space at 0x" << std::hex << ddr_write_location << ". Resetting DDR..." << std::endl);
 					uint32_t nb;
 	
-					//First put 0 for next command
+					//First put 0 for next command, the PRU must find it before it can see the wrap
 					nb=0;
 					memcpy(ddr_mem, &nb, sizeof(nb));
-					msync(ddr_mem, sizeof(nb), MS_SYNC);
-					
-					nb=DDR_MAGIC;
-					memcpy(ddr_write_location, &nb, sizeof(nb));
 					
-					msync(ddr_write_location, sizeof(nb), MS_SYNC);
+					ddrPublish((uint32_t*)ddr_write_location, DDR_MAGIC);
 					
 					//It is now the begining
 					ddr_write_location=ddr_mem;
@@ -371,11 +279,12 @@ void PruTimer::push_block(uint8_t* blockMemory, size_t blockLen, unsigned int un
 				}
 				
 				assert(maxSize>0);
-				unsigned long t = currentBlockSize-maxSize > 0 ? totalTime/2 : totalTime;
-				blocksID.emplace(maxSize+4,t); //FIXME: TotalTime is not /2 but doesn't it to be precise to make it work...
+				unsigned long t = blockCycles(blockStart, maxSize, unit);
+				blocksID.emplace(maxSize+4,t);
 				
 				ddr_mem_used+=maxSize+4;
 				totalQueuedMovesTime += t;
+				starving = false;
 				
 				//First copy the data
 				//LOG( std::dec << "Writing " << maxSize+4 << " bytes to 0x" << std::hex << (unsigned long)ddr_write_location << std::endl);
@@ -398,25 +307,19 @@ void PruTimer::push_block(uint8_t* blockMemory, size_t blockLen, unsigned int un
 				if(!resetDDR) {
 					nb=0;
 					memcpy(ddr_mem, &nb, sizeof(nb));
-					msync(ddr_mem, sizeof(nb), MS_SYNC);
 				}
 				
-				//Need it?
-				msync(ddr_write_location+4, maxSize+4, MS_SYNC);
-				
-				//Then signal how much data we have to the PRU
+				//Then signal how much data we have to the PRU, after the data and the next count
 				nb = (uint32_t)maxSize/unit;
 				
-				nbStepsWritten+=nb;
+				nbCommandsWritten+=nb;
 				
-				memcpy(ddr_write_location, &nb, sizeof(nb));
+				ddrPublish((uint32_t*)ddr_write_location, nb);
 				
 				//LOG( "Written " << std::dec << maxSize << " bytes of stepper commands." << std::endl);
 				
 				//LOG( "Remaining free memory: " << std::dec << ddr_size-ddr_mem_used << " bytes." << std::endl);
 				
-				msync(ddr_write_location, 4, MS_SYNC);
-				
 				
 				if(resetDDR) {
 					ddr_write_location+=maxSize+sizeof(nb);;
@@ -435,10 +338,11 @@ void PruTimer::push_block(uint8_t* blockMemory, size_t blockLen, unsigned int un
 					assert(remainingSize == (remainingSize/unit)*unit);
 
 					
-					blocksID.emplace(remainingSize+4,totalTime-t); //FIXME: TotalTime is not /2 but doesn't it to be precise to make it work...
+					unsigned long remainingTime = blockCycles(blockStart+maxSize, remainingSize, unit);
+					blocksID.emplace(remainingSize+4,remainingTime);
 					
 					ddr_mem_used+=remainingSize+4;
-					totalQueuedMovesTime += totalTime-t;
+					totalQueuedMovesTime += remainingTime;
 					
 
 					assert(ddr_write_location+remainingSize+sizeof(nb)*2<=ddr_mem_end);
@@ -457,21 +361,16 @@ void PruTimer::push_block(uint8_t* blockMemory, size_t blockLen, unsigned int un
 					
 					memcpy(ddr_write_location+remainingSize+sizeof(nb), &nb, sizeof(nb));
 					
-					//Need it?
-					msync(ddr_write_location+sizeof(nb), remainingSize, MS_SYNC);
-					
 					//Then signal how much data we have to the PRU
 					nb = (uint32_t)remainingSize/unit;
-					nbStepsWritten+=nb;
+					nbCommandsWritten+=nb;
 					//LOG( std::hex << "Writing nb command to 0x" << (unsigned long)ddr_write_location << std::endl);
-					memcpy(ddr_write_location, &nb, sizeof(nb));
+					ddrPublish((uint32_t*)ddr_write_location, nb);
 					
 					//LOG( "Written " << std::dec << remainingSize << " bytes of stepper commands." << std::endl);
 					
 					//LOG( "Remaining free memory: " << std::dec << ddr_size-ddr_mem_used << " bytes." << std::endl);
 					
-					msync(ddr_write_location, sizeof(nb), MS_SYNC);
-					
 					//It is now the begining
 					ddr_write_location+=remainingSize+sizeof(nb);
 					
@@ -481,10 +380,12 @@ void PruTimer::push_block(uint8_t* blockMemory, size_t blockLen, unsigned int un
 				
 			} else {
 				
-				blocksID.emplace(currentBlockSize+4,totalTime); //FIXME: TotalTime is not /2 but doesn't it to be precise to make it work...
+				unsigned long t = blockCycles(blockStart, currentBlockSize, unit);
+				blocksID.emplace(currentBlockSize+4,t);
 				
 				ddr_mem_used+=currentBlockSize+4;
-				totalQueuedMovesTime += totalTime;
+				totalQueuedMovesTime += t;
+				starving = false;
 
 
 				//First copy the data
@@ -498,13 +399,11 @@ void PruTimer::push_block(uint8_t* blockMemory, size_t blockLen, unsigned int un
 				
 				assert(ddr_write_location+currentBlockSize+sizeof(nb)*2<=ddr_mem_end);
 				memcpy(ddr_write_location+currentBlockSize+sizeof(nb), &nb, sizeof(nb));
-				//Need it?
-				msync(ddr_write_location+sizeof(nb), currentBlockSize, MS_SYNC);
 				//Then signal how much data we have to the PRU
 				nb = (uint32_t)currentBlockSize/unit;
-				nbStepsWritten+=nb;
+				nbCommandsWritten+=nb;
 				//LOG( std::hex << "Writing nb command to 0x" << (unsigned long)ddr_write_location << std::endl);
-				memcpy(ddr_write_location, &nb, sizeof(nb));
+				ddrPublish((uint32_t*)ddr_write_location, nb);
 				
 				//LOG( "Written " << std::dec << currentBlockSize << " bytes of stepper commands." << std::endl);
 				
@@ -512,15 +411,15 @@ void PruTimer::push_block(uint8_t* blockMemory, size_t blockLen, unsigned int un
 				
 				ddr_write_location+=currentBlockSize+sizeof(nb);
 				
-				msync(ddr_write_location, sizeof(nb), MS_SYNC);
-				
 			}
 			
-			
+			ddrMemHighWater = std::max(ddrMemHighWater, ddr_mem_used);
 		}
+		
+		TRACE_INSTANT(TRACE_BLOCK_PUBLISHED, currentBlockSize/unit);
 	}
 	
-	assert(nbStepsWritten == blockLen/unit);
+	assert(nbCommandsWritten == blockLen/unit);
 	
 }
 
@@ -531,62 +430,39 @@ void PruTimer::waitUntilFinished() {
     });
 }
 
-void PruTimer::waitUntilLowMoveTime(unsigned long lowMoveTimeTicks) {
+uint64_t PruTimer::waitUntilLowMoveTime(unsigned long lowMoveTimeTicks) {
 	std::unique_lock<std::mutex> lk(mutex_memory);
-	blockAvailable.wait(lk, [this,lowMoveTimeTicks]{ LOG("Current wait " << totalQueuedMovesTime << "/" << lowMoveTimeTicks <<  std::endl); return totalQueuedMovesTime<lowMoveTimeTicks || stop; });
+	auto lowMoveTime = [this,lowMoveTimeTicks]{ return totalQueuedMovesTime<lowMoveTimeTicks || stop; };
+	
+	if(!lowMoveTime()) {
+		LOG_RATE_LIMITED(LOG_DDR, LOG_LEVEL_DEBUG, LOG_HOT_INTERVAL, "Current wait " << totalQueuedMovesTime << "/" << lowMoveTimeTicks <<  std::endl);
+		
+		auto start = std::chrono::steady_clock::now();
+		TRACE_BEGIN(TRACE_LOW_MOVE_TIME_WAIT, totalQueuedMovesTime);
+		blockAvailable.wait(lk, lowMoveTime);
+		TRACE_END(TRACE_LOW_MOVE_TIME_WAIT, totalQueuedMovesTime);
+		
+		auto now = std::chrono::steady_clock::now();
+		lowMoveTimeWaitTime += std::chrono::duration_cast<std::chrono::nanoseconds>(now-start).count();
+		
+		return std::max((int64_t)1, (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now-std::max(start, blocksDoneTime)).count());
+	}
+	
+	return 0;
 }
 
 void PruTimer::run() {
 	
-	LOG( "Starting PruTimer thread..." << std::endl);
+	LOG_INFO(LOG_PRU, "Starting PruTimer thread..." << std::endl);
 	
 	while(!stop) {
-#ifdef DEMO_PRU
-		
-		
-		unsigned int* nbCommand = (unsigned int *)currentReadingAddress;
-		
-		if(!nbCommand || stop || !*nbCommand)
-			continue;
-		
-		SteppersCommand * cmd = (SteppersCommand*)(currentReadingAddress+4);
-		
-		float totalWait = 0;
-		
-		for(int i=0;i<*nbCommand;i++) {
-			totalWait+=cmd->delay/200000.0;
-			
-			
-			cmd++;
-		}
-		
-		std::this_thread::sleep_for( std::chrono::milliseconds((unsigned)totalWait) );
-		
-		
-		currentReadingAddress+=(*nbCommand)*8+4;
+		backend->waitEvent(1000);
 		
-		nbCommand = (unsigned int *)currentReadingAddress;
-		
-		if(*nbCommand == DDR_MAGIC) {
-			currentReadingAddress = ddr_mem;
-		}
-		
-		*ddr_nr_events=(*ddr_nr_events)+1;
-#else
-		unsigned int nbWaitedEvent = prussdrv_pru_wait_event (PRU_EVTOUT_0,1000); //250ms timeout
-#endif
 		if(stop) break;
 		
 		//LOG( ("\tINFO: PRU0 completed transfer.\r\n"));
 		
-#ifndef DEMO_PRU
-		if(nbWaitedEvent)
-			prussdrv_pru_clear_event (PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
-#endif
-		
-		msync(ddr_nr_events, 4, MS_SYNC);
-		
-		uint32_t nb = *ddr_nr_events;
+		uint32_t nb = ddrAcquire(ddr_nr_events);
 		
 		
 		
@@ -604,14 +480,27 @@ void PruTimer::run() {
 				
 				assert(ddr_mem_used<ddr_size);
 				
-				LOG( "Block of size " << std::dec << front.size << " and time " << front.totalTime << " done." << std::endl);
+				LOG_RATE_LIMITED(LOG_DDR, LOG_LEVEL_DEBUG, LOG_HOT_INTERVAL, "Block of size " << std::dec << front.size << " and time " << front.totalTime << " done." << std::endl);
+				TRACE_INSTANT(TRACE_PRU_BLOCK_DONE, front.size);
 
 				blocksID.pop();
 				
 				currentNbEvents++;
+				blocksDoneTime = std::chrono::steady_clock::now();
 			}
 			
 			currentNbEvents = nb;
+			
+			//The PRU needs the next moves sooner than usual, or has none at all. A starvation is only counted when the 
+			//queue becomes empty, not on each wake-up until the next block is pushed
+			if(movesPending) {
+				if(blocksID.empty() && !starving) {
+					starvations++;
+					starving = true;
+				}
+				
+				queuedMovesTimeMin = std::min(queuedMovesTimeMin, (unsigned long)totalQueuedMovesTime);
+			}
 		}
 		
 		
@@ -623,16 +512,29 @@ void PruTimer::run() {
 	}
 }
 
+void PruTimer::getMetrics(PlannerMetrics& metrics) {
+	std::lock_guard<std::mutex> lk(mutex_memory);
+	
+	metrics.lowMoveTimeWaitTime = lowMoveTimeWaitTime/1e9;
+	metrics.ddrSpaceWaitTime = ddrSpaceWaitTime/1e9;
+	metrics.ddrMemUsed = ddr_mem_used;
+	metrics.ddrMemHighWater = ddrMemHighWater;
+	metrics.ddrSize = ddr_size;
+	metrics.queuedMovesTime = totalQueuedMovesTime/(double)F_CPU;
+	metrics.queuedMovesTimeMin = queuedMovesTimeMin == ULONG_MAX ? -1 : queuedMovesTimeMin/(double)F_CPU;
+	metrics.starvations = starvations;
+}
+
 void PruTimer::suspend() {
 	//We lock it so that we are thread safe
 	std::unique_lock<std::mutex> lk(mutex_memory);
 
-	*pru_control = 1;
+	ddrPublish(pru_control, 1);
 }
 
 void PruTimer::resume() {
 	//We lock it so that we are thread safe
 	std::unique_lock<std::mutex> lk(mutex_memory);
 	
-	*pru_control = 0;
+	ddrPublish(pru_control, 0);
 }
@@ -16,7 +16,11 @@
 #include <string.h>
 #include <strings.h>
 #include <condition_variable>
+#include <atomic>
+#include <chrono>
 #include "Logger.h"
+#include "PruBackend.h"
+#include "Metrics.h"
 
 //#define DEMO_PRU
 
@@ -29,16 +33,14 @@ class PruTimer {
 		BlockDef(unsigned long size, unsigned long totalTime) : size(size),totalTime(totalTime) {}
 	};
 	
-	std::string firmwareStepper, firmwareEndstop;
+	PruBackend* backend;
 	
 	/* Should be locked when used */
 	std::queue<BlockDef> blocksID;
 	size_t ddr_mem_used;
 	size_t totalQueuedMovesTime;
 	
-	unsigned long ddr_addr;
 	unsigned long ddr_size;
-	int mem_fd;
 	uint8_t *ddr_mem;
 	uint8_t *ddr_mem_end;
 	
@@ -53,19 +55,40 @@ class PruTimer {
 	std::condition_variable blockAvailable;
 	
 	std::thread runningThread;
-	bool stop;
-	
-#ifdef DEMO_PRU
-	uint8_t *currentReadingAddress;
-#endif
+	std::atomic<bool> stop;
+	
+	/* Metrics, see PlannerMetrics. The ones not atomic are locked by mutex_memory */
+	size_t ddrMemHighWater;
+	unsigned long queuedMovesTimeMin;
+	uint64_t starvations;
+	bool starving;                              ///< The starvation of the empty queue is counted, until the next push
+	std::atomic<uint64_t> lowMoveTimeWaitTime; //in ns
+	std::atomic<uint64_t> ddrSpaceWaitTime; //in ns
+	std::atomic<bool> movesPending;
+	std::chrono::steady_clock::time_point blocksDoneTime; ///< Last time blocks done by the PRU were freed
 	
 	void initalizePRURegisters();
 	
+	bool initBackend(PruBackend* pru, const std::string& firmware_stepper, const std::string& firmware_endstops);
+	
 public:
 	PruTimer();
 	virtual ~PruTimer();
 	bool initPRU(const std::string& firmware_stepper, const std::string& firmware_endstops);
 	
+	/* Run the commands on a VirtualPru instead of the PRU, see VirtualPru for the realTime parameter */
+	bool initVirtualPRU(bool realTime);
+	
+	/* Run the commands on the given backend, which is then owned by the PruTimer */
+	bool initPRU(PruBackend* backend) {
+		return initBackend(backend, "", "");
+	}
+	
+	/* The backend executing the commands, NULL before initPRU() or initVirtualPRU() */
+	PruBackend* getBackend() {
+		return backend;
+	}
+	
 	void run();
 	
 	void runThread();
@@ -82,7 +105,23 @@ public:
 		return totalQueuedMovesTime;
 	}
 	
-	void waitUntilLowMoveTime(unsigned long lowMoveTimeTicks);
+	/* Wait until less than lowMoveTimeTicks of moves are queued. Return the time between the PRU thread signaling it 
+	 * and the caller running again in ns, 0 if there was no need to wait */
+	uint64_t waitUntilLowMoveTime(unsigned long lowMoveTimeTicks);
+	
+	uint64_t getStarvations() {
+		std::lock_guard<std::mutex> lk(mutex_memory);
+		return starvations;
+	}
+	
+	/* Tell whether more moves are waiting to be sent after the ones pushed, the PRU is starving if it runs out of 
+	 * moves meanwhile. Must be cleared when there are no more moves to send */
+	void setMovesPending(bool pending) {
+		movesPending = pending;
+	}
+	
+	/* Fill the metrics of the PRU */
+	void getMetrics(PlannerMetrics& metrics);
 	
 	void suspend();
 	
@@ -90,7 +129,10 @@ public:
 	
 	void reset();
 	
-	void push_block(uint8_t* blockMemory, size_t blockLen, unsigned int unit, unsigned int pathID, unsigned long totalTime);
+	/* Push a block of commands to the PRU. blockLen is in bytes and unit is the size of one command. A command can
+	 * execute several steps (see STEPPER_COMMAND_REPEAT_MASK) so the block is only split on command boundaries. 
+	 * The time of each part written to the DDR is the one the PRU takes to execute its commands. */
+	void push_block(uint8_t* blockMemory, size_t blockLen, unsigned int unit, unsigned int pathID);
 };
 
 #endif /* defined(__PathPlanner__PruTimer__) */
@@ -0,0 +1,92 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#include "RampCache.h"
+#include "config.h"
+
+bool RampProfile::operator<(const RampProfile& other) const {
+	if(algorithm != other.algorithm) return algorithm < other.algorithm;
+	if(acceleration != other.acceleration) return acceleration < other.acceleration;
+	if(fAcceleration != other.fAcceleration) return fAcceleration < other.fAcceleration;
+	if(vStart != other.vStart) return vStart < other.vStart;
+	if(vEnd != other.vEnd) return vEnd < other.vEnd;
+	if(vMax != other.vMax) return vMax < other.vMax;
+	if(accelCount != other.accelCount) return accelCount < other.accelCount;
+	return decelCount < other.decelCount;
+}
+
+RampCache::RampCache() {
+	hits = 0;
+	misses = 0;
+}
+
+std::shared_ptr<const RampIntervals> RampCache::get(const RampProfile& profile) {
+	std::lock_guard<std::mutex> lk(cacheMutex);
+	
+	auto it = index.find(profile);
+	
+	if(it == index.end()) {
+		misses++;
+		return std::shared_ptr<const RampIntervals>();
+	}
+	
+	hits++;
+	
+	//Move the entry in front of the list
+	entries.splice(entries.begin(), entries, it->second);
+	
+	return it->second->second;
+}
+
+void RampCache::put(const RampProfile& profile, std::shared_ptr<const RampIntervals> intervals) {
+	std::lock_guard<std::mutex> lk(cacheMutex);
+	
+	if(index.find(profile) != index.end())
+		return;
+	
+	if(entries.size() >= RAMP_CACHE_SIZE) {
+		index.erase(entries.back().first);
+		entries.pop_back();
+	}
+	
+	entries.push_front(std::make_pair(profile, intervals));
+	index[profile] = entries.begin();
+}
+
+unsigned long RampCache::getHits() {
+	std::lock_guard<std::mutex> lk(cacheMutex);
+	return hits;
+}
+
+unsigned long RampCache::getMisses() {
+	std::lock_guard<std::mutex> lk(cacheMutex);
+	return misses;
+}
+
+void RampCache::clear() {
+	std::lock_guard<std::mutex> lk(cacheMutex);
+	
+	entries.clear();
+	index.clear();
+	hits = 0;
+	misses = 0;
+}
@@ -0,0 +1,98 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#ifndef __PathPlanner__RampCache__
+#define __PathPlanner__RampCache__
+
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/* Parameters that fully determine the intervals of the acceleration and deceleration phases of a move */
+typedef struct RampProfile {
+	uint32_t algorithm;     ///< RampAlgorithm used to compute the intervals
+	uint32_t acceleration;  ///< Acceleration in steps/s^2 of the incremental ramp, 0 for the timer ramp
+	uint32_t fAcceleration;
+	uint32_t vStart;
+	uint32_t vEnd;
+	uint32_t vMax;
+	uint32_t accelCount;    ///< Number of steps computed with the acceleration ramp
+	uint32_t decelCount;    ///< Number of steps computed with the deceleration ramp
+	
+	bool operator<(const RampProfile& other) const;
+} RampProfile;
+
+/* Intervals of the acceleration phase followed by the ones of the deceleration phase */
+typedef std::vector<uint32_t> RampIntervals;
+
+class RampCache {
+private:
+	typedef std::list<std::pair<RampProfile, std::shared_ptr<const RampIntervals> > > EntryList;
+	
+	EntryList entries;                                  ///< Most recently used first
+	std::map<RampProfile, EntryList::iterator> index;
+	std::mutex cacheMutex;
+	
+	unsigned long hits;
+	unsigned long misses;
+	
+public:
+	RampCache();
+	
+	/**
+	 * @brief Return the cached intervals of a ramp profile
+	 * @details The entry becomes the most recently used one. The returned intervals stay valid even if the entry is evicted afterwards.
+	 *
+	 * @param profile The profile to look up
+	 * @return The intervals or an empty pointer if the profile is not in the cache
+	 */
+	std::shared_ptr<const RampIntervals> get(const RampProfile& profile);
+	
+	/**
+	 * @brief Add the intervals of a ramp profile in the cache
+	 * @details The least recently used entry is evicted when the cache holds RAMP_CACHE_SIZE entries.
+	 *
+	 * @param profile The profile of the intervals
+	 * @param intervals The intervals of the acceleration phase followed by the ones of the deceleration phase
+	 */
+	void put(const RampProfile& profile, std::shared_ptr<const RampIntervals> intervals);
+	
+	/**
+	 * @brief Return the number of lookups that found their ramp in the cache
+	 */
+	unsigned long getHits();
+	
+	/**
+	 * @brief Return the number of lookups that had to compute their ramp
+	 */
+	unsigned long getMisses();
+	
+	/**
+	 * @brief Remove all the entries and reset the statistics
+	 */
+	void clear();
+};
+
+#endif /* defined(__PathPlanner__RampCache__) */
@@ -0,0 +1,395 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+#include "StepGenerator.h"
+#include "config.h"
+
+#if defined(STEP_GENERATOR_NEON)
+#include <arm_neon.h>
+#elif defined(STEP_GENERATOR_SSE2)
+#include <emmintrin.h>
+#endif
+
+/* F_CPU/v without integer division. Both operands are below 2^32, so the correctly rounded double quotient truncates to the exact integer quotient. */
+static inline uint32_t intervalForSpeed(uint32_t v) {
+	return (uint32_t)((double)F_CPU / (double)v);
+}
+
+template<unsigned int LANES>
+void StepGenerator::generateStepsSpecialized(uint8_t* steps, unsigned int count) {
+	const int32_t s = trapezoid.steps;
+	int32_t err[LANES];
+	int32_t d[LANES];
+	
+	//Kept in registers, the lane loops are unrolled since LANES is known at compile time
+	for(unsigned int lane=0; lane<LANES; lane++) {
+		err[lane] = error[lane];
+		d[lane] = delta[lane];
+	}
+	
+	for(unsigned int i=0; i<count; i++) {
+		unsigned int lanesMask = 0;
+		
+		for(unsigned int lane=0; lane<LANES; lane++) {
+			err[lane] -= d[lane];
+			int32_t negative = err[lane] >> 31;
+			err[lane] += negative & s;
+			lanesMask |= negative & (1 << lane);
+		}
+		
+		steps[i] = laneSteps[lanesMask];
+	}
+	
+	for(unsigned int lane=0; lane<LANES; lane++) {
+		error[lane] = err[lane];
+	}
+}
+
+/* Only the steppers stepping at every step: the same mask for all the steps */
+template<>
+void StepGenerator::generateStepsSpecialized<0>(uint8_t* steps, unsigned int count) {
+	memset(steps, laneSteps[0], count);
+}
+
+StepGenerator::StepGenerator(const SteppersTrapezoid& trapezoid, StepKernel kernel, RampCache* rampCache, RampAlgorithm algorithm, uint32_t acceleration) : trapezoid(trapezoid), kernel(kernel), algorithm(algorithm) {
+	uint8_t laneStepper[STEP_GENERATOR_LANES];
+	uint8_t alwaysSteps = 0;
+	
+	lanes = 0;
+	memset(error, 0, sizeof(error));
+	memset(delta, 0, sizeof(delta));
+	memset(laneStepper, 0, sizeof(laneStepper));
+	
+	//Only the moving steppers get a lane, a lane without delta never steps. 
+	//The primary axis steps at every step and needs no lane either.
+	for(unsigned int i=0; i<NUM_STEPPERS; i++) {
+		if(!trapezoid.delta[i])
+			continue;
+		
+		if(trapezoid.delta[i] == trapezoid.steps) {
+			alwaysSteps |= 1 << i;
+			continue;
+		}
+		
+		assert(lanes < STEP_GENERATOR_LANES);
+		laneStepper[lanes] = 1 << i;
+		delta[lanes] = trapezoid.delta[i];
+		error[lanes] = trapezoid.steps >> 1;
+		lanes++;
+	}
+	
+	for(unsigned int lanesMask=0; lanesMask<(1 << STEP_GENERATOR_LANES); lanesMask++) {
+		laneSteps[lanesMask] = alwaysSteps;
+		for(unsigned int lane=0; lane<STEP_GENERATOR_LANES; lane++) {
+			if(lanesMask & (1 << lane))
+				laneSteps[lanesMask] |= laneStepper[lane];
+		}
+	}
+	
+	//The kernel is chosen once for the whole move, so that the step loop has no test on the shape of the move. 
+	//Only 0 and 1 lane have their own kernel when NEON or SSE2 is available: from two lanes the instantiated loops 
+	//are slower than the vectorized kernel.
+	static void (StepGenerator::* const specializedKernels[STEP_GENERATOR_LANES + 1])(uint8_t*, unsigned int) = {
+		&StepGenerator::generateStepsSpecialized<0>,   //Single axis moves: Z only, E only retracts...
+		&StepGenerator::generateStepsSpecialized<1>,   //XY travel
+#if defined(STEP_GENERATOR_NEON) || defined(STEP_GENERATOR_SSE2)
+		&StepGenerator::generateStepsVectorized,       //XY printing with extrusion
+		&StepGenerator::generateStepsVectorized,
+		&StepGenerator::generateStepsVectorized,
+#else
+		&StepGenerator::generateStepsSpecialized<2>,
+		&StepGenerator::generateStepsSpecialized<3>,
+		&StepGenerator::generateStepsSpecialized<4>,
+#endif
+	};
+	
+	switch(kernel) {
+		case STEP_KERNEL_SCALAR:
+			stepKernel = &StepGenerator::generateStepsScalar;
+			break;
+		case STEP_KERNEL_VECTORIZED:
+			stepKernel = &StepGenerator::generateStepsVectorized;
+			break;
+		default:
+			stepKernel = specializedKernels[lanes];
+			break;
+	}
+	
+	stepNumber = 0;
+	accelEnd = trapezoid.accelSteps < trapezoid.steps ? trapezoid.accelSteps + 1 : trapezoid.steps;
+	decelStart = trapezoid.steps > trapezoid.decelSteps ? trapezoid.steps - trapezoid.decelSteps : 0;
+	if(decelStart < accelEnd)
+		decelStart = accelEnd;
+	timerAccel = 0;
+	timerDecel = 0;
+	vMaxReached = trapezoid.vStart;
+	
+	if(algorithm == RAMP_INCREMENTAL) {
+		//The deceleration starts from the speed reached at the end of the acceleration
+		double vTop = sqrt((double)trapezoid.vStart * trapezoid.vStart + 2.0 * acceleration * accelEnd);
+		if(vTop > trapezoid.vMax) vTop = trapezoid.vMax;
+		
+		accelRamp.accelerate(trapezoid.vStart, trapezoid.vMax, acceleration);
+		decelRamp.decelerate(trapezoid.vEnd, vTop, acceleration, trapezoid.steps - decelStart);
+	}
+	
+	if(rampCache) {
+		RampProfile profile;
+		profile.algorithm = algorithm;
+		profile.acceleration = algorithm == RAMP_INCREMENTAL ? acceleration : 0;
+		profile.fAcceleration = trapezoid.fAcceleration;
+		profile.vStart = trapezoid.vStart;
+		profile.vEnd = trapezoid.vEnd;
+		profile.vMax = trapezoid.vMax;
+		profile.accelCount = accelEnd;
+		profile.decelCount = trapezoid.steps - decelStart;
+		
+		if(profile.accelCount + profile.decelCount <= RAMP_CACHE_MAX_STEPS) {
+			ramp = rampCache->get(profile);
+			
+			if(!ramp) {
+				RampIntervals* intervals = new RampIntervals(profile.accelCount + profile.decelCount);
+				
+				if(!intervals->empty()) {
+					accelerate(&(*intervals)[0], profile.accelCount);
+					decelerate(&(*intervals)[profile.accelCount], profile.decelCount);
+				}
+				
+				ramp.reset(intervals);
+				rampCache->put(profile, ramp);
+			}
+		}
+	}
+}
+
+const char* StepGenerator::vectorInstructionSet() {
+#if defined(STEP_GENERATOR_NEON)
+	return "NEON";
+#elif defined(STEP_GENERATOR_SSE2)
+	return "SSE2";
+#else
+	return "none";
+#endif
+}
+
+unsigned int StepGenerator::generate(uint8_t* steps, uint32_t* delays, unsigned int count) {
+	if(count > trapezoid.steps - stepNumber)
+		count = trapezoid.steps - stepNumber;
+	
+	if(!count)
+		return 0;
+	
+	(this->*stepKernel)(steps, count);
+	
+	if(ramp) {
+		generateDelaysCached(delays, count);
+	} else if(kernel != STEP_KERNEL_SCALAR || algorithm != RAMP_TIMER) {
+		generateDelaysByPhase(delays, count);
+	} else {
+		generateDelaysScalar(delays, count);
+	}
+	
+	stepNumber += count;
+	
+	return count;
+}
+
+void StepGenerator::generateStepsScalar(uint8_t* steps, unsigned int count) {
+	for(unsigned int i=0; i<count; i++) {
+		unsigned int lanesMask = 0;
+		
+		for(unsigned int lane=0; lane<STEP_GENERATOR_LANES; lane++) {
+			if((error[lane] -= delta[lane]) < 0) {
+				lanesMask |= (1 << lane);
+				error[lane] += trapezoid.steps;
+			}
+		}
+		
+		steps[i] = laneSteps[lanesMask];
+	}
+}
+
+void StepGenerator::generateStepsVectorized(uint8_t* steps, unsigned int count) {
+#if defined(STEP_GENERATOR_NEON)
+	static const uint32_t laneBitsValues[STEP_GENERATOR_LANES] = {1, 2, 4, 8};
+	int32x4_t err = vld1q_s32(error);
+	const int32x4_t d = vld1q_s32(delta);
+	const uint32x4_t s = vdupq_n_u32(trapezoid.steps);
+	const uint32x4_t laneBits = vld1q_u32(laneBitsValues);
+	uint32_t lanesMasks[STEP_GENERATOR_BLOCK_SIZE];
+	
+	//Moving a NEON register to an ARM register stalls the Cortex-A8 pipeline, so the lanes masks are stored by block and translated afterwards
+	for(unsigned int start=0; start<count; start+=STEP_GENERATOR_BLOCK_SIZE) {
+		unsigned int blockCount = count - start < STEP_GENERATOR_BLOCK_SIZE ? count - start : STEP_GENERATOR_BLOCK_SIZE;
+		
+		for(unsigned int i=0; i<blockCount; i++) {
+			err = vsubq_s32(err, d);
+			uint32x4_t negative = vreinterpretq_u32_s32(vshrq_n_s32(err, 31));
+			err = vaddq_s32(err, vreinterpretq_s32_u32(vandq_u32(negative, s)));
+			
+			uint32x4_t bits = vandq_u32(negative, laneBits);
+			uint32x2_t mask = vorr_u32(vget_low_u32(bits), vget_high_u32(bits));
+			mask = vpadd_u32(mask, mask);
+			vst1_lane_u32(&lanesMasks[i], mask, 0);
+		}
+		
+		for(unsigned int i=0; i<blockCount; i++) {
+			steps[start + i] = laneSteps[lanesMasks[i]];
+		}
+	}
+	
+	vst1q_s32(error, err);
+#elif defined(STEP_GENERATOR_SSE2)
+	__m128i err = _mm_load_si128((const __m128i*)error);
+	const __m128i d = _mm_load_si128((const __m128i*)delta);
+	const __m128i s = _mm_set1_epi32(trapezoid.steps);
+	
+	for(unsigned int i=0; i<count; i++) {
+		err = _mm_sub_epi32(err, d);
+		__m128i negative = _mm_srai_epi32(err, 31);
+		err = _mm_add_epi32(err, _mm_and_si128(negative, s));
+		steps[i] = laneSteps[_mm_movemask_ps(_mm_castsi128_ps(negative))];
+	}
+	
+	_mm_store_si128((__m128i*)error, err);
+#else
+	generateStepsScalar(steps, count);
+#endif
+}
+
+void StepGenerator::generateDelaysScalar(uint32_t* delays, unsigned int count) {
+	for(unsigned int i=0; i<count; i++) {
+		uint32_t step = stepNumber + i;
+		uint32_t interval;
+		
+		if(step <= trapezoid.accelSteps) {
+			vMaxReached = (((timerAccel >> 8) * trapezoid.fAcceleration) >> 10) + trapezoid.vStart;
+			if(vMaxReached > trapezoid.vMax) vMaxReached = trapezoid.vMax;
+			interval = F_CPU / vMaxReached;
+			timerAccel += interval;
+		} else if(trapezoid.steps - step <= trapezoid.decelSteps) {
+			uint32_t v = ((timerDecel >> 8) * trapezoid.fAcceleration) >> 10;
+			if(v > vMaxReached) {
+				v = trapezoid.vEnd;
+			} else {
+				v = vMaxReached - v;
+				if(v < trapezoid.vEnd)
+					v = trapezoid.vEnd;
+			}
+			interval = F_CPU / v;
+			timerDecel += interval;
+		} else {
+			interval = trapezoid.fullInterval;
+		}
+		
+		delays[i] = interval;
+	}
+}
+
+void StepGenerator::accelerate(uint32_t* delays, unsigned int count) {
+	if(algorithm == RAMP_INCREMENTAL) {
+		accelRamp.generate(delays, count);
+		return;
+	}
+	
+	for(unsigned int i=0; i<count; i++) {
+		vMaxReached = (((timerAccel >> 8) * trapezoid.fAcceleration) >> 10) + trapezoid.vStart;
+		if(vMaxReached > trapezoid.vMax) vMaxReached = trapezoid.vMax;
+		uint32_t interval = intervalForSpeed(vMaxReached);
+		timerAccel += interval;
+		delays[i] = interval;
+	}
+}
+
+void StepGenerator::decelerate(uint32_t* delays, unsigned int count) {
+	if(algorithm == RAMP_INCREMENTAL) {
+		decelRamp.generate(delays, count);
+		return;
+	}
+	
+	for(unsigned int i=0; i<count; i++) {
+		uint32_t v = ((timerDecel >> 8) * trapezoid.fAcceleration) >> 10;
+		v = v > vMaxReached ? trapezoid.vEnd : vMaxReached - v;
+		if(v < trapezoid.vEnd)
+			v = trapezoid.vEnd;
+		uint32_t interval = intervalForSpeed(v);
+		timerDecel += interval;
+		delays[i] = interval;
+	}
+}
+
+void StepGenerator::generateDelaysByPhase(uint32_t* delays, unsigned int count) {
+	uint32_t step = stepNumber;
+	uint32_t end = stepNumber + count;
+	
+	//The phases are computed run by run so that the loops have no phase test
+	
+	if(step < accelEnd) {
+		unsigned int accelCount = (accelEnd < end ? accelEnd : end) - step;
+		accelerate(delays, accelCount);
+		delays += accelCount;
+		step += accelCount;
+	}
+	
+	//Cruise, a constant delay that the compiler turns into vector stores
+	if(step < decelStart && step < end) {
+		uint32_t fullInterval = trapezoid.fullInterval;
+		unsigned int cruiseCount = (decelStart < end ? decelStart : end) - step;
+		for(unsigned int i=0; i<cruiseCount; i++) {
+			delays[i] = fullInterval;
+		}
+		delays += cruiseCount;
+		step += cruiseCount;
+	}
+	
+	decelerate(delays, end - step);
+}
+
+void StepGenerator::generateDelaysCached(uint32_t* delays, unsigned int count) {
+	uint32_t step = stepNumber;
+	uint32_t end = stepNumber + count;
+	const uint32_t* intervals = ramp->data();
+	
+	if(step < accelEnd) {
+		unsigned int accelCount = (accelEnd < end ? accelEnd : end) - step;
+		memcpy(delays, intervals + step, accelCount * sizeof(uint32_t));
+		delays += accelCount;
+		step += accelCount;
+	}
+	
+	if(step < decelStart && step < end) {
+		uint32_t fullInterval = trapezoid.fullInterval;
+		unsigned int cruiseCount = (decelStart < end ? decelStart : end) - step;
+		for(unsigned int i=0; i<cruiseCount; i++) {
+			delays[i] = fullInterval;
+		}
+		delays += cruiseCount;
+		step += cruiseCount;
+	}
+	
+	if(step < end) {
+		memcpy(delays, intervals + accelEnd + (step - decelStart), (end - step) * sizeof(uint32_t));
+	}
+}
@@ -0,0 +1,129 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#ifndef __PathPlanner__StepGenerator__
+#define __PathPlanner__StepGenerator__
+
+#include <stdint.h>
+#include <memory>
+#include "StepperCommand.h"
+#include "RampCache.h"
+#include "IncrementalRamp.h"
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define STEP_GENERATOR_NEON
+#elif defined(__SSE2__)
+#define STEP_GENERATOR_SSE2
+#endif
+
+/* Algorithms computing the intervals of the acceleration and deceleration phases */
+enum RampAlgorithm {
+	RAMP_TIMER = 0,             ///< Speed computed from the time elapsed since the start of the phase, as done by the PRU for the trapezoids
+	RAMP_INCREMENTAL = 1,       ///< Intervals updated step by step without division in 64 bits fixed point, see IncrementalRamp
+};
+
+/* Kernels running the Bresenham algorithm of the steppers */
+enum StepKernel {
+	STEP_KERNEL_SCALAR = 0,         ///< Generic loop over all the lanes, reference implementation
+	STEP_KERNEL_VECTORIZED = 1,     ///< All the lanes at once with NEON or SSE2
+	STEP_KERNEL_SPECIALIZED = 2,    ///< Dedicated loop for 0 and 1 lane, see generateStepsSpecialized(), the vectorized kernel from 2 lanes when available
+};
+
+/* Number of steppers computed together by the vectorized Bresenham, a move drives at most X, Y, Z and one extruder */
+#define STEP_GENERATOR_LANES 4
+
+class StepGenerator {
+private:
+	SteppersTrapezoid trapezoid;
+	StepKernel kernel;
+	RampAlgorithm algorithm;
+	void (StepGenerator::*stepKernel)(uint8_t* steps, unsigned int count);  ///< Bresenham kernel chosen once for the move
+	
+	int32_t error[STEP_GENERATOR_LANES] __attribute__((aligned(16)));
+	int32_t delta[STEP_GENERATOR_LANES] __attribute__((aligned(16)));
+	uint8_t laneSteps[1 << STEP_GENERATOR_LANES];   ///< Step mask of the steppers stepping for each combination of lanes
+	unsigned int lanes;                             ///< Number of lanes used, the steppers stepping at every step have none
+	
+	uint32_t stepNumber;
+	uint32_t accelEnd;                              ///< First step after the acceleration phase
+	uint32_t decelStart;                            ///< First step of the deceleration phase
+	uint32_t timerAccel;
+	uint32_t timerDecel;
+	uint32_t vMaxReached;
+	IncrementalRamp accelRamp;
+	IncrementalRamp decelRamp;
+	
+	std::shared_ptr<const RampIntervals> ramp;      ///< Cached intervals of the acceleration and deceleration phases
+	
+	void generateStepsScalar(uint8_t* steps, unsigned int count);
+	void generateStepsVectorized(uint8_t* steps, unsigned int count);
+	template<unsigned int LANES> void generateStepsSpecialized(uint8_t* steps, unsigned int count);
+	void generateDelaysScalar(uint32_t* delays, unsigned int count);
+	void generateDelaysByPhase(uint32_t* delays, unsigned int count);
+	void generateDelaysCached(uint32_t* delays, unsigned int count);
+	void accelerate(uint32_t* delays, unsigned int count);
+	void decelerate(uint32_t* delays, unsigned int count);
+	
+public:
+	/**
+	 * @brief Create a generator for the steps of a move
+	 * @details The steps are the same as the ones computed by the PRU for the trapezoid, see expandSteppersTrapezoid().
+	 *
+	 * @param trapezoid The descriptor of the move
+	 * @param kernel The kernel running the Bresenham algorithm, they all give the same steps
+	 * @param rampCache If not NULL, the intervals of the acceleration and deceleration phases are taken from this cache 
+	 * and added to it when missing
+	 * @param algorithm The algorithm computing the intervals of the acceleration and deceleration phases. With RAMP_INCREMENTAL, 
+	 * the steps are not the ones of expandSteppersTrapezoid() anymore.
+	 * @param acceleration The acceleration of the primary axis in steps/s^2, only used by RAMP_INCREMENTAL
+	 */
+	StepGenerator(const SteppersTrapezoid& trapezoid, StepKernel kernel = STEP_KERNEL_SPECIALIZED, RampCache* rampCache = NULL, RampAlgorithm algorithm = RAMP_TIMER, uint32_t acceleration = 0);
+	
+	/**
+	 * @brief Generate the next steps of the move
+	 * @details Compute the step masks and delays of the next steps of the move, by block. The vectorized kernel runs 
+	 * the Bresenham algorithm of all the steppers at once with NEON or SSE2 without branches, the specialized kernel runs 
+	 * a dedicated loop for the moves with 0 or 1 lane and the vectorized kernel for the others. Without NEON or SSE2 it 
+	 * runs a branchless loop instantiated for the number of lanes of the move. The delays are computed 
+	 * phase by phase, with an exact floating point division instead of the integer division that the Cortex-A8 does not have.
+	 *
+	 * @param steps Receive the step mask of each step, 0b000HEZYX
+	 * @param delays Receive the delay of each step in PRU cycles
+	 * @param count Maximum number of steps to generate
+	 * @return The number of steps generated, 0 when the move is done
+	 */
+	unsigned int generate(uint8_t* steps, uint32_t* delays, unsigned int count);
+	
+	/**
+	 * @brief Return true when all the steps of the move have been generated
+	 */
+	inline bool isDone() const {
+		return stepNumber >= trapezoid.steps;
+	}
+	
+	/**
+	 * @brief Return the name of the instruction set used by the vectorized kernel
+	 */
+	static const char* vectorInstructionSet();
+};
+
+#endif /* defined(__PathPlanner__StepGenerator__) */
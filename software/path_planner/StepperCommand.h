@@ -25,14 +25,51 @@
 
 #include <stdint.h>
 
+/* The options byte of a command is defined as 0bTRRRRRRR
+ * R: number of times the command is executed again after its first execution. It allows to send a run of
+ * identical steps (typically the cruise part of a move) as a single command.
+ * T: the command is the header of a SteppersTrapezoid, the PRU computes the steps of the whole move.
+ */
+#define STEPPER_COMMAND_REPEAT_MASK 0x7F
+#define STEPPER_COMMAND_MAX_REPEAT STEPPER_COMMAND_REPEAT_MASK
+#define STEPPER_COMMAND_OPTION_TRAPEZOID 0x80
+
+/* Number of steppers driven by the PRU, the step and direction masks are 0b000HEZYX */
+#define NUM_STEPPERS 5
+
 typedef struct SteppersCommand {
 	uint8_t     step;                //Steppers are defined as 0b000HEZYX - A 1 for a stepper means we will do a step for this stepper
     uint8_t     direction;           //Steppers are defined as 0b000HEZYX - Direction for each stepper
     uint8_t     cancellableMask;     //If the endstop match the mask, all the move commands are canceled.
-    uint8_t     options;             //Options for the move, not yet used.
+    uint8_t     options;             //Options for the move, see STEPPER_COMMAND_REPEAT_MASK
     uint32_t    delay;               //number of cycle to wait (this is the # of PRU click cycles)
 } SteppersCommand;
 
 static_assert(sizeof(SteppersCommand)==8,"Invalid stepper command size");
 
+/* Move level command: the PRU runs the Bresenham algorithm and the acceleration ramp of the move itself.
+ * The ramp is the one of PathPlanner::run(), see expandSteppersTrapezoid() for the reference implementation. */
+typedef struct SteppersTrapezoid {
+	uint8_t     step;                //Steppers moving during the move, defined as 0b000HEZYX
+	uint8_t     direction;           //Steppers are defined as 0b000HEZYX - Direction for each stepper
+	uint8_t     cancellableMask;     //If the endstop match the mask, all the move commands are canceled.
+	uint8_t     options;             //Must be STEPPER_COMMAND_OPTION_TRAPEZOID
+	uint32_t    steps;               //Number of steps of the primary axis
+	uint32_t    delta[NUM_STEPPERS]; //Steps to do for each stepper, indexed as the step mask
+	uint32_t    accelSteps;          //Number of steps of the acceleration phase
+	uint32_t    decelSteps;          //Number of steps of the deceleration phase
+	uint32_t    vStart;              //Starting speed in steps/s
+	uint32_t    vMax;                //Maximum speed in steps/s
+	uint32_t    vEnd;                //End speed in steps/s
+	uint32_t    fAcceleration;       //Acceleration of the primary axis*262144/F_CPU
+	uint32_t    fullInterval;        //Delay between two steps at full speed in PRU cycles
+} SteppersTrapezoid;
+
+static_assert(sizeof(SteppersTrapezoid)%sizeof(SteppersCommand)==0,"Invalid stepper trapezoid size");
+
+/* Number of steps executed by the PRU for this command */
+static inline unsigned int stepperCommandSteps(const SteppersCommand& cmd) {
+	return (cmd.options & STEPPER_COMMAND_REPEAT_MASK) + 1;
+}
+
 #endif
@@ -0,0 +1,93 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#include "StepperTrapezoid.h"
+#include "config.h"
+
+TrapezoidStepper::TrapezoidStepper(const SteppersTrapezoid& trapezoid) : trapezoid(trapezoid), ramp(trapezoid), stepNumber(0) {
+	for(unsigned int i=0; i<NUM_STEPPERS; i++) {
+		error[i] = trapezoid.steps >> 1;
+	}
+}
+
+void TrapezoidStepper::next(SteppersCommand& cmd) {
+	//All the computations are done on 32 bits like on the PRU
+	cmd.direction = trapezoid.direction;
+	cmd.cancellableMask = trapezoid.cancellableMask;
+	cmd.options = 0;
+	cmd.step = 0;
+	
+	//Bresenham, a stepper without delta never steps
+	for(unsigned int i=0; i<NUM_STEPPERS; i++) {
+		if((error[i] -= trapezoid.delta[i]) < 0) {
+			cmd.step |= (1 << i);
+			error[i] += trapezoid.steps;
+		}
+	}
+	
+	cmd.delay = ramp.interval(stepNumber);
+	stepNumber++;
+}
+
+void expandSteppersTrapezoid(const SteppersTrapezoid& trapezoid, SteppersCommand* commands) {
+	TrapezoidStepper stepper(trapezoid);
+	
+	while(!stepper.done()) {
+		stepper.next(commands[stepper.getStepNumber()]);
+	}
+}
+
+uint64_t steppersCommandsCycles(const SteppersCommand* commands, unsigned int count) {
+	uint64_t cycles = 0;
+	
+	for(unsigned int i=0; i<count; i++) {
+		cycles += (uint64_t)stepCycles(commands[i].delay) * stepperCommandSteps(commands[i]);
+	}
+	
+	return cycles;
+}
+
+uint64_t steppersTrapezoidCycles(const SteppersTrapezoid& trapezoid) {
+	TrapezoidRamp ramp(trapezoid);
+	uint64_t cycles = PRU_TRAPEZOID_START_CYCLES;
+	
+	//Same phases as TrapezoidRamp::interval()
+	uint32_t accelEnd = trapezoid.accelSteps < trapezoid.steps ? trapezoid.accelSteps + 1 : trapezoid.steps;
+	uint32_t decelStart = trapezoid.steps > trapezoid.decelSteps ? trapezoid.steps - trapezoid.decelSteps : 0;
+	
+	if(decelStart < accelEnd)
+		decelStart = accelEnd;
+	
+	uint32_t stepNumber;
+	
+	for(stepNumber=0; stepNumber<accelEnd; stepNumber++) {
+		cycles += trapezoidStepCycles(ramp.interval(stepNumber), PRU_TRAPEZOID_RAMP_CYCLES);
+	}
+	
+	cycles += (uint64_t)trapezoidStepCycles(trapezoid.fullInterval, PRU_TRAPEZOID_CRUISE_CYCLES) * (decelStart - accelEnd);
+	
+	for(stepNumber=decelStart; stepNumber<trapezoid.steps; stepNumber++) {
+		cycles += trapezoidStepCycles(ramp.interval(stepNumber), PRU_TRAPEZOID_RAMP_CYCLES);
+	}
+	
+	return cycles;
+}
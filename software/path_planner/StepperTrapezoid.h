@@ -0,0 +1,146 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#ifndef __PathPlanner__StepperTrapezoid__
+#define __PathPlanner__StepperTrapezoid__
+
+#include "StepperCommand.h"
+#include "config.h"
+
+/* PRU cycles taken by a step with this delay */
+static inline uint32_t stepCycles(uint32_t delay) {
+	return delay > PRU_MIN_STEP_CYCLES ? delay : PRU_MIN_STEP_CYCLES;
+}
+
+/* PRU cycles taken by a step of a trapezoid with this interval. The firmware removes the overhead of the step, 
+ * PRU_TRAPEZOID_RAMP_CYCLES or PRU_TRAPEZOID_CRUISE_CYCLES, from the interval, so it never takes less than a plain 
+ * step plus the overhead. */
+static inline uint32_t trapezoidStepCycles(uint32_t interval, uint32_t overhead) {
+	return interval > PRU_MIN_STEP_CYCLES + overhead ? interval : PRU_MIN_STEP_CYCLES + overhead;
+}
+
+/* True if the step is computed by the acceleration or deceleration of the trapezoid, false in the cruise */
+static inline bool trapezoidRampStep(const SteppersTrapezoid& trapezoid, uint32_t stepNumber) {
+	return stepNumber <= trapezoid.accelSteps || trapezoid.steps - stepNumber <= trapezoid.decelSteps;
+}
+
+/**
+ * Speed ramp of firmware_runtime.p, the interval of each step must be asked in order. The steps of the cruise can be 
+ * skipped, they do not change the ramp.
+ */
+class TrapezoidRamp {
+private:
+	const SteppersTrapezoid& trapezoid;
+	uint32_t timerAccel;
+	uint32_t timerDecel;
+	uint32_t vMaxReached;
+	
+public:
+	TrapezoidRamp(const SteppersTrapezoid& trapezoid) : trapezoid(trapezoid), timerAccel(0), timerDecel(0), vMaxReached(trapezoid.vStart) {}
+	
+	uint32_t interval(uint32_t stepNumber) {
+		uint32_t interval;
+		
+		if(stepNumber <= trapezoid.accelSteps) {
+			vMaxReached = (((timerAccel >> 8) * trapezoid.fAcceleration) >> 10) + trapezoid.vStart;
+			if(vMaxReached > trapezoid.vMax) vMaxReached = trapezoid.vMax;
+			interval = F_CPU / vMaxReached;
+			timerAccel += interval;
+		} else if(trapezoid.steps - stepNumber <= trapezoid.decelSteps) {
+			uint32_t v = ((timerDecel >> 8) * trapezoid.fAcceleration) >> 10;
+			if(v > vMaxReached) {
+				v = trapezoid.vEnd;
+			} else {
+				v = vMaxReached - v;
+				if(v < trapezoid.vEnd)
+					v = trapezoid.vEnd;
+			}
+			interval = F_CPU / v;
+			timerDecel += interval;
+		} else {
+			interval = trapezoid.fullInterval;
+		}
+		
+		return interval;
+	}
+};
+
+/**
+ * Steps of a trapezoid descriptor computed one at a time, like the PRU does, without expanding the whole trapezoid.
+ */
+class TrapezoidStepper {
+private:
+	const SteppersTrapezoid& trapezoid;
+	TrapezoidRamp ramp;
+	int32_t error[NUM_STEPPERS];
+	uint32_t stepNumber;
+	
+public:
+	TrapezoidStepper(const SteppersTrapezoid& trapezoid);
+	
+	/**
+	 * @brief Return true once all the steps of the trapezoid are given
+	 */
+	bool done() const {
+		return stepNumber >= trapezoid.steps;
+	}
+	
+	/**
+	 * @brief Return the number of the next step
+	 */
+	uint32_t getStepNumber() const {
+		return stepNumber;
+	}
+	
+	/**
+	 * @brief Compute the next step of the trapezoid
+	 *
+	 * @param cmd Receives the step, not repeated, with the interval of the step as delay
+	 */
+	void next(SteppersCommand& cmd);
+};
+
+/**
+ * @brief Expand a trapezoid descriptor into one command per step
+ * @details Host reference of the computation done by firmware_runtime.p for a SteppersTrapezoid. It uses the same 
+ * 32 bits integer arithmetic as the PRU, so the result can be compared bit for bit with the per step commands 
+ * generated by PathPlanner::run() for the same move.
+ *
+ * @param trapezoid The descriptor to expand
+ * @param commands Buffer receiving trapezoid.steps commands, none of them is repeated
+ */
+void expandSteppersTrapezoid(const SteppersTrapezoid& trapezoid, SteppersCommand* commands);
+
+/**
+ * @brief Return the PRU cycles taken by the execution of the commands, repeats included
+ */
+uint64_t steppersCommandsCycles(const SteppersCommand* commands, unsigned int count);
+
+/**
+ * @brief Return the PRU cycles taken by the execution of a trapezoid descriptor
+ * @details The intervals are the delays of the commands given by expandSteppersTrapezoid(), each step taking 
+ * trapezoidStepCycles() with the overhead of its phase, plus PRU_TRAPEZOID_START_CYCLES. Only the steps of the 
+ * acceleration and deceleration are computed one by one.
+ */
+uint64_t steppersTrapezoidCycles(const SteppersTrapezoid& trapezoid);
+
+#endif /* defined(__PathPlanner__StepperTrapezoid__) */
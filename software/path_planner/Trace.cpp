@@ -0,0 +1,131 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#include "Trace.h"
+#include <vector>
+#include <mutex>
+#include <fstream>
+#include <algorithm>
+
+static const char* traceEventNames[TRACE_EVENTS_COUNT] = {
+	"queueMove",
+	"updateTrapezoids",
+	"stepGeneration",
+	"bufferWait",
+	"lowMoveTimeWait",
+	"ddrSpaceWait",
+	"pushBlock",
+	"blockPublished",
+	"pruBlockDone"
+};
+
+std::atomic<bool> Tracer::enabled(false);
+__thread TraceBuffer* Tracer::threadBuffer = NULL;
+__thread const char* Tracer::threadName = NULL;
+
+static std::mutex buffersMutex;
+static std::vector<TraceBuffer*> buffers;
+
+TraceBuffer* Tracer::registerThread() {
+	TraceBuffer* buffer = new TraceBuffer();
+	
+	buffer->written = 0;
+	buffer->threadName = threadName;
+	
+	std::lock_guard<std::mutex> lk(buffersMutex);
+	
+	buffer->threadId = buffers.size() + 1;
+	buffers.push_back(buffer);
+	
+	threadBuffer = buffer;
+	
+	return buffer;
+}
+
+void Tracer::setThreadName(const char* name) {
+	threadName = name;
+	
+	if(threadBuffer) {
+		std::lock_guard<std::mutex> lk(buffersMutex);
+		threadBuffer->threadName = name;
+	}
+}
+
+bool Tracer::dump(const std::string& path) {
+	std::ofstream out(path.c_str());
+	
+	if(!out)
+		return false;
+	
+	std::vector<TraceEvent> events;
+	bool first = true;
+	
+	out << "{\"traceEvents\":[";
+	
+	std::lock_guard<std::mutex> lk(buffersMutex);
+	
+	for(TraceBuffer* buffer : buffers) {
+		uint32_t end = buffer->written.load(std::memory_order_acquire);
+		uint32_t start = end > TRACE_BUFFER_SIZE ? end - TRACE_BUFFER_SIZE : 0;
+		
+		events.clear();
+		for(uint32_t i=start; i!=end; i++) {
+			events.push_back(buffer->events[i & (TRACE_BUFFER_SIZE-1)]);
+		}
+		
+		//The events the thread wrote over meanwhile are discarded, including the one it may be writing
+		uint32_t written = buffer->written.load(std::memory_order_acquire);
+		if(written - start >= TRACE_BUFFER_SIZE) {
+			events.erase(events.begin(), events.begin() + std::min<size_t>(written - start - TRACE_BUFFER_SIZE + 1, events.size()));
+		}
+		
+		if(!first)
+			out << ",";
+		first = false;
+		
+		out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->threadId << ",\"args\":{\"name\":\"";
+		
+		if(buffer->threadName)
+			out << buffer->threadName;
+		else
+			out << "thread " << buffer->threadId;
+		
+		out << "\"}}";
+		
+		for(const TraceEvent& event : events) {
+			out << ",\n{\"name\":\"" << traceEventNames[event.id] << "\",\"ph\":\"" << event.phase << "\"";
+			
+			//Chrome trace timestamps are in us
+			out << ",\"ts\":" << event.time/1000 << "." << (char)('0' + event.time/100%10) << (char)('0' + event.time/10%10) << (char)('0' + event.time%10);
+			out << ",\"pid\":1,\"tid\":" << buffer->threadId;
+			
+			if(event.phase == 'i')
+				out << ",\"s\":\"t\"";
+			
+			out << ",\"args\":{\"arg\":" << event.arg << "}}";
+		}
+	}
+	
+	out << "]}\n";
+	
+	return out.good();
+}
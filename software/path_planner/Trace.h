@@ -0,0 +1,155 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#ifndef __PathPlanner__Trace__
+#define __PathPlanner__Trace__
+
+#include <stdint.h>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include "config.h"
+
+/**
+ * Events recorded in the trace, see traceEventNames in Trace.cpp for their name in the exported trace
+ */
+enum TraceEventId {
+	TRACE_QUEUE_MOVE,           ///< queueLine(), arg: sequence number of the line
+	TRACE_UPDATE_TRAPEZOIDS,    ///< Replanning pass of updateTrapezoids()
+	TRACE_STEP_GENERATION,      ///< Commands of a line generated, arg: steps of the line
+	TRACE_BUFFER_WAIT,          ///< run() waiting for the ring to fill up before printing
+	TRACE_LOW_MOVE_TIME_WAIT,   ///< Waiting until the PRU needs more moves
+	TRACE_DDR_SPACE_WAIT,       ///< push_block() waiting for space in the DDR
+	TRACE_PUSH_BLOCK,           ///< push_block(), arg: line index
+	TRACE_BLOCK_PUBLISHED,      ///< Block made visible to the PRU, arg: commands in the block
+	TRACE_PRU_BLOCK_DONE,       ///< Block executed by the PRU, arg: bytes of DDR freed
+	TRACE_EVENTS_COUNT
+};
+
+/**
+ * Fixed size binary event, converted to JSON only when the trace is dumped
+ */
+struct TraceEvent {
+	uint64_t time;    ///< Monotonic clock in ns
+	uint32_t arg;
+	uint16_t id;      ///< TraceEventId
+	char phase;       ///< Chrome trace phase: 'B' begin, 'E' end, 'i' instant
+	uint8_t unused;
+};
+
+/**
+ * Ring of the last TRACE_BUFFER_SIZE events of a thread. Only its thread writes it, so recording an event does 
+ * not need any lock. The buffers are kept after their thread exits so that its events can still be dumped.
+ */
+struct TraceBuffer {
+	TraceEvent events[TRACE_BUFFER_SIZE];
+	std::atomic<uint32_t> written;            ///< Number of events recorded, the last one is at (written-1)%TRACE_BUFFER_SIZE
+	unsigned int threadId;
+	const char* threadName;
+};
+
+/**
+ * Low overhead tracer of the path planner threads, exported in the Chrome trace / Perfetto JSON format.
+ * Recording an event costs a clock read and a store in the ring of the thread when enabled, a relaxed load when 
+ * disabled.
+ */
+class Tracer {
+private:
+	static std::atomic<bool> enabled;
+	static __thread TraceBuffer* threadBuffer;
+	static __thread const char* threadName;
+	
+	static TraceBuffer* registerThread();
+	
+public:
+	static void setEnabled(bool enable) {
+		enabled.store(enable, std::memory_order_relaxed);
+	}
+	
+	static bool isEnabled() {
+		return enabled.load(std::memory_order_relaxed);
+	}
+	
+	/**
+	 * @brief Name the calling thread in the exported trace
+	 * 
+	 * @param name A string that lives as long as the program, usually a literal
+	 */
+	static void setThreadName(const char* name);
+	
+	static inline void record(TraceEventId id, char phase, uint32_t arg) {
+		if(!enabled.load(std::memory_order_relaxed))
+			return;
+		
+		TraceBuffer* buffer = threadBuffer;
+		
+		if(!buffer)
+			buffer = registerThread();
+		
+		uint32_t index = buffer->written.load(std::memory_order_relaxed);
+		TraceEvent& event = buffer->events[index & (TRACE_BUFFER_SIZE-1)];
+		
+		event.time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		event.arg = arg;
+		event.id = id;
+		event.phase = phase;
+		
+		//Published for dump(), which discards the events overwritten while it was copying them
+		buffer->written.store(index + 1, std::memory_order_release);
+	}
+	
+	/**
+	 * @brief Write the events of all the threads to a file in the Chrome trace JSON format
+	 * @details Can be called while the other threads record events. It can be opened with chrome://tracing or 
+	 * https://ui.perfetto.dev
+	 * 
+	 * @param path The path of the file to write
+	 * 
+	 * @return true in case of success, false otherwise.
+	 */
+	static bool dump(const std::string& path);
+};
+
+/**
+ * Records the begin and end events of a scope
+ */
+class TraceScope {
+private:
+	TraceEventId id;
+	uint32_t arg;
+	
+public:
+	TraceScope(TraceEventId id, uint32_t arg) : id(id), arg(arg) {
+		Tracer::record(id, 'B', arg);
+	}
+	
+	~TraceScope() {
+		Tracer::record(id, 'E', arg);
+	}
+};
+
+#define TRACE_BEGIN(id, arg) Tracer::record(id, 'B', arg)
+#define TRACE_END(id, arg) Tracer::record(id, 'E', arg)
+#define TRACE_INSTANT(id, arg) Tracer::record(id, 'i', arg)
+#define TRACE_SCOPE(id, arg) TraceScope traceScope(id, arg)
+
+#endif /* defined(__PathPlanner__Trace__) */
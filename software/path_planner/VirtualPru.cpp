@@ -0,0 +1,250 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#include "VirtualPru.h"
+#include "StepperTrapezoid.h"
+#include "Logger.h"
+#include "config.h"
+
+VirtualPru::VirtualPru(bool realTime) : realTime(realTime) {
+	running = false;
+	eventsSent = 0;
+	eventsReceived = 0;
+	endstopPositiveMask = 0xFF;
+	endstopNegativeMask = 0xFF;
+	observer = NULL;
+	
+	for(int i=0;i<NUM_STEPPERS;i++)
+		positions[i] = 0;
+	
+	cycles = 0;
+	stepsDone = 0;
+	blocksDone = 0;
+	blocksCancelled = 0;
+}
+
+VirtualPru::~VirtualPru() {
+	halt();
+}
+
+bool VirtualPru::init(const std::string& /*firmwareStepper*/, const std::string& /*firmwareEndstop*/) {
+	memory.assign(VIRTUAL_PRU_DDR_SIZE, 0);
+	
+	LOG_INFO(LOG_PRU, "Virtual PRU " << (realTime ? "in real time" : "simulated") << ", DDR of 0x" << std::hex << memory.size() << " bytes at 0x" << (unsigned long)memory.data() << std::dec << std::endl);
+	
+	return true;
+}
+
+void VirtualPru::start() {
+	halt();
+	
+	if(memory.empty()) return;
+	
+	{
+		std::lock_guard<std::mutex> lk(mutex_event);
+		eventsSent = 0;
+		eventsReceived = 0;
+	}
+	
+	for(int i=0;i<NUM_STEPPERS;i++)
+		positions[i] = 0;
+	
+	cycles = 0;
+	stepsDone = 0;
+	blocksDone = 0;
+	blocksCancelled = 0;
+	
+	running = true;
+	
+	runningThread = std::thread([this]() {
+		this->run();
+	});
+}
+
+void VirtualPru::halt() {
+	running = false;
+	
+	if(runningThread.joinable())
+		runningThread.join();
+	
+	eventSignaled.notify_all();
+}
+
+void VirtualPru::release() {
+	halt();
+	
+	memory.clear();
+	memory.shrink_to_fit();
+}
+
+bool VirtualPru::waitEvent(unsigned int timeoutMs) {
+	std::unique_lock<std::mutex> lk(mutex_event);
+	
+	bool signaled = eventSignaled.wait_for(lk, std::chrono::milliseconds(timeoutMs), [this]{ return eventsSent != eventsReceived || !running; });
+	
+	eventsReceived = eventsSent;
+	
+	return signaled && running;
+}
+
+void VirtualPru::signalEvent() {
+	uint32_t* nrEvents = (uint32_t*)(memory.data()+memory.size()-4);
+	
+	__atomic_store_n(nrEvents, __atomic_load_n(nrEvents, __ATOMIC_RELAXED)+1, __ATOMIC_RELEASE);
+	
+	{
+		std::lock_guard<std::mutex> lk(mutex_event);
+		eventsSent++;
+	}
+	
+	eventSignaled.notify_all();
+}
+
+bool VirtualPru::waitBlock(uint32_t* address) {
+	if(__atomic_load_n(address, __ATOMIC_ACQUIRE))
+		return running;
+	
+	while(running && !__atomic_load_n(address, __ATOMIC_ACQUIRE)) {
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+	
+	//The PRU was idle, the time spent waiting doesn't have to be caught up
+	if(realTime)
+		deadline = std::max(deadline, std::chrono::steady_clock::now());
+	
+	return running;
+}
+
+bool VirtualPru::executeStep(const SteppersCommand& cmd, uint32_t delay) {
+	uint8_t allowed = (cmd.direction & endstopPositiveMask) | (~cmd.direction & endstopNegativeMask);
+	
+	if(cmd.cancellableMask && !(cmd.cancellableMask & allowed))
+		return false;
+	
+	uint8_t step = cmd.step & allowed;
+	
+	for(int i=0;i<NUM_STEPPERS;i++) {
+		if(step & (1<<i))
+			positions[i].fetch_add((cmd.direction & (1<<i)) ? 1 : -1, std::memory_order_relaxed);
+	}
+	
+	if(observer)
+		observer->step(cmd, step, cycles);
+	
+	cycles.fetch_add(delay, std::memory_order_relaxed);
+	stepsDone.fetch_add(1, std::memory_order_relaxed);
+	
+	if(realTime) {
+		deadline += std::chrono::nanoseconds(delay*(1000000000LL/F_CPU));
+		
+		if(deadline - std::chrono::steady_clock::now() > std::chrono::nanoseconds(VIRTUAL_PRU_MAX_AHEAD))
+			std::this_thread::sleep_until(deadline);
+	}
+	
+	uint32_t* pruControl = (uint32_t*)(memory.data()+memory.size()-8);
+	
+	if(__atomic_load_n(pruControl, __ATOMIC_ACQUIRE)) {
+		while(running && __atomic_load_n(pruControl, __ATOMIC_ACQUIRE)) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		
+		if(realTime)
+			deadline = std::max(deadline, std::chrono::steady_clock::now());
+	}
+	
+	return true;
+}
+
+void VirtualPru::run() {
+	LOG_INFO(LOG_PRU, "Starting virtual PRU..." << std::endl);
+	
+	uint8_t* ddr = memory.data();
+	uint8_t* reading = ddr;
+	
+	deadline = std::chrono::steady_clock::now();
+	
+	while(waitBlock((uint32_t*)reading)) {
+		uint32_t nbCommands = __atomic_load_n((uint32_t*)reading, __ATOMIC_ACQUIRE);
+		
+		if(nbCommands == DDR_MAGIC) {
+			reading = ddr;
+			continue;
+		}
+		
+		const uint8_t* cmd = reading+4;
+		bool cancelled = false;
+		
+		//A block of trapezoids only contains trapezoids
+		bool trapezoids = ((const SteppersCommand*)cmd)->options & STEPPER_COMMAND_OPTION_TRAPEZOID;
+		size_t unit = trapezoids ? sizeof(SteppersTrapezoid) : sizeof(SteppersCommand);
+		
+		for(uint32_t i=0;i<nbCommands && !cancelled && running;i++) {
+			if(trapezoids) {
+				const SteppersTrapezoid& trapezoid = *(const SteppersTrapezoid*)(cmd+i*unit);
+				
+				TrapezoidStepper stepper(trapezoid);
+				SteppersCommand step;
+				
+				//The steps are computed one by one like on the PRU
+				while(!stepper.done() && !cancelled && running) {
+					uint32_t stepNumber = stepper.getStepNumber();
+					stepper.next(step);
+					
+					uint32_t delay = trapezoidStepCycles(step.delay, trapezoidRampStep(trapezoid, stepNumber) ? PRU_TRAPEZOID_RAMP_CYCLES : PRU_TRAPEZOID_CRUISE_CYCLES);
+					
+					//The loading of the descriptor is counted with the first step
+					if(stepNumber == 0)
+						delay += PRU_TRAPEZOID_START_CYCLES;
+					
+					cancelled = !executeStep(step, delay);
+				}
+			} else {
+				const SteppersCommand& command = *(const SteppersCommand*)(cmd+i*unit);
+				unsigned int steps = stepperCommandSteps(command);
+				
+				for(unsigned int j=0;j<steps && !cancelled && running;j++) {
+					cancelled = !executeStep(command, stepCycles(command.delay));
+				}
+			}
+		}
+		
+		if(!running) break;
+		
+		if(cancelled)
+			blocksCancelled.fetch_add(1, std::memory_order_relaxed);
+		
+		if(observer)
+			observer->blockDone(cancelled);
+		
+		//The event is sent once the last step of the block is really done
+		if(realTime)
+			std::this_thread::sleep_until(deadline);
+		
+		blocksDone.fetch_add(1, std::memory_order_relaxed);
+		
+		reading += 4+nbCommands*unit;
+		
+		signalEvent();
+	}
+	
+	LOG_INFO(LOG_PRU, "Virtual PRU stopped." << std::endl);
+}
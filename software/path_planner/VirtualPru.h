@@ -0,0 +1,183 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+#ifndef __PathPlanner__VirtualPru__
+#define __PathPlanner__VirtualPru__
+
+#include <stdint.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include "PruBackend.h"
+#include "StepperCommand.h"
+
+/* Size of the DDR memory allocated by the virtual PRU, the same order as the one reserved on the BeagleBone */
+#define VIRTUAL_PRU_DDR_SIZE 0x40000
+
+/* The virtual PRU sleeps when it is ahead of the real time by more than this, in ns */
+#define VIRTUAL_PRU_MAX_AHEAD 1000000
+
+/**
+ * Receives the steps executed by a VirtualPru, in the thread of the virtual PRU.
+ */
+class VirtualPruObserver {
+public:
+	virtual ~VirtualPruObserver() {}
+	
+	/**
+	 * @brief Called for each step executed
+	 *
+	 * @param command The command of the step, a repeated command or a trapezoid gives one call per step
+	 * @param stepped The steppers actually stepped, the step mask of the command masked by the end stops
+	 * @param cycle The PRU cycle at which the step starts
+	 */
+	virtual void step(const SteppersCommand& command, uint8_t stepped, uint64_t cycle) = 0;
+	
+	/**
+	 * @brief Called when a block is done, before the event is signaled
+	 *
+	 * @param cancelled true if the end of the block was cancelled by the end stops
+	 */
+	virtual void blockDone(bool cancelled) = 0;
+};
+
+/**
+ * A thread executing the DDR ring like firmware_runtime.p, so the whole planner can run on a computer without PRU.
+ *
+ * It follows the same protocol as the firmware: the block counts, the DDR_MAGIC wrap, the event counter, the 
+ * pru_control suspend and the cancellable masks checked against the end stop masks. The steps of the trapezoids are 
+ * computed one at a time with a TrapezoidStepper. The clock is advanced by the delay of each step, with the same 
+ * minimum step time and trapezoid overheads as the firmware. In real time mode the thread sleeps so the steps are 
+ * executed at their real speed, otherwise it runs as fast as possible and getCycles() gives the simulated time.
+ */
+class VirtualPru : public PruBackend {
+private:
+	bool realTime;
+	std::vector<uint8_t> memory;
+	
+	std::thread runningThread;
+	std::atomic<bool> running;
+	
+	std::mutex mutex_event;
+	std::condition_variable eventSignaled;
+	uint32_t eventsSent;
+	uint32_t eventsReceived;
+	
+	std::atomic<uint8_t> endstopPositiveMask;
+	std::atomic<uint8_t> endstopNegativeMask;
+	
+	std::atomic<int64_t> positions[NUM_STEPPERS];
+	std::atomic<uint64_t> cycles;
+	std::atomic<uint64_t> stepsDone;
+	std::atomic<uint64_t> blocksDone;
+	std::atomic<uint64_t> blocksCancelled;
+	
+	VirtualPruObserver* observer;
+	
+	std::chrono::steady_clock::time_point deadline;
+	
+	void run();
+	
+	/* Wait until the block count at address is not 0, false if the PRU is halted */
+	bool waitBlock(uint32_t* address);
+	
+	/* Execute one step taking delay PRU cycles, false if the command cancels the rest of the block */
+	bool executeStep(const SteppersCommand& cmd, uint32_t delay);
+	
+	void signalEvent();
+	
+public:
+	/**
+	 * @param realTime true to execute the steps at their real speed, false to run as fast as possible
+	 */
+	VirtualPru(bool realTime);
+	virtual ~VirtualPru();
+	
+	virtual bool init(const std::string& firmwareStepper, const std::string& firmwareEndstop);
+	
+	virtual uint8_t* getDDRMemory() {
+		return memory.data();
+	}
+	
+	virtual unsigned long getDDRAddress() {
+		return (unsigned long)memory.data();
+	}
+	
+	virtual unsigned long getDDRSize() {
+		return memory.size();
+	}
+	
+	virtual void start();
+	virtual void halt();
+	virtual bool waitEvent(unsigned int timeoutMs);
+	virtual void release();
+	
+	/**
+	 * @brief Set the masks of the steppers allowed to move, as PRU1 does from the end stops
+	 *
+	 * @param positive Steppers allowed to move in the positive direction, defined as 0b000HEZYX
+	 * @param negative Steppers allowed to move in the negative direction, defined as 0b000HEZYX
+	 */
+	void setEndstopMasks(uint8_t positive, uint8_t negative) {
+		endstopPositiveMask = positive;
+		endstopNegativeMask = negative;
+	}
+	
+	/**
+	 * @brief Set the observer receiving the executed steps, NULL for none
+	 * @details To be set before the commands are pushed.
+	 */
+	void setObserver(VirtualPruObserver* observer) {
+		this->observer = observer;
+	}
+	
+	/**
+	 * @brief Return the position of a stepper in steps since start()
+	 */
+	int64_t getPosition(int stepper) {
+		return positions[stepper];
+	}
+	
+	/**
+	 * @brief Return the number of PRU cycles executed since start()
+	 */
+	uint64_t getCycles() {
+		return cycles;
+	}
+	
+	uint64_t getStepsDone() {
+		return stepsDone;
+	}
+	
+	uint64_t getBlocksDone() {
+		return blocksDone;
+	}
+	
+	uint64_t getBlocksCancelled() {
+		return blocksCancelled;
+	}
+};
+
+#endif /* defined(__PathPlanner__VirtualPru__) */
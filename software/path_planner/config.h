@@ -38,6 +38,16 @@
 /* The speed of the timer created by the PRU in Hz */
 #define F_CPU 200000000
 
+/* Minimum number of PRU cycles of a step, whatever its delay: the time firmware_runtime.p spends setting up the pins */
+#define PRU_MIN_STEP_CYCLES 939
+
+/* PRU cycles firmware_runtime.p spends computing a step of a trapezoid on top of a plain step, in the acceleration or 
+ * deceleration and in the cruise, and once per trapezoid. Counted in the firmware listing, must be kept in sync with 
+ * TRAPEZOID_RAMP_CYCLES and TRAPEZOID_CRUISE_CYCLES. */
+#define PRU_TRAPEZOID_RAMP_CYCLES 789
+#define PRU_TRAPEZOID_CRUISE_CYCLES 64
+#define PRU_TRAPEZOID_START_CYCLES 25
+
 /* Minimum of move buffered in the PRU (in term of move time in milliseconds) before we stop sending moves to the PRU. */
 /* Should be as low as possible so that we can keep some moves in the PathPlanner buffer for proper speed computations */
 #define MIN_BUFFERED_MOVE_TIME 100
@@ -48,4 +58,102 @@
  */
 #define PRINT_MOVE_BUFFER_WAIT 500
 
+/* Bounds of the PRU time kept queued by the adaptive buffering, in milliseconds (see BufferController). 
+ * MIN_BUFFERED_MOVE_TIME is the starting value, and the only one when the adaptive buffering is disabled. */
+#define ADAPTIVE_BUFFERED_MOVE_TIME_MIN 20
+#define ADAPTIVE_BUFFERED_MOVE_TIME_MAX 1000
+
+/* Lower bound of the adaptive wait for a new line before printing, in milliseconds. PRINT_MOVE_BUFFER_WAIT is the upper bound */
+#define ADAPTIVE_BUFFER_WAIT_MIN 50
+
+/* Half-life of the peaks measured by the adaptive buffering, in milliseconds: the target goes back down this slowly 
+ * once the host is quiet again */
+#define ADAPTIVE_BUFFER_HALF_LIFE 10000
+
+/* The queued PRU time is kept at least this many times the peak wake-up latency of the path planner thread */
+#define ADAPTIVE_BUFFER_LATENCY_FACTOR 4
+
+/* The wait for a new line is this many times the peak time between two lines queued in a row */
+#define ADAPTIVE_BUFFER_GAP_FACTOR 4
+
+/* Time of the moves to queue before printing, as a multiple of the PRU time kept queued */
+#define ADAPTIVE_BUFFER_FILL_FACTOR 2
+
+/* Number of steps computed at once by the step generator of the path planner */
+#define STEP_GENERATOR_BLOCK_SIZE 256
+
+/* Number of step commands in a chunk of the command arena. The commands of a line are sent to the PRU chunk by chunk */
+#define COMMAND_ARENA_CHUNK_COMMANDS 1024
+
+/* Number of chunks of the command arena, allocated once when the path planner is created (8 KB per chunk). 
+ * It does not cover the worst case of all the lines, the generation workers only claim a line when its chunks can be 
+ * reserved. Chunks are allocated on the heap when all of them are in use */
+#define COMMAND_ARENA_CHUNKS 1024
+
+/* Lines with more steps than this are not generated in advance, their commands are computed chunk by chunk while 
+ * being sent to the PRU so that the memory used and the latency before their first step do not depend on their length */
+#define COMMAND_STREAMING_STEPS 16384
+
+/* Number of chunks of the command arena that the generation workers cannot reserve: the most used by a line that is 
+ * not streamed, so that the lines generated by the path planner thread itself never go to the heap */
+#define COMMAND_ARENA_KEPT_CHUNKS ((COMMAND_STREAMING_STEPS + COMMAND_ARENA_CHUNK_COMMANDS - 1) / COMMAND_ARENA_CHUNK_COMMANDS)
+
+/* Number of acceleration ramps kept by the ramp cache of the path planner */
+#define RAMP_CACHE_SIZE 32
+
+/* Ramps with more acceleration and deceleration steps than this are not cached, it bounds the memory used by the cache */
+#define RAMP_CACHE_MAX_STEPS 8192
+
+/* Compute the ramps with IncrementalRamp instead of the time based ramp by default. Its only gain is the accuracy of 
+ * the move times: on 32 bits ARM its 64 bits products take about twice the time of the time based ramp per step, it 
+ * is only as fast where the compiler has a 128 bits type. */
+#define INCREMENTAL_RAMP_DEFAULT false
+
+/* Number of segments per second of move on the printers whose carriages do not move in straight lines (Delta) */
+#define DELTA_SEGMENTS_PER_SECOND 200
+
+/* Minimum length of a segment in meters, the slow moves are split in fewer segments than DELTA_SEGMENTS_PER_SECOND */
+#define DELTA_MIN_SEGMENT_LENGTH 0.0005
+
+/* Number of segments whose inverse kinematics are computed at once */
+#define DELTA_SEGMENTS_BATCH 32
+
+/* Default maximum distance in meters between an arc and the chords it is split into */
+#define ARC_CHORD_TOLERANCE 0.000002
+
+/* Interval in ms over which the moves/s and steps/s of the metrics are computed */
+#define METRICS_RATE_INTERVAL 1000
+
+/* Maximum number of clients waiting for the metrics socket */
+#define METRICS_SOCKET_BACKLOG 4
+
+/* Time in ms after which the metrics server checks whether it has been stopped */
+#define METRICS_SOCKET_POLL_TIMEOUT 200
+
+/* Time in ms a client of the metrics socket has to send an HTTP request, the metrics are sent without HTTP header after */
+#define METRICS_SOCKET_REQUEST_TIMEOUT 100
+
+/* Number of events kept per thread by the trace ring, must be a power of two */
+#define TRACE_BUFFER_SIZE 8192
+
+/* Number of log messages waiting to be written, must be a power of two. The messages are dropped when it is full */
+#define LOGGER_RING_SIZE 1024
+
+/* Maximum length of a log message, the end of the longer ones is dropped */
+#define LOGGER_RECORD_SIZE 256
+
+/* Time in ms the logger thread sleeps when there is no message to write */
+#define LOGGER_FLUSH_INTERVAL 10
+
+/* Level of the log messages when REDEEM_LOG is not set, the Python module sets the one of the configuration */
+#define LOG_DEFAULT_LEVEL 30
+
+/* Minimum time in ms between two messages of the rate limited call sites of the hot loops */
+#define LOG_HOT_INTERVAL 1000
+
+/* Check that the trapezoid descriptors expand to exactly the same steps as the per step commands computed by the 
+ * path planner. Slow, only for debugging the trapezoid implementation.
+ */
+//#define CHECK_TRAPEZOID_COMMANDS
+
 #endif
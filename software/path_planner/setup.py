@@ -1,8 +1,15 @@
 #!/usr/bin/env python
 
 from distutils.core import setup, Extension
+import platform
 
-pathplanner = Extension('_PathPlannerNative', sources = ['PathPlannerNative.i', 'PathPlanner.cpp','PruTimer.cpp','prussdrv.c','Logger.cpp'],  swig_opts=['-c++','-builtin'], extra_compile_args = ['-std=c++0x','-g','-Ofast','-fpermissive','-D_GLIBCXX_USE_NANOSLEEP','-DBUILD_PYTHON_EXT=1'])
+extra_compile_args = ['-std=c++0x','-g','-Ofast','-fpermissive','-D_GLIBCXX_USE_NANOSLEEP','-DBUILD_PYTHON_EXT=1']
+
+# The step generator uses NEON on the BeagleBone
+if platform.machine().startswith('arm'):
+    extra_compile_args += ['-mfpu=neon']
+
+pathplanner = Extension('_PathPlannerNative', sources = ['PathPlannerNative.i', 'PathPlanner.cpp','PruTimer.cpp','PruBackend.cpp','VirtualPru.cpp','Metrics.cpp','BufferController.cpp','Trace.cpp','StepperTrapezoid.cpp','StepGenerator.cpp','RampCache.cpp','IncrementalRamp.cpp','CommandArena.cpp','CommandStream.cpp','GcodeParser.cpp','Kinematics.cpp','MoveSegmenter.cpp','prussdrv.c','Logger.cpp'],  swig_opts=['-c++','-builtin'], extra_compile_args = extra_compile_args)
 
 setup(name='PathPlannerNative',
       version='1.0',
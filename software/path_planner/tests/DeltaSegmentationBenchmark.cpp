@@ -0,0 +1,193 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+/* Benchmark of the segmentation of the Delta moves, build from the path_planner directory with:
+ * g++ -std=c++0x -Ofast -I. tests/DeltaSegmentationBenchmark.cpp MoveSegmenter.cpp Kinematics.cpp -o DeltaSegmentationBenchmark
+ * The batched inverse kinematics are only vectorized with SSE2, the NEON of the BeagleBone has no double precision.
+ */
+
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include <stdlib.h>
+#include "MoveSegmenter.h"
+#include "Path.h"
+
+#define NB_POINTS 4096
+
+/* Random moves in a disc of 8 cm around the center of the bed */
+static void randomPosition(float position[NUM_AXIS]) {
+	float angle = rand() * 2.0f * M_PI / RAND_MAX;
+	float radius = 0.08f * sqrtf((float)rand() / RAND_MAX);
+	
+	position[X_AXIS] = radius * cosf(angle);
+	position[Y_AXIS] = radius * sinf(angle);
+	position[Z_AXIS] = 0.2f * rand() / RAND_MAX;
+	position[E_AXIS] = 0;
+}
+
+static bool checkBatch(const DeltaKinematics& kinematics) {
+	double x[NB_POINTS], y[NB_POINTS], z[NB_POINTS], a[NB_POINTS], b[NB_POINTS], c[NB_POINTS];
+	const double* const cartesian[NUM_MOVING_AXIS] = {x, y, z};
+	double* const motors[NUM_MOVING_AXIS] = {a, b, c};
+	
+	for(unsigned int n=0; n<NB_POINTS; n++) {
+		float position[NUM_AXIS];
+		randomPosition(position);
+		x[n] = position[X_AXIS];
+		y[n] = position[Y_AXIS];
+		z[n] = position[Z_AXIS];
+	}
+	
+	if(!kinematics.inverseBatch(cartesian, motors, NB_POINTS))
+		return false;
+	
+	for(unsigned int n=0; n<NB_POINTS; n++) {
+		double point[NUM_MOVING_AXIS] = {x[n], y[n], z[n]};
+		double expected[NUM_MOVING_AXIS], back[NUM_MOVING_AXIS];
+		
+		if(!kinematics.inverse(point, expected) || !kinematics.forward(expected, back))
+			return false;
+		
+		for(int i=0; i<NUM_MOVING_AXIS; i++) {
+			//The batch runs the same operations as inverse(), the results are the same to the bit
+			if(motors[i][n] != expected[i] || fabs(back[i] - point[i]) > 1e-9)
+				return false;
+		}
+	}
+	
+	return true;
+}
+
+static double benchmarkInverse(const DeltaKinematics& kinematics, bool batch, unsigned int repeat) {
+	double x[NB_POINTS], y[NB_POINTS], z[NB_POINTS], a[NB_POINTS], b[NB_POINTS], c[NB_POINTS];
+	const double* const cartesian[NUM_MOVING_AXIS] = {x, y, z};
+	double* const motors[NUM_MOVING_AXIS] = {a, b, c};
+	double checksum = 0;
+	
+	for(unsigned int n=0; n<NB_POINTS; n++) {
+		float position[NUM_AXIS];
+		randomPosition(position);
+		x[n] = position[X_AXIS];
+		y[n] = position[Y_AXIS];
+		z[n] = position[Z_AXIS];
+	}
+	
+	auto start = std::chrono::steady_clock::now();
+	
+	for(unsigned int r=0; r<repeat; r++) {
+		if(batch) {
+			kinematics.inverseBatch(cartesian, motors, NB_POINTS);
+		} else {
+			for(unsigned int n=0; n<NB_POINTS; n++) {
+				double point[NUM_MOVING_AXIS] = {x[n], y[n], z[n]};
+				double result[NUM_MOVING_AXIS];
+				kinematics.inverse(point, result);
+				a[n] = result[0];
+				b[n] = result[1];
+				c[n] = result[2];
+			}
+		}
+		checksum += a[r % NB_POINTS] + b[r % NB_POINTS] + c[r % NB_POINTS];
+	}
+	
+	auto end = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration_cast<std::chrono::duration<double> >(end - start).count();
+	
+	//Keep the computed values alive
+	if(checksum == 1234.5)
+		std::cout << checksum << std::endl;
+	
+	return (double)NB_POINTS * repeat / seconds;
+}
+
+int main(int argc, const char * argv[])
+{
+	unsigned int repeat = argc > 1 ? atoi(argv[1]) : 200;
+	
+	//Kossel XL like printer
+	DeltaKinematics kinematics(0.25, 0.175, 0.033, 0.033, 0.033, 0.0);
+	const float stepsPerMeter[NUM_AXIS] = {80000, 80000, 80000, 535000};
+	const float maxFeedrate[NUM_MOVING_AXIS] = {0.3, 0.3, 0.3};
+	
+	if(!checkBatch(kinematics)) {
+		std::cout << "Batched inverse kinematics mismatch" << std::endl;
+		return 1;
+	}
+	
+	float moves[NB_POINTS / 16][NUM_AXIS];
+	const unsigned int nbMoves = sizeof(moves) / sizeof(moves[0]);
+	for(unsigned int m=0; m<nbMoves; m++) {
+		randomPosition(moves[m]);
+		moves[m][E_AXIS] = m * 0.001f;
+	}
+	
+	MoveSegmenter segmenter;
+	SegmentMove segments[DELTA_SEGMENTS_BATCH];
+	uint64_t totalSegments = 0;
+	float checksum = 0;
+	
+	auto start = std::chrono::steady_clock::now();
+	
+	for(unsigned int r=0; r<repeat; r++) {
+		float position[NUM_AXIS] = {0, 0, 0.1f, 0};
+		
+		for(unsigned int m=0; m<nbMoves; m++) {
+			unsigned int count;
+			
+			if(!segmenter.begin(&kinematics, position, moves[m], 0.1f, stepsPerMeter, maxFeedrate)) {
+				std::cout << "Cannot reach the start of move " << m << std::endl;
+				return 1;
+			}
+			
+			while((count = segmenter.next(segments, DELTA_SEGMENTS_BATCH))) {
+				checksum += segments[count - 1].speed;
+				totalSegments += count;
+			}
+			
+			//The end of the move is within a step of the target
+			if(!segmenter.isDone() || !segmenter.getPosition(position)) {
+				std::cout << "Cannot reach the end of move " << m << std::endl;
+				return 1;
+			}
+			for(int i=0; i<NUM_AXIS; i++) {
+				if(fabsf(position[i] - moves[m][i]) > 2.0f / stepsPerMeter[i]) {
+					std::cout << "Move " << m << " ends " << position[i] - moves[m][i] << " m away from its target" << std::endl;
+					return 1;
+				}
+			}
+		}
+	}
+	
+	auto end = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration_cast<std::chrono::duration<double> >(end - start).count();
+	
+	//Keep the computed values alive
+	if(checksum == 1234.5f)
+		std::cout << checksum << std::endl;
+	
+	std::cout << "Inverse kinematics, point by point: " << (uint64_t)benchmarkInverse(kinematics, false, repeat) << " points/s" << std::endl;
+	std::cout << "Inverse kinematics, batched:        " << (uint64_t)benchmarkInverse(kinematics, true, repeat) << " points/s" << std::endl;
+	std::cout << "Segmentation:                       " << (uint64_t)(totalSegments / seconds) << " segments/s" << std::endl;
+	
+	return 0;
+}
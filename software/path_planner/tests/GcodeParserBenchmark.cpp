@@ -0,0 +1,211 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+/* Benchmark of the G-code parser, build from the path_planner directory with:
+ * g++ -std=c++0x -Ofast -I. tests/GcodeParserBenchmark.cpp GcodeParser.cpp -o GcodeParserBenchmark
+ * Run with the path of a sliced file, or without argument to parse generated slicer-like lines.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "GcodeParser.h"
+
+/* Lines looking like the output of a slicer, with the usual mix of extrusions, travels and comments */
+static std::vector<std::string> generateLines(unsigned int count) {
+	std::vector<std::string> lines;
+	char buffer[128];
+	float e = 0;
+	
+	lines.reserve(count);
+	
+	for(unsigned int i=0; i<count; i++) {
+		float x = 100 + 50 * sinf(i * 0.01f);
+		float y = 100 + 50 * cosf(i * 0.013f);
+		
+		switch(i % 20) {
+			case 0:
+				snprintf(buffer, sizeof(buffer), "G1 F9000 X%.3f Y%.3f", x, y);
+				break;
+			case 1:
+				snprintf(buffer, sizeof(buffer), ";TYPE:WALL-OUTER");
+				break;
+			case 2:
+				snprintf(buffer, sizeof(buffer), "G0 X%.3f Y%.3f Z%.2f ; travel", x, y, 0.2f + (i / 1000) * 0.2f);
+				break;
+			case 3:
+				snprintf(buffer, sizeof(buffer), "M106 S255");
+				break;
+			default:
+				e += 0.04321f;
+				snprintf(buffer, sizeof(buffer), "G1 X%.3f Y%.3f E%.5f", x, y, e);
+				break;
+		}
+		
+		lines.push_back(buffer);
+	}
+	
+	return lines;
+}
+
+/* The parsing of the Python Gcode class: split on spaces, one string and one number per word */
+static bool naiveParse(const std::string& line, std::string& command, std::vector<std::pair<char, float> >& tokens) {
+	std::string code = line.substr(0, line.find(';'));
+	std::istringstream words(code);
+	std::string word;
+	
+	command.clear();
+	tokens.clear();
+	
+	while(words >> word) {
+		if(command.empty()) {
+			command = word;
+		} else {
+			tokens.push_back(std::make_pair(word[0], (float)strtod(word.c_str() + 1, NULL)));
+		}
+	}
+	
+	return !command.empty();
+}
+
+static bool checkParser() {
+	GcodeLine line;
+	
+	if(!line.parse("N42 G1 X10.5 Y-3 E.25 F3000*86") || line.getCommand() != "G1" || line.getLineNumber() != 42
+	   || line.getValue('X') != 10.5f || line.getValue('y') != -3.0f || line.getValue('E') != 0.25f 
+	   || line.getValue('F') != 3000.0f || line.getLettersCount() != 4 || !line.hasChecksum())
+		return false;
+	
+	//Same checksum as the one computed by the hosts
+	uint8_t checksum = 0;
+	const char* text = "N42 G1 X10.5 Y-3 E.25 F3000";
+	for(const char* c = text; *c; c++) {
+		checksum ^= *c;
+	}
+	char withChecksum[64];
+	snprintf(withChecksum, sizeof(withChecksum), "%s*%d", text, checksum);
+	if(!line.parse(withChecksum) || !line.isChecksumValid())
+		return false;
+	
+	if(!line.parse("G29.1 ; probe") || line.getCommand() != "G29.1" || line.getLettersCount() != 0)
+		return false;
+	
+	if(!line.parse("g28x0y0") || line.getCommand() != "G28" || !line.hasLetter('X') || !line.hasLetter('Y') || line.hasLetter('Z'))
+		return false;
+	
+	if(!line.parse("M117 Hello world") || line.getTextOffset() != 5 || !line.hasLetter('H') || line.hasValue('H'))
+		return false;
+	
+	if(line.parse("; only a comment") || line.parse("") || line.getLettersCount() != 0)
+		return false;
+	
+	return true;
+}
+
+int main(int argc, const char * argv[])
+{
+	std::vector<std::string> lines;
+	
+	if(!checkParser()) {
+		std::cout << "Parser check failed" << std::endl;
+		return 1;
+	}
+	
+	if(argc > 1) {
+		std::ifstream file(argv[1]);
+		std::string text;
+		
+		if(!file) {
+			std::cout << "Cannot open " << argv[1] << std::endl;
+			return 1;
+		}
+		
+		while(std::getline(file, text)) {
+			lines.push_back(text);
+		}
+	} else {
+		lines = generateLines(1000000);
+	}
+	
+	GcodeLine line;
+	std::string command;
+	std::vector<std::pair<char, float> > tokens;
+	unsigned int commands = 0;
+	float sum = 0;
+	
+	//The two parsers must agree on the generated lines
+	for(size_t i=0; i<lines.size() && argc <= 1; i++) {
+		line.parse(lines[i]);
+		naiveParse(lines[i], command, tokens);
+		
+		if(command != line.getCommand() || tokens.size() != line.getLettersCount()) {
+			std::cout << "Parser mismatch on line " << lines[i] << std::endl;
+			return 1;
+		}
+		
+		for(size_t t=0; t<tokens.size(); t++) {
+			if(fabsf(line.getValue(tokens[t].first) - tokens[t].second) > fabsf(tokens[t].second) * 1e-6f) {
+				std::cout << "Value mismatch on line " << lines[i] << std::endl;
+				return 1;
+			}
+		}
+	}
+	
+	auto start = std::chrono::steady_clock::now();
+	
+	for(size_t i=0; i<lines.size(); i++) {
+		if(line.parse(lines[i])) {
+			commands++;
+			sum += line.hasValue('X') ? line.getValue('X') : 0;
+		}
+	}
+	
+	auto end = std::chrono::steady_clock::now();
+	double native = lines.size() / std::chrono::duration_cast<std::chrono::duration<double> >(end - start).count();
+	
+	start = std::chrono::steady_clock::now();
+	
+	for(size_t i=0; i<lines.size(); i++) {
+		if(naiveParse(lines[i], command, tokens)) {
+			commands--;
+			sum -= tokens.empty() ? 0 : tokens[0].second;
+		}
+	}
+	
+	end = std::chrono::steady_clock::now();
+	double naive = lines.size() / std::chrono::duration_cast<std::chrono::duration<double> >(end - start).count();
+	
+	//Keep the parsed values alive
+	if(commands == 0xFFFFFFFF || sum == 1234.5f)
+		std::cout << sum << std::endl;
+	
+	std::cout << lines.size() << " lines" << std::endl;
+	std::cout << "GcodeLine:    " << (uint64_t)native << " lines/s" << std::endl;
+	std::cout << "Split/strtod: " << (uint64_t)naive << " lines/s" << std::endl;
+	
+	return 0;
+}
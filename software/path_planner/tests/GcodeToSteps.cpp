@@ -0,0 +1,361 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+/* Compile a G-code file into the stepper commands the PRU would execute, with the real path planner and step generator
+ * running on a simulated virtual PRU. Build from the path_planner directory with:
+ * gcc -c prussdrv.c && g++ -std=c++0x -Ofast -DNDEBUG -I. -D_GLIBCXX_USE_NANOSLEEP tests/GcodeToSteps.cpp PathPlanner.cpp PruTimer.cpp PruBackend.cpp VirtualPru.cpp Logger.cpp StepperTrapezoid.cpp StepGenerator.cpp RampCache.cpp IncrementalRamp.cpp CommandArena.cpp CommandStream.cpp GcodeParser.cpp Kinematics.cpp MoveSegmenter.cpp Metrics.cpp Trace.cpp BufferController.cpp prussdrv.o -lpthread -o GcodeToSteps
+ *
+ * Usage: GcodeToSteps [options] input.gcode [output.steps]
+ *   --steps x,y,z,e         Steps per meter, default 32000,32000,400000,48000
+ *   --max-speed x,y,z,e     Maximum speeds in m/s, default 0.2,0.2,0.02,0.2
+ *   --acceleration x,y,z,e  Accelerations in m/s^2, default 0.5,0.5,0.1,0.5
+ *   --jerk xy,z,e           Maximum jerks in m/s, default 0.02,0.002,0.005
+ *   --trapezoids            Send trapezoid commands, the PRU computes the steps
+ * The defaults are the ones of configs/default.cfg.
+ *
+ * The output file is the sequence of the blocks executed by the PRU. Each block is its number of steps as a 32 bits
+ * integer followed by one SteppersCommand per step, whatever the commands sent: the repeated commands and the 
+ * trapezoids are expanded, step is the mask of the steppers stepped and options is 0. Two versions of the planner can 
+ * be compared by comparing their output files.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "PathPlanner.h"
+#include "GcodeParser.h"
+#include "config.h"
+
+/* Feed rate of the moves before the first F, in m/s */
+#define DEFAULT_FEEDRATE 0.05
+
+/* Records the steps executed by the virtual PRU and computes the statistics of the print */
+class StepRecorder : public VirtualPruObserver {
+private:
+	FILE* output;
+	std::vector<SteppersCommand> block;
+	
+public:
+	uint64_t steps[NUM_STEPPERS];
+	uint64_t lastStep[NUM_STEPPERS];
+	uint64_t minInterval[NUM_STEPPERS];
+	uint64_t blocks;
+	uint64_t cancelledBlocks;
+	double cpuTime;
+	
+	StepRecorder(FILE* output) : output(output) {
+		for(int i=0; i<NUM_STEPPERS; i++) {
+			steps[i] = 0;
+			lastStep[i] = 0;
+			minInterval[i] = UINT64_MAX;
+		}
+		
+		blocks = 0;
+		cancelledBlocks = 0;
+		cpuTime = 0;
+	}
+	
+	virtual void step(const SteppersCommand& command, uint8_t stepped, uint64_t cycle) {
+		for(int i=0; i<NUM_STEPPERS; i++) {
+			if(!(stepped & (1 << i)))
+				continue;
+			
+			if(steps[i])
+				minInterval[i] = std::min(minInterval[i], cycle - lastStep[i]);
+			
+			steps[i]++;
+			lastStep[i] = cycle;
+		}
+		
+		if(output) {
+			SteppersCommand executed = command;
+			executed.step = stepped;
+			executed.options = 0;
+			block.push_back(executed);
+		}
+	}
+	
+	virtual void blockDone(bool cancelled) {
+		blocks++;
+		
+		if(cancelled)
+			cancelledBlocks++;
+		
+		if(output) {
+			uint32_t count = block.size();
+			fwrite(&count, sizeof(count), 1, output);
+			fwrite(block.data(), sizeof(SteppersCommand), count, output);
+			block.clear();
+		}
+		
+		//This runs in the thread of the virtual PRU
+		struct timespec time;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+		cpuTime = time.tv_sec + time.tv_nsec*1e-9;
+	}
+};
+
+static double cpuTime(clockid_t clock) {
+	struct timespec time;
+	clock_gettime(clock, &time);
+	return time.tv_sec + time.tv_nsec*1e-9;
+}
+
+/* Parse a list of comma separated numbers, false if there are less than count of them */
+static bool parseList(const char* text, float* values, unsigned int count) {
+	for(unsigned int i=0; i<count; i++) {
+		char* end;
+		values[i] = strtof(text, &end);
+		
+		if(end == text || (i+1 < count && *end != ','))
+			return false;
+		
+		text = end+1;
+	}
+	
+	return true;
+}
+
+static void usage() {
+	std::cerr << "Usage: GcodeToSteps [--steps x,y,z,e] [--max-speed x,y,z,e] [--acceleration x,y,z,e] [--jerk xy,z,e] [--trapezoids] input.gcode [output.steps]" << std::endl;
+}
+
+int main(int argc, const char * argv[])
+{
+	float stepsPerMeter[NUM_AXIS] = {32000, 32000, 400000, 48000};
+	float maxSpeed[NUM_AXIS] = {0.2, 0.2, 0.02, 0.2};
+	float acceleration[NUM_AXIS] = {0.5, 0.5, 0.1, 0.5};
+	float jerk[3] = {0.02, 0.002, 0.005};
+	bool trapezoids = false;
+	const char* inputName = NULL;
+	const char* outputName = NULL;
+	
+	for(int i=1; i<argc; i++) {
+		bool ok = true;
+		
+		if(!strcmp(argv[i], "--steps") && i+1 < argc) {
+			ok = parseList(argv[++i], stepsPerMeter, NUM_AXIS);
+		} else if(!strcmp(argv[i], "--max-speed") && i+1 < argc) {
+			ok = parseList(argv[++i], maxSpeed, NUM_AXIS);
+		} else if(!strcmp(argv[i], "--acceleration") && i+1 < argc) {
+			ok = parseList(argv[++i], acceleration, NUM_AXIS);
+		} else if(!strcmp(argv[i], "--jerk") && i+1 < argc) {
+			ok = parseList(argv[++i], jerk, 3);
+		} else if(!strcmp(argv[i], "--trapezoids")) {
+			trapezoids = true;
+		} else if(argv[i][0] != '-' && !inputName) {
+			inputName = argv[i];
+		} else if(argv[i][0] != '-' && !outputName) {
+			outputName = argv[i];
+		} else {
+			ok = false;
+		}
+		
+		if(!ok) {
+			usage();
+			return 1;
+		}
+	}
+	
+	if(!inputName) {
+		usage();
+		return 1;
+	}
+	
+	std::ifstream input(inputName);
+	
+	if(!input.good()) {
+		std::cerr << "Unable to open " << inputName << std::endl;
+		return 1;
+	}
+	
+	FILE* output = NULL;
+	
+	if(outputName && !(output = fopen(outputName, "wb"))) {
+		std::cerr << "Unable to create " << outputName << std::endl;
+		return 1;
+	}
+	
+	StepRecorder recorder(output);
+	VirtualPru* pru = new VirtualPru(false);
+	pru->setObserver(&recorder);
+	
+	PathPlanner planner;
+	
+	if(!planner.initPRU(pru)) {
+		std::cerr << "Unable to init the virtual PRU" << std::endl;
+		return 1;
+	}
+	
+	unsigned long steps[NUM_MOVING_AXIS];
+	for(int i=0; i<NUM_MOVING_AXIS; i++)
+		steps[i] = stepsPerMeter[i];
+	
+	planner.setAxisStepsPerMeter(steps);
+	planner.setMaxFeedrates(maxSpeed);
+	planner.setPrintAcceleration(acceleration);
+	planner.setTravelAcceleration(acceleration);
+	planner.setMaxJerk(jerk[0], jerk[1]);
+	
+	Extruder& extruder = planner.getExtruder(0);
+	extruder.setAxisStepsPerMeter(stepsPerMeter[E_AXIS]);
+	extruder.setMaxFeedrate(maxSpeed[E_AXIS]);
+	extruder.setPrintAcceleration(acceleration[E_AXIS]);
+	extruder.setTravelAcceleration(acceleration[E_AXIS]);
+	extruder.setMaxStartFeedrate(jerk[2]);
+	planner.setExtruder(0);
+	
+	planner.setTrapezoidCommands(trapezoids);
+	planner.runThread();
+	
+	//Position in meters of the G-code, the planner keeps the one rounded to whole steps
+	float position[NUM_AXIS] = {0, 0, 0, 0};
+	const char axisLetters[NUM_AXIS] = {'X', 'Y', 'Z', 'E'};
+	float feedrate = DEFAULT_FEEDRATE;
+	float unit = 0.001; //G-code units to meters
+	bool absolute = true;
+	bool absoluteExtrusion = true;
+	unsigned long lines = 0, moves = 0, ignored = 0;
+	
+	GcodeLine gcode;
+	std::string line;
+	
+	auto start = std::chrono::steady_clock::now();
+	
+	while(std::getline(input, line)) {
+		lines++;
+		
+		if(!gcode.parse(line))
+			continue;
+		
+		char letter = gcode.getCommandLetter();
+		int code = gcode.getCommandCode();
+		
+		if(letter == 'G' && code <= 3) {
+			float target[NUM_AXIS];
+			
+			for(int axis=0; axis<NUM_AXIS; axis++) {
+				target[axis] = position[axis];
+				
+				if(!gcode.hasValue(axisLetters[axis]))
+					continue;
+				
+				float value = gcode.getValue(axisLetters[axis])*unit;
+				bool axisAbsolute = axis == E_AXIS ? absolute && absoluteExtrusion : absolute;
+				
+				target[axis] = axisAbsolute ? value : position[axis] + value;
+			}
+			
+			if(gcode.hasValue('F')) {
+				//mm/min to m/s, like G1_G0.py
+				feedrate = gcode.getValue('F')*unit/60.0;
+			}
+			
+			float move[NUM_AXIS];
+			memcpy(move, target, sizeof(move));
+			
+			if(code <= 1) {
+				planner.queueMoveTo(move, feedrate, false, true);
+			} else if(gcode.hasValue('R')) {
+				planner.queueArcRadius(move, gcode.getValue('R')*unit, code == 2, feedrate, false, true);
+			} else {
+				float offsetI = gcode.hasValue('I') ? gcode.getValue('I')*unit : 0;
+				float offsetJ = gcode.hasValue('J') ? gcode.getValue('J')*unit : 0;
+				planner.queueArc(move, offsetI, offsetJ, code == 2, feedrate, false, true);
+			}
+			
+			memcpy(position, target, sizeof(position));
+			moves++;
+		} else if(letter == 'G' && code == 20) {
+			unit = 0.0254;
+		} else if(letter == 'G' && code == 21) {
+			unit = 0.001;
+		} else if(letter == 'G' && code == 28) {
+			//No end stops offline, the axes are considered homed where they are
+			bool all = !gcode.hasLetter('X') && !gcode.hasLetter('Y') && !gcode.hasLetter('Z');
+			
+			for(int axis=0; axis<3; axis++) {
+				if(all || gcode.hasLetter(axisLetters[axis]))
+					position[axis] = 0;
+			}
+			
+			planner.setPosition(position);
+		} else if(letter == 'G' && (code == 90 || code == 91)) {
+			absolute = code == 90;
+		} else if(letter == 'G' && code == 92) {
+			bool all = !gcode.getLettersCount();
+			
+			for(int axis=0; axis<NUM_AXIS; axis++) {
+				if(all)
+					position[axis] = 0;
+				else if(gcode.hasValue(axisLetters[axis]))
+					position[axis] = gcode.getValue(axisLetters[axis])*unit;
+			}
+			
+			planner.setPosition(position);
+		} else if(letter == 'M' && (code == 82 || code == 83)) {
+			absoluteExtrusion = code == 82;
+		} else {
+			ignored++;
+		}
+	}
+	
+	double queueCpu = cpuTime(CLOCK_THREAD_CPUTIME_ID);
+	
+	planner.waitUntilFinished();
+	
+	double wallTime = std::chrono::duration_cast<std::chrono::duration<double> >(std::chrono::steady_clock::now() - start).count();
+	double processCpu = cpuTime(CLOCK_PROCESS_CPUTIME_ID);
+	double printTime = pru->getCycles()/(double)F_CPU;
+	
+	planner.stopThread(true);
+	
+	if(output)
+		fclose(output);
+	
+	const char* stepperNames[NUM_STEPPERS] = {"X", "Y", "Z", "E", "H"};
+	
+	std::cout << "Lines:             " << lines << " (" << moves << " moves, " << ignored << " commands ignored)" << std::endl;
+	std::cout << "Print time:        " << printTime << " s" << std::endl;
+	std::cout << "Blocks:            " << recorder.blocks << " (" << recorder.cancelledBlocks << " cancelled)" << std::endl;
+	
+	for(int i=0; i<NUM_STEPPERS; i++) {
+		if(!recorder.steps[i])
+			continue;
+		
+		double peakRate = recorder.minInterval[i] == UINT64_MAX ? 0 : F_CPU/(double)recorder.minInterval[i];
+		
+		std::cout << "Stepper " << stepperNames[i] << ":         " << recorder.steps[i] << " steps, position " << pru->getPosition(i) << ", peak " << (uint64_t)peakRate << " steps/s" << std::endl;
+	}
+	
+	//The planning is done by the thread queuing the moves and by the planner threads, the PRU thread only executes
+	std::cout << "Planner CPU time:  " << processCpu - recorder.cpuTime << " s (" << queueCpu << " s parsing and queuing)" << std::endl;
+	std::cout << "PRU CPU time:      " << recorder.cpuTime << " s" << std::endl;
+	std::cout << "Wall time:         " << wallTime << " s" << std::endl;
+	
+	return 0;
+}
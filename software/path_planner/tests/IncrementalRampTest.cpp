@@ -0,0 +1,156 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+/* Check that the total time of the moves generated with the incremental ramp matches the theoretical time of the
+ * trapezoid, and compare it with the time based ramp. Build from the path_planner directory with:
+ * g++ -std=c++0x -Ofast -I. tests/IncrementalRampTest.cpp StepGenerator.cpp IncrementalRamp.cpp RampCache.cpp -o IncrementalRampTest
+ */
+
+#include <iostream>
+#include <chrono>
+#include <math.h>
+#include "StepGenerator.h"
+#include "config.h"
+
+/* Maximum difference between the generated and the theoretical time of a move: 1e-6 of the move time plus 100 cycles (0.5 us) */
+#define MAX_RELATIVE_ERROR 1e-6
+#define MAX_ABSOLUTE_ERROR 100
+
+typedef struct TestMove {
+	SteppersTrapezoid trapezoid;
+	uint32_t acceleration;
+} TestMove;
+
+static TestMove makeMove(uint32_t steps, uint32_t vStart, uint32_t vMax, uint32_t vEnd, uint32_t acceleration) {
+	TestMove move;
+	SteppersTrapezoid& trapezoid = move.trapezoid;
+	
+	move.acceleration = acceleration;
+	
+	trapezoid.step = 1;
+	trapezoid.direction = 0;
+	trapezoid.cancellableMask = 0;
+	trapezoid.options = 0;
+	trapezoid.steps = steps;
+	for(unsigned int i=0; i<NUM_STEPPERS; i++) {
+		trapezoid.delta[i] = 0;
+	}
+	trapezoid.delta[0] = steps;
+	
+	//Same computation as Path::updateStepsParameter()
+	trapezoid.fullInterval = F_CPU / vMax;
+	trapezoid.vMax = F_CPU / trapezoid.fullInterval;
+	trapezoid.vStart = vStart;
+	trapezoid.vEnd = vEnd;
+	trapezoid.fAcceleration = 262144.0 * acceleration / F_CPU;
+	uint64_t vMax2 = (uint64_t)trapezoid.vMax * trapezoid.vMax;
+	trapezoid.accelSteps = (vMax2 - (uint64_t)vStart * vStart) / (acceleration << 1) + 1;
+	trapezoid.decelSteps = (vMax2 - (uint64_t)vEnd * vEnd) / (acceleration << 1) + 1;
+	if(trapezoid.accelSteps + trapezoid.decelSteps >= steps) {
+		uint32_t reduction = (trapezoid.accelSteps + trapezoid.decelSteps + 2 - steps) >> 1;
+		trapezoid.accelSteps -= std::min(trapezoid.accelSteps, reduction);
+		trapezoid.decelSteps -= std::min(trapezoid.decelSteps, reduction);
+	}
+	
+	return move;
+}
+
+/* Time in cycles of a constant acceleration from v0 over the given distance, the speed being limited to vMax */
+static double rampTime(double v0, double vMax, double acceleration, double distance) {
+	double limitDistance = (vMax * vMax - v0 * v0) / (2 * acceleration);
+	
+	if(distance <= limitDistance)
+		return F_CPU * (sqrt(v0 * v0 + 2 * acceleration * distance) - v0) / acceleration;
+	
+	return F_CPU * ((vMax - v0) / acceleration + (distance - limitDistance) / vMax);
+}
+
+/* Theoretical time of the move in cycles, with the phases lengths used by StepGenerator */
+static double theoreticalTime(const TestMove& move) {
+	const SteppersTrapezoid& trapezoid = move.trapezoid;
+	double a = move.acceleration;
+	uint32_t accelEnd = trapezoid.accelSteps < trapezoid.steps ? trapezoid.accelSteps + 1 : trapezoid.steps;
+	uint32_t decelStart = trapezoid.steps > trapezoid.decelSteps ? trapezoid.steps - trapezoid.decelSteps : 0;
+	if(decelStart < accelEnd)
+		decelStart = accelEnd;
+	
+	double vTop = std::min((double)trapezoid.vMax, sqrt((double)trapezoid.vStart * trapezoid.vStart + 2 * a * accelEnd));
+	
+	//The deceleration is the acceleration from vEnd run backwards
+	return rampTime(trapezoid.vStart, trapezoid.vMax, a, accelEnd)
+		+ (double)(decelStart - accelEnd) * trapezoid.fullInterval
+		+ rampTime(trapezoid.vEnd, vTop, a, trapezoid.steps - decelStart);
+}
+
+static double generatedTime(const TestMove& move, RampAlgorithm algorithm, double& secondsPerStep) {
+	uint8_t steps[STEP_GENERATOR_BLOCK_SIZE];
+	uint32_t delays[STEP_GENERATOR_BLOCK_SIZE];
+	unsigned int count;
+	uint64_t total = 0;
+	
+	auto start = std::chrono::steady_clock::now();
+	
+	StepGenerator generator(move.trapezoid, STEP_KERNEL_SPECIALIZED, NULL, algorithm, move.acceleration);
+	while((count = generator.generate(steps, delays, STEP_GENERATOR_BLOCK_SIZE))) {
+		for(unsigned int i=0; i<count; i++) {
+			total += delays[i];
+		}
+	}
+	
+	auto end = std::chrono::steady_clock::now();
+	secondsPerStep = std::chrono::duration_cast<std::chrono::duration<double> >(end - start).count() / move.trapezoid.steps;
+	
+	return total;
+}
+
+int main(int argc, const char * argv[])
+{
+	const TestMove moves[] = {
+		makeMove(100000, 2000, 80000, 2000, 1000000),       //Full trapezoid
+		makeMove(3000, 2000, 80000, 5000, 1000000),         //Triangle, vMax not reached
+		makeMove(50000, 500, 20000, 500, 50000),            //Slow start, exact computation on the first steps
+		makeMove(20000, 10000, 200000, 3000, 20000000),     //High acceleration
+		makeMove(400, 1500, 4000, 1500, 100000),
+	};
+	const unsigned int nbMoves = sizeof(moves) / sizeof(moves[0]);
+	bool ok = true;
+	
+	for(unsigned int m=0; m<nbMoves; m++) {
+		double timerSecondsPerStep, incrementalSecondsPerStep;
+		double expected = theoreticalTime(moves[m]);
+		double timer = generatedTime(moves[m], RAMP_TIMER, timerSecondsPerStep);
+		double incremental = generatedTime(moves[m], RAMP_INCREMENTAL, incrementalSecondsPerStep);
+		double timerError = (timer - expected) / expected;
+		double incrementalError = (incremental - expected) / expected;
+		
+		std::cout << "Move " << m << ": theoretical " << (uint64_t)expected << " cycles, time based ramp " << timerError * 100 << "% (" 
+			<< timerSecondsPerStep * 1e9 << " ns/step), incremental ramp " << incrementalError * 100 << "% (" 
+			<< incrementalSecondsPerStep * 1e9 << " ns/step)" << std::endl;
+		
+		if(fabs(incremental - expected) > MAX_RELATIVE_ERROR * expected + MAX_ABSOLUTE_ERROR) {
+			std::cout << "Move " << m << ": the incremental ramp is off by " << (int64_t)(incremental - expected) << " cycles" << std::endl;
+			ok = false;
+		}
+	}
+	
+	return ok ? 0 : 1;
+}
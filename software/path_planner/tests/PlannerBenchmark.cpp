@@ -0,0 +1,350 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+/* Microbenchmarks of the stages of the path planner, to track the regressions between versions. Each result is printed 
+ * as a CSV line: stage,case,value,unit. Build from the path_planner directory with:
+ * gcc -c prussdrv.c && g++ -std=c++0x -Ofast -DNDEBUG -I. -D_GLIBCXX_USE_NANOSLEEP tests/PlannerBenchmark.cpp PathPlanner.cpp PruTimer.cpp PruBackend.cpp VirtualPru.cpp Logger.cpp StepperTrapezoid.cpp StepGenerator.cpp RampCache.cpp IncrementalRamp.cpp CommandArena.cpp CommandStream.cpp GcodeParser.cpp Kinematics.cpp MoveSegmenter.cpp Metrics.cpp Trace.cpp BufferController.cpp prussdrv.o -lpthread -o PlannerBenchmark
+ * NDEBUG removes the asserts. The debug logs are disabled unless REDEEM_LOG enables them, they would be measured otherwise. The optional argument multiplies the number of iterations.
+ */
+
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <stdlib.h>
+#include <math.h>
+#include "PathPlanner.h"
+#include "StepGenerator.h"
+#include "config.h"
+
+#define STEPS_PER_METER 80000
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration_cast<std::chrono::duration<double> >(std::chrono::steady_clock::now() - start).count();
+}
+
+/* Name of a segment length in mm, without the trailing zeros */
+static std::string lengthName(float length) {
+	std::string name = std::to_string(length*1000);
+	
+	name.erase(name.find_last_not_of('0') + 1);
+	name.erase(name.find_last_not_of('.') + 1);
+	
+	return name + "mm";
+}
+
+static void printResult(const char* stage, const std::string& name, double value, const char* unit) {
+	std::cout << stage << "," << name << "," << (uint64_t)value << "," << unit << std::endl;
+}
+
+static void configure(PathPlanner& planner) {
+	float maxFeedrate[NUM_AXIS] = {0.2, 0.2, 0.005, 0.2};
+	unsigned long steps[NUM_AXIS] = {STEPS_PER_METER, STEPS_PER_METER, STEPS_PER_METER, STEPS_PER_METER};
+	float acceleration[NUM_AXIS] = {3, 3, 0.1, 3};
+	
+	planner.setMaxFeedrates(maxFeedrate);
+	planner.setAxisStepsPerMeter(steps);
+	planner.setPrintAcceleration(acceleration);
+	planner.setTravelAcceleration(acceleration);
+	
+	Extruder& extruder = planner.getExtruder(0);
+	extruder.setAxisStepsPerMeter(500000);
+	extruder.setPrintAcceleration(3);
+	extruder.setTravelAcceleration(3);
+	extruder.setMaxFeedrate(0.2);
+	extruder.setMaxStartFeedrate(0.02);
+	planner.setExtruder(0);
+}
+
+/* Segment i of a polygon approximating a circle, the junctions are planned like the ones of a curved print */
+static void segment(unsigned int i, float length, float axisDiff[NUM_AXIS], float numSteps[NUM_AXIS]) {
+	float angle = i*0.1f;
+	
+	axisDiff[X_AXIS] = length*cosf(angle);
+	axisDiff[Y_AXIS] = length*sinf(angle);
+	axisDiff[Z_AXIS] = 0;
+	axisDiff[E_AXIS] = length*0.05f;
+	
+	numSteps[X_AXIS] = ceilf(fabsf(axisDiff[X_AXIS])*STEPS_PER_METER);
+	numSteps[Y_AXIS] = ceilf(fabsf(axisDiff[Y_AXIS])*STEPS_PER_METER);
+	numSteps[Z_AXIS] = 0;
+	numSteps[E_AXIS] = ceilf(axisDiff[E_AXIS]*500000);
+}
+
+/* queueMove(), which runs calculateMove() and updateTrapezoids(), without executing the moves: the ring of a new 
+ * planner is filled for each batch */
+static double benchmarkPlanning(float length, unsigned int batches) {
+	double seconds = 0;
+	unsigned int moves = 0;
+	float axisDiff[NUM_AXIS], numSteps[NUM_AXIS];
+	
+	for(unsigned int b=0; b<batches; b++) {
+		PathPlanner planner;
+		configure(planner);
+		
+		auto start = std::chrono::steady_clock::now();
+		
+		for(unsigned int i=0; i<MOVE_CACHE_SIZE-1; i++) {
+			segment(i, length, axisDiff, numSteps);
+			planner.queueMove(axisDiff, numSteps, 0.1, false, true);
+		}
+		
+		seconds += secondsSince(start);
+		moves += MOVE_CACHE_SIZE-1;
+	}
+	
+	return moves / seconds;
+}
+
+/* The whole pipeline on the simulated virtual PRU: planning, step generation and DDR publishing. Once the ring is full, 
+ * queueMove() returns at the pace the moves are executed, the throughput is measured until the last one is queued 
+ * since the planner waits PRINT_MOVE_BUFFER_WAIT before executing the last moves. */
+static double benchmarkPipeline(float length, unsigned int count, bool trapezoids) {
+	PathPlanner planner;
+	float axisDiff[NUM_AXIS], numSteps[NUM_AXIS];
+	
+	planner.initVirtualPRU(false);
+	configure(planner);
+	planner.setTrapezoidCommands(trapezoids);
+	planner.runThread();
+	
+	auto start = std::chrono::steady_clock::now();
+	
+	for(unsigned int i=0; i<count; i++) {
+		segment(i, length, axisDiff, numSteps);
+		planner.queueMove(axisDiff, numSteps, 0.1, false, true);
+	}
+	
+	double moves = (count - MOVE_CACHE_SIZE) / secondsSince(start);
+	
+	planner.waitUntilFinished();
+	planner.stopThread(true);
+	
+	return moves;
+}
+
+static SteppersTrapezoid makeTrapezoid(uint32_t deltaX, uint32_t deltaY, uint32_t deltaZ, uint32_t deltaE, uint32_t vMax) {
+	SteppersTrapezoid trapezoid;
+	uint32_t steps = std::max(std::max(deltaX, deltaY), std::max(deltaZ, deltaE));
+	
+	trapezoid.step = 0;
+	trapezoid.direction = 0;
+	trapezoid.cancellableMask = 0;
+	trapezoid.options = STEPPER_COMMAND_OPTION_TRAPEZOID;
+	trapezoid.steps = steps;
+	trapezoid.delta[0] = deltaX;
+	trapezoid.delta[1] = deltaY;
+	trapezoid.delta[2] = deltaZ;
+	trapezoid.delta[3] = deltaE;
+	trapezoid.delta[4] = 0;
+	
+	for(unsigned int i=0; i<NUM_STEPPERS; i++) {
+		if(trapezoid.delta[i])
+			trapezoid.step |= (1 << i);
+	}
+	
+	//1e6 steps/s^2 from and to 2000 steps/s
+	uint32_t acceleration = 1000000;
+	trapezoid.vStart = 2000;
+	trapezoid.vEnd = 2000;
+	trapezoid.vMax = vMax;
+	trapezoid.fAcceleration = (uint32_t)((uint64_t)acceleration * 262144 / F_CPU);
+	trapezoid.accelSteps = (uint32_t)(((uint64_t)vMax * vMax - (uint64_t)trapezoid.vStart * trapezoid.vStart) / (2 * acceleration));
+	trapezoid.decelSteps = trapezoid.accelSteps;
+	if(trapezoid.accelSteps + trapezoid.decelSteps > steps) {
+		trapezoid.accelSteps = steps / 2;
+		trapezoid.decelSteps = steps - trapezoid.accelSteps;
+	}
+	trapezoid.fullInterval = F_CPU / vMax;
+	
+	return trapezoid;
+}
+
+/* The step generator as used by PathPlanner::run(), in steps/s */
+static double benchmarkSteps(const SteppersTrapezoid& trapezoid, unsigned int repeat, RampCache* rampCache) {
+	uint8_t steps[STEP_GENERATOR_BLOCK_SIZE];
+	uint32_t delays[STEP_GENERATOR_BLOCK_SIZE];
+	uint64_t totalSteps = 0;
+	uint32_t checksum = 0;
+	unsigned int count;
+	
+	auto start = std::chrono::steady_clock::now();
+	
+	for(unsigned int r=0; r<repeat; r++) {
+		StepGenerator generator(trapezoid, STEP_KERNEL_SPECIALIZED, rampCache);
+		while((count = generator.generate(steps, delays, STEP_GENERATOR_BLOCK_SIZE))) {
+			checksum += steps[count - 1] + delays[count - 1];
+			totalSteps += count;
+		}
+	}
+	
+	double seconds = secondsSince(start);
+	
+	//Keep the generated values alive
+	if(checksum == 0xFFFFFFFF)
+		std::cout << checksum << std::endl;
+	
+	return totalSteps / seconds;
+}
+
+/* PruTimer::push_block() alone: the virtual PRU is suspended while the DDR is filled, then drains it before the next 
+ * round. The write location keeps moving so the rounds go through the wrap-around of the DDR. */
+static double benchmarkPushBlock(unsigned int commandsPerBlock, unsigned int rounds, unsigned int& wraps) {
+	PruTimer pru;
+	std::vector<SteppersCommand> block(commandsPerBlock);
+	
+	for(unsigned int i=0; i<commandsPerBlock; i++) {
+		block[i].step = 0;
+		block[i].direction = 0;
+		block[i].cancellableMask = 0;
+		block[i].options = 0;
+		block[i].delay = 0;
+	}
+	
+	pru.initVirtualPRU(false);
+	pru.runThread();
+	
+	size_t blockSize = commandsPerBlock*sizeof(SteppersCommand);
+	unsigned int blocksPerRound = pru.getFreeMemory()*3/4/(blockSize+8);
+	uint64_t bytesWritten = 0;
+	double seconds = 0;
+	unsigned int blocks = 0;
+	
+	for(unsigned int r=0; r<rounds; r++) {
+		pru.suspend();
+		
+		auto start = std::chrono::steady_clock::now();
+		
+		for(unsigned int b=0; b<blocksPerRound; b++) {
+			pru.push_block((uint8_t*)block.data(), blockSize, sizeof(SteppersCommand), 0);
+		}
+		
+		seconds += secondsSince(start);
+		blocks += blocksPerRound;
+		bytesWritten += blocksPerRound*(blockSize+4);
+		
+		pru.resume();
+		pru.waitUntilFinished();
+	}
+	
+	wraps = bytesWritten/pru.getBackend()->getDDRSize();
+	
+	pru.stopThread(true);
+	
+	return blocks / seconds;
+}
+
+/* Cost of recording an event in the trace ring, disabled and enabled */
+static double benchmarkTrace(bool enabled, unsigned int count) {
+	Tracer::setEnabled(enabled);
+	
+	auto start = std::chrono::steady_clock::now();
+	
+	for(unsigned int i=0; i<count; i++) {
+		TRACE_INSTANT(TRACE_BLOCK_PUBLISHED, i);
+	}
+	
+	double seconds = secondsSince(start);
+	
+	Tracer::setEnabled(false);
+	
+	return seconds*1e9 / count;
+}
+
+/* Cost of a debug message when its category does not log it */
+static double benchmarkDisabledLog(unsigned int count) {
+	int level = Logger::getLevel(LOG_PLANNER);
+	Logger::setLevel("planner", LOG_LEVEL_INFO);
+	
+	auto start = std::chrono::steady_clock::now();
+	
+	for(unsigned int i=0; i<count; i++) {
+		LOG_DEBUG(LOG_PLANNER, "Message " << i << std::endl);
+	}
+	
+	double seconds = secondsSince(start);
+	
+	Logger::setLevel("planner", level);
+	
+	return seconds*1e9 / count;
+}
+
+int main(int argc, const char * argv[])
+{
+	unsigned int repeat = argc > 1 ? atoi(argv[1]) : 1;
+	
+	std::cout << "stage,case,value,unit" << std::endl;
+	
+	//Segment lengths in m, from the tiny segments of a curve to long travel moves
+	const float lengths[] = {0.0001, 0.001, 0.01, 0.05};
+	const unsigned int nbLengths = sizeof(lengths) / sizeof(lengths[0]);
+	
+	for(unsigned int l=0; l<nbLengths; l++) {
+		printResult("planning", lengthName(lengths[l]), benchmarkPlanning(lengths[l], 200*repeat), "moves/s");
+	}
+	
+	for(unsigned int l=0; l<nbLengths; l++) {
+		std::string name = lengthName(lengths[l]);
+		
+		//The long moves are limited by the step generation, less of them are needed
+		unsigned int count = (lengths[l] < 0.005 ? 5000 : 500)*repeat;
+		
+		printResult("pipeline", name + " steps", benchmarkPipeline(lengths[l], count, false), "moves/s");
+		printResult("pipeline", name + " trapezoids", benchmarkPipeline(lengths[l], count, true), "moves/s");
+	}
+	
+	//The usual shapes of moves, each one runs a different instantiation of the specialized kernel
+	const char* shapeNames[] = {"XY+E print", "XY travel", "E retract", "Z only", "XYZ+E"};
+	const SteppersTrapezoid shapes[] = {
+		makeTrapezoid(8000, 5000, 0, 300, 80000),
+		makeTrapezoid(8000, 5000, 0, 0, 160000),
+		makeTrapezoid(0, 0, 0, 1500, 40000),
+		makeTrapezoid(0, 0, 4000, 0, 20000),
+		makeTrapezoid(8000, 5000, 400, 300, 80000),
+	};
+	const unsigned int nbShapes = sizeof(shapes) / sizeof(shapes[0]);
+	
+	RampCache rampCache;
+	
+	for(unsigned int t=0; t<nbShapes; t++) {
+		printResult("steps", shapeNames[t], benchmarkSteps(shapes[t], 200*repeat, NULL), "steps/s");
+		printResult("steps", std::string(shapeNames[t]) + " cached ramp", benchmarkSteps(shapes[t], 200*repeat, &rampCache), "steps/s");
+	}
+	
+	//One block per step generator block as sent by PathPlanner::run(), and bigger blocks
+	const unsigned int blockCommands[] = {16, STEP_GENERATOR_BLOCK_SIZE, 4096};
+	
+	for(unsigned int b=0; b<sizeof(blockCommands)/sizeof(blockCommands[0]); b++) {
+		unsigned int wraps;
+		double blocks = benchmarkPushBlock(blockCommands[b], 20*repeat, wraps);
+		std::string name = std::to_string(blockCommands[b]) + " commands";
+		
+		printResult("push_block", name, blocks, "blocks/s");
+		printResult("push_block", name, blocks*blockCommands[b]*sizeof(SteppersCommand), "bytes/s");
+		printResult("push_block", name + " wraps", wraps, "count");
+	}
+	
+	printResult("trace", "disabled", benchmarkTrace(false, 10000000*repeat), "ns/event");
+	printResult("trace", "enabled", benchmarkTrace(true, 10000000*repeat), "ns/event");
+	printResult("log", "disabled", benchmarkDisabledLog(10000000*repeat), "ns/message");
+	
+	return 0;
+}
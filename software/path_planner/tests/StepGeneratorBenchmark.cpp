@@ -0,0 +1,194 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+/* Benchmark of the step generator kernels, build from the path_planner directory with:
+ * g++ -std=c++0x -Ofast -I. tests/StepGeneratorBenchmark.cpp StepGenerator.cpp StepperTrapezoid.cpp RampCache.cpp IncrementalRamp.cpp -o StepGeneratorBenchmark
+ * Add -mfpu=neon on the BeagleBone to enable the NEON kernel.
+ */
+
+#include <iostream>
+#include <chrono>
+#include <stdlib.h>
+#include <algorithm>
+#include "StepGenerator.h"
+#include "StepperTrapezoid.h"
+#include "config.h"
+
+static SteppersTrapezoid makeTrapezoid(uint32_t deltaX, uint32_t deltaY, uint32_t deltaZ, uint32_t deltaE, uint32_t vMax) {
+	SteppersTrapezoid trapezoid;
+	uint32_t steps = std::max(std::max(deltaX, deltaY), std::max(deltaZ, deltaE));
+	
+	trapezoid.step = 0;
+	trapezoid.direction = 0;
+	trapezoid.cancellableMask = 0;
+	trapezoid.options = STEPPER_COMMAND_OPTION_TRAPEZOID;
+	trapezoid.steps = steps;
+	trapezoid.delta[0] = deltaX;
+	trapezoid.delta[1] = deltaY;
+	trapezoid.delta[2] = deltaZ;
+	trapezoid.delta[3] = deltaE;
+	trapezoid.delta[4] = 0;
+	
+	for(unsigned int i=0; i<NUM_STEPPERS; i++) {
+		if(trapezoid.delta[i])
+			trapezoid.step |= (1 << i);
+	}
+	
+	//1e6 steps/s^2 from and to 2000 steps/s
+	uint32_t acceleration = 1000000;
+	trapezoid.vStart = 2000;
+	trapezoid.vEnd = 2000;
+	trapezoid.vMax = vMax;
+	trapezoid.fAcceleration = (uint32_t)((uint64_t)acceleration * 262144 / F_CPU);
+	trapezoid.accelSteps = (uint32_t)(((uint64_t)vMax * vMax - (uint64_t)trapezoid.vStart * trapezoid.vStart) / (2 * acceleration));
+	trapezoid.decelSteps = trapezoid.accelSteps;
+	if(trapezoid.accelSteps + trapezoid.decelSteps > steps) {
+		trapezoid.accelSteps = steps / 2;
+		trapezoid.decelSteps = steps - trapezoid.accelSteps;
+	}
+	trapezoid.fullInterval = F_CPU / vMax;
+	
+	return trapezoid;
+}
+
+static bool check(const SteppersTrapezoid& trapezoid, StepKernel kernel, RampCache* rampCache = NULL) {
+	SteppersCommand* expected = new SteppersCommand[trapezoid.steps];
+	uint8_t steps[STEP_GENERATOR_BLOCK_SIZE];
+	uint32_t delays[STEP_GENERATOR_BLOCK_SIZE];
+	unsigned int count, stepNumber = 0;
+	bool ok = true;
+	
+	expandSteppersTrapezoid(trapezoid, expected);
+	
+	StepGenerator generator(trapezoid, kernel, rampCache);
+	while((count = generator.generate(steps, delays, STEP_GENERATOR_BLOCK_SIZE))) {
+		for(unsigned int i=0; i<count; i++, stepNumber++) {
+			if(expected[stepNumber].step != steps[i] || expected[stepNumber].delay != delays[i])
+				ok = false;
+		}
+	}
+	
+	delete[] expected;
+	
+	return ok && stepNumber == trapezoid.steps;
+}
+
+/* Steps/s of the kernel, checksum receives a hash of all the generated steps and delays */
+static double benchmark(const SteppersTrapezoid* trapezoids, unsigned int nbTrapezoids, unsigned int repeat, StepKernel kernel, uint32_t& checksum, RampCache* rampCache = NULL) {
+	uint8_t steps[STEP_GENERATOR_BLOCK_SIZE];
+	uint32_t delays[STEP_GENERATOR_BLOCK_SIZE];
+	uint64_t totalSteps = 0;
+	unsigned int count;
+	
+	checksum = 0;
+	
+	auto start = std::chrono::steady_clock::now();
+	
+	for(unsigned int r=0; r<repeat; r++) {
+		for(unsigned int t=0; t<nbTrapezoids; t++) {
+			StepGenerator generator(trapezoids[t], kernel, rampCache);
+			while((count = generator.generate(steps, delays, STEP_GENERATOR_BLOCK_SIZE))) {
+				for(unsigned int i=0; i<count; i++) {
+					checksum = checksum * 31 + steps[i];
+					checksum = checksum * 31 + delays[i];
+				}
+				totalSteps += count;
+			}
+		}
+	}
+	
+	auto end = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration_cast<std::chrono::duration<double> >(end - start).count();
+	
+	return totalSteps / seconds;
+}
+
+int main(int argc, const char * argv[])
+{
+	unsigned int repeat = argc > 1 ? atoi(argv[1]) : 20;
+	
+	const SteppersTrapezoid trapezoids[] = {
+		makeTrapezoid(200, 150, 0, 37, 40000),          //Short moves, ramp only
+		makeTrapezoid(5000, 3500, 0, 120, 80000),
+		makeTrapezoid(40000, 12345, 0, 999, 100000),    //Long moves, mostly cruise
+		makeTrapezoid(150000, 149999, 0, 0, 160000),
+	};
+	const unsigned int nbTrapezoids = sizeof(trapezoids) / sizeof(trapezoids[0]);
+	
+	//The usual shapes of moves, each one runs a different instantiation of the specialized kernel
+	const char* shapeNames[] = {"XY+E print", "XY travel", "E retract", "Z only", "XYZ+E"};
+	const SteppersTrapezoid shapes[] = {
+		makeTrapezoid(8000, 5000, 0, 300, 80000),
+		makeTrapezoid(8000, 5000, 0, 0, 160000),
+		makeTrapezoid(0, 0, 0, 1500, 40000),
+		makeTrapezoid(0, 0, 4000, 0, 20000),
+		makeTrapezoid(8000, 5000, 400, 300, 80000),
+	};
+	const unsigned int nbShapes = sizeof(shapes) / sizeof(shapes[0]);
+	
+	RampCache rampCache;
+	
+	for(unsigned int t=0; t<nbTrapezoids + nbShapes; t++) {
+		const SteppersTrapezoid& trapezoid = t < nbTrapezoids ? trapezoids[t] : shapes[t - nbTrapezoids];
+		
+		//The second cached check uses the ramp computed by the first one
+		if(!check(trapezoid, STEP_KERNEL_SCALAR) || !check(trapezoid, STEP_KERNEL_VECTORIZED) || !check(trapezoid, STEP_KERNEL_SPECIALIZED) 
+		   || !check(trapezoid, STEP_KERNEL_SPECIALIZED, &rampCache) || !check(trapezoid, STEP_KERNEL_SPECIALIZED, &rampCache)) {
+			std::cout << "Step generator mismatch on move " << t << std::endl;
+			return 1;
+		}
+	}
+	
+	uint32_t scalarChecksum, vectorizedChecksum, specializedChecksum, cachedChecksum;
+	double scalar = benchmark(trapezoids, nbTrapezoids, repeat, STEP_KERNEL_SCALAR, scalarChecksum);
+	double vectorized = benchmark(trapezoids, nbTrapezoids, repeat, STEP_KERNEL_VECTORIZED, vectorizedChecksum);
+	double specialized = benchmark(trapezoids, nbTrapezoids, repeat, STEP_KERNEL_SPECIALIZED, specializedChecksum);
+	rampCache.clear();
+	double cached = benchmark(trapezoids, nbTrapezoids, repeat, STEP_KERNEL_SPECIALIZED, cachedChecksum, &rampCache);
+	
+	if(vectorizedChecksum != scalarChecksum || specializedChecksum != scalarChecksum || cachedChecksum != scalarChecksum) {
+		std::cout << "Step generator output differs from the scalar kernel" << std::endl;
+		return 1;
+	}
+	
+	std::cout << "Scalar:      " << (uint64_t)scalar << " steps/s" << std::endl;
+	std::cout << "Vectorized:  " << (uint64_t)vectorized << " steps/s (" << StepGenerator::vectorInstructionSet() << ")" << std::endl;
+	std::cout << "Specialized: " << (uint64_t)specialized << " steps/s" << std::endl;
+	std::cout << "Ramp cache:  " << (uint64_t)cached << " steps/s (" << rampCache.getHits() << " hits, " << rampCache.getMisses() << " misses)" << std::endl;
+	
+	//Kernels compared move shape by move shape, delays included, each one must give the output of the scalar kernel
+	std::cout << std::endl << "Steps/s by move shape   scalar / vectorized / specialized" << std::endl;
+	for(unsigned int t=0; t<nbShapes; t++) {
+		double shapeScalar = benchmark(&shapes[t], 1, repeat * 20, STEP_KERNEL_SCALAR, scalarChecksum);
+		double shapeVectorized = benchmark(&shapes[t], 1, repeat * 20, STEP_KERNEL_VECTORIZED, vectorizedChecksum);
+		double shapeSpecialized = benchmark(&shapes[t], 1, repeat * 20, STEP_KERNEL_SPECIALIZED, specializedChecksum);
+		
+		if(vectorizedChecksum != scalarChecksum || specializedChecksum != scalarChecksum) {
+			std::cout << shapeNames[t] << ": output differs from the scalar kernel" << std::endl;
+			return 1;
+		}
+		
+		std::cout << shapeNames[t] << ":\t" << (uint64_t)shapeScalar << " / " << (uint64_t)shapeVectorized << " / " << (uint64_t)shapeSpecialized << std::endl;
+	}
+	
+	return 0;
+}
@@ -0,0 +1,451 @@
+/*
+ This file is part of Redeem - 3D Printer control software
+ 
+ Author: Mathieu Monney
+ Website: http://www.xwaves.net
+ License: GNU GPLv3 http://www.gnu.org/copyleft/gpl.html
+ 
+ Redeem is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Redeem is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Redeem.  If not, see <http://www.gnu.org/licenses/>.
+ 
+ */
+
+/* Run the whole path planner on the virtual PRU: check the final stepper positions, also when switching to the 
+ * trapezoids while printing, the arena use of a full queue of long lines, the cancellation of the moves by the end stop masks, the time accounted for the DDR blocks, the starvation count and the timing of the real time mode, with and 
+ * without the adaptive buffering. Build from the path_planner directory with:
+ * gcc -c prussdrv.c && g++ -std=c++0x -O2 -I. -D_GLIBCXX_USE_NANOSLEEP tests/VirtualPruTest.cpp PathPlanner.cpp PruTimer.cpp PruBackend.cpp VirtualPru.cpp Logger.cpp StepperTrapezoid.cpp StepGenerator.cpp RampCache.cpp IncrementalRamp.cpp CommandArena.cpp CommandStream.cpp GcodeParser.cpp Kinematics.cpp MoveSegmenter.cpp Metrics.cpp Trace.cpp BufferController.cpp prussdrv.o -lpthread -o VirtualPruTest
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <math.h>
+#include "PathPlanner.h"
+#include "StepperTrapezoid.h"
+#include "VirtualPru.h"
+#include "config.h"
+
+#define STEPS_PER_METER 50000
+
+/* Maximum difference between the real and the simulated time of the moves in real time mode, in ms */
+#define MAX_REAL_TIME_ERROR 50
+
+/* Maximum difference between the real and the simulated time of the steps in real time mode, in percent */
+#define MAX_REAL_TIME_STEPS_ERROR 3
+
+/* Instructions of firmware_runtime.p, counted in its pasm listing: a plain step until the delay and its minimum delay, 
+ * the steps of a trapezoid on top of the 7 of a plain step from the end of the previous delay (TRAPEZOID_NEXT_STEP, 
+ * the Bresenham, the phase, the ramp and TRAPEZOID_STEP_READY), the first step which goes through COMMAND_DONE, 
+ * NEXT_COMMAND and TRAPEZOID_START instead of TRAPEZOID_NEXT_STEP, and the command after the last step */
+#define FIRMWARE_STEP_INSTRUCTIONS 559
+#define FIRMWARE_MIN_DELAY 380
+#define FIRMWARE_RAMP_INSTRUCTIONS (5+56+730+5-7)
+#define FIRMWARE_CRUISE_INSTRUCTIONS (5+56+5+5-7)
+#define FIRMWARE_TRAPEZOID_START_INSTRUCTIONS (5+2+19-5)
+#define FIRMWARE_TRAPEZOID_END_INSTRUCTIONS (7+2+2-7)
+
+static void configure(PathPlanner& planner) {
+	float maxFeedrate[NUM_AXIS] = {0.2, 0.2, 0.2, 0.2};
+	unsigned long steps[NUM_AXIS] = {STEPS_PER_METER, STEPS_PER_METER, STEPS_PER_METER, STEPS_PER_METER};
+	float acceleration[NUM_AXIS] = {1, 1, 1, 1};
+	
+	planner.setMaxFeedrates(maxFeedrate);
+	planner.setAxisStepsPerMeter(steps);
+	planner.setPrintAcceleration(acceleration);
+	planner.setTravelAcceleration(acceleration);
+	
+	Extruder& extruder = planner.getExtruder(0);
+	extruder.setAxisStepsPerMeter(STEPS_PER_METER);
+	extruder.setPrintAcceleration(1);
+	extruder.setTravelAcceleration(1);
+	extruder.setMaxFeedrate(0.2);
+	extruder.setMaxStartFeedrate(0.02);
+	planner.setExtruder(0);
+}
+
+/* Queue a square followed by a move to the given position, the steppers must reach the position of the planner */
+static bool testPositions(bool trapezoids) {
+	PathPlanner planner;
+	
+	planner.initVirtualPRU(false);
+	configure(planner);
+	planner.setTrapezoidCommands(trapezoids);
+	planner.runThread();
+	
+	float corners[5][NUM_AXIS] = {{0.03, 0, 0, 0}, {0.03, 0.03, 0, 0}, {0, 0.03, 0, 0}, {0, 0, 0, 0}, {0.0123, -0.0171, 0, 0}};
+	
+	for(int i=0; i<5; i++) {
+		planner.queueMoveTo(corners[i], 0.1, false, true);
+	}
+	
+	planner.waitUntilFinished();
+	
+	VirtualPru* pru = planner.getVirtualPRU();
+	bool ok = true;
+	
+	for(int axis=0; axis<2; axis++) {
+		int64_t expected = lround(planner.getPosition(axis)*STEPS_PER_METER);
+		
+		if(pru->getPosition(axis) != expected) {
+			std::cout << "Stepper " << axis << " at " << pru->getPosition(axis) << " instead of " << expected << std::endl;
+			ok = false;
+		}
+	}
+	
+	std::cout << (trapezoids ? "Trapezoids: " : "Steps: ") << pru->getStepsDone() << " steps in " << pru->getBlocksDone() << " blocks, " << pru->getCycles()/(F_CPU/1000) << " ms simulated" << std::endl;
+	
+	planner.stopThread(true);
+	
+	return ok;
+}
+
+/* Switching between the per step commands and the trapezoids while printing must not lose any move */
+static bool testModeSwitch() {
+	PathPlanner planner;
+	
+	planner.initVirtualPRU(false);
+	configure(planner);
+	planner.runThread();
+	
+	for(int i=0; i<200; i++) {
+		float target[NUM_AXIS] = {0.001f*(i%7), 0.0013f*(i%5), 0, 0};
+		planner.queueMoveTo(target, 0.1, false, true);
+		planner.setTrapezoidCommands(i%3 == 0);
+	}
+	
+	planner.waitUntilFinished();
+	
+	VirtualPru* pru = planner.getVirtualPRU();
+	bool ok = true;
+	
+	for(int axis=0; axis<2; axis++) {
+		int64_t expected = lround(planner.getPosition(axis)*STEPS_PER_METER);
+		
+		if(pru->getPosition(axis) != expected) {
+			std::cout << "Mode switch: stepper " << axis << " at " << pru->getPosition(axis) << " instead of " << expected << std::endl;
+			ok = false;
+		}
+	}
+	
+	planner.stopThread(true);
+	
+	return ok;
+}
+
+/* Lines accelerating over all their steps need a command per step, more chunks than the arena has for the whole queue: 
+ * the generation workers must wait for free chunks instead of going to the heap */
+static bool testArenaFull() {
+	PathPlanner planner;
+	float acceleration[NUM_AXIS] = {0.1, 0.1, 0.1, 0.1};
+	
+	planner.initVirtualPRU(false);
+	configure(planner);
+	planner.setPrintAcceleration(acceleration);
+	planner.setTravelAcceleration(acceleration);
+	planner.setStepGenerationWorkers(2);
+	planner.runThread();
+	
+	for(int i=0; i<MOVE_CACHE_SIZE+32; i++) {
+		float target[NUM_AXIS] = {(i%2) ? 0.0f : 0.3f, (i%2) ? 0.0f : 0.1854f, 0, 0};
+		planner.queueMoveTo(target, 0.2, false, true);
+	}
+	
+	planner.waitUntilFinished();
+	
+	bool ok = planner.getCommandArenaHeapAllocations() == 0 && planner.getCommandArenaHighWater() <= COMMAND_ARENA_CHUNKS*sizeof(CommandChunk);
+	
+	std::cout << "Arena: " << planner.getCommandArenaHighWater()/sizeof(CommandChunk) << " chunks used at most, " << planner.getCommandArenaHeapAllocations() << " on the heap" << std::endl;
+	
+	planner.stopThread(true);
+	
+	return ok;
+}
+
+/* A cancellable move towards a triggered end stop must be cancelled, the other moves executed */
+static bool testCancel() {
+	PathPlanner planner;
+	
+	planner.initVirtualPRU(false);
+	configure(planner);
+	planner.runThread();
+	
+	VirtualPru* pru = planner.getVirtualPRU();
+	
+	//X cannot move in the positive direction anymore
+	pru->setEndstopMasks(0xFF & ~(1 << X_AXIS), 0xFF);
+	
+	float cancelled[NUM_AXIS] = {0.02, 0, 0, 0};
+	planner.queueMoveTo(cancelled, 0.1, true, false);
+	planner.waitUntilFinished();
+	
+	float executed[NUM_AXIS] = {0.02, 0.01, 0, 0};
+	planner.queueMoveTo(executed, 0.1, true, false);
+	planner.waitUntilFinished();
+	
+	bool ok = pru->getBlocksCancelled() == 1 && pru->getPosition(X_AXIS) == 0 && pru->getPosition(Y_AXIS) == lround(0.01*STEPS_PER_METER);
+	
+	if(!ok) {
+		std::cout << "Cancel: " << pru->getBlocksCancelled() << " blocks cancelled, steppers at " << pru->getPosition(X_AXIS) << " " << pru->getPosition(Y_AXIS) << std::endl;
+	}
+	
+	planner.stopThread(true);
+	
+	return ok;
+}
+
+/* Cycles of a trapezoid, following firmware_runtime.p: TRAPEZOID_STEP_READY removes the time spent computing the step 
+ * from its interval, then the step waits like a plain command */
+static uint64_t firmwareTrapezoidCycles(const SteppersTrapezoid& trapezoid) {
+	std::vector<SteppersCommand> commands(trapezoid.steps);
+	expandSteppersTrapezoid(trapezoid, commands.data());
+	
+	uint64_t cycles = FIRMWARE_TRAPEZOID_START_INSTRUCTIONS + FIRMWARE_TRAPEZOID_END_INSTRUCTIONS;
+	
+	for(uint32_t i=0; i<trapezoid.steps; i++) {
+		bool accelerating = i <= trapezoid.accelSteps;
+		bool decelerating = !accelerating && trapezoid.steps - i <= trapezoid.decelSteps;
+		uint32_t overhead = accelerating || decelerating ? FIRMWARE_RAMP_INSTRUCTIONS : FIRMWARE_CRUISE_INSTRUCTIONS;
+		
+		uint32_t delay = std::max(commands[i].delay, overhead) - overhead;
+		uint32_t wait = std::max(delay, (uint32_t)FIRMWARE_STEP_INSTRUCTIONS) - FIRMWARE_STEP_INSTRUCTIONS;
+		
+		cycles += overhead + FIRMWARE_STEP_INSTRUCTIONS + std::max(wait, (uint32_t)FIRMWARE_MIN_DELAY);
+	}
+	
+	return cycles;
+}
+
+/* The time queued for the blocks must be the one the PRU takes to execute them, also for the blocks split at the end of
+ * the DDR, and the time of the trapezoids must match the one of the firmware */
+static bool testBlockTimes() {
+	PruTimer pru;
+	SteppersCommand block[50];
+	
+	for(int i=0; i<50; i++) {
+		block[i].step = 1 << X_AXIS;
+		block[i].direction = 0;
+		block[i].cancellableMask = 0;
+		block[i].options = i%4;
+		block[i].delay = 200*i;
+	}
+	
+	pru.initVirtualPRU(false);
+	pru.runThread();
+	
+	VirtualPru* virtualPru = (VirtualPru*)pru.getBackend();
+	size_t blockSize = sizeof(block);
+	unsigned int blocksPerRound = pru.getFreeMemory()*3/4/(blockSize+8);
+	uint64_t expected = 0;
+	bool ok = true;
+	
+	//Enough rounds to go through the end of the DDR
+	for(unsigned int r=0; r<4; r++) {
+		uint64_t queued = 0;
+		
+		pru.suspend();
+		
+		for(unsigned int b=0; b<blocksPerRound; b++) {
+			pru.push_block((uint8_t*)block, blockSize, sizeof(SteppersCommand), 0);
+			queued += steppersCommandsCycles(block, 50);
+		}
+		
+		if(pru.getTotalQueuedMovesTime() != queued) {
+			std::cout << "Block times: " << pru.getTotalQueuedMovesTime() << " cycles queued instead of " << queued << std::endl;
+			ok = false;
+		}
+		
+		expected += queued;
+		
+		pru.resume();
+		pru.waitUntilFinished();
+	}
+	
+	if(virtualPru->getCycles() != expected || pru.getTotalQueuedMovesTime() != 0) {
+		std::cout << "Block times: " << virtualPru->getCycles() << " cycles executed instead of " << expected << std::endl;
+		ok = false;
+	}
+	
+	uint32_t steps[3] = {1000, 37, 4000};
+	SteppersTrapezoid trapezoids[3];
+	uint64_t firmwareCycles = 0;
+	
+	for(int i=0; i<3; i++) {
+		SteppersTrapezoid& trapezoid = trapezoids[i];
+		trapezoid = SteppersTrapezoid();
+		trapezoid.step = 1 << X_AXIS;
+		trapezoid.options = STEPPER_COMMAND_OPTION_TRAPEZOID;
+		trapezoid.steps = steps[i];
+		trapezoid.delta[X_AXIS] = steps[i];
+		trapezoid.accelSteps = steps[i]/3;
+		trapezoid.decelSteps = steps[i]/4;
+		trapezoid.vStart = 500;
+		trapezoid.vMax = 10000;
+		trapezoid.vEnd = 1000;
+		trapezoid.fAcceleration = (uint32_t)(20000.0*262144/F_CPU);
+		trapezoid.fullInterval = F_CPU/trapezoid.vMax;
+		
+		uint64_t firmware = firmwareTrapezoidCycles(trapezoid);
+		firmwareCycles += firmware;
+		
+		if(steppersTrapezoidCycles(trapezoid) != firmware) {
+			std::cout << "Trapezoid of " << steps[i] << " steps: " << steppersTrapezoidCycles(trapezoid) << " cycles instead of " << firmware << std::endl;
+			ok = false;
+		}
+	}
+	
+	//The virtual PRU must take the same time
+	pru.push_block((uint8_t*)trapezoids, sizeof(trapezoids), sizeof(SteppersTrapezoid), 0);
+	pru.waitUntilFinished();
+	
+	if(virtualPru->getCycles() - expected != firmwareCycles) {
+		std::cout << "Trapezoids: " << virtualPru->getCycles() - expected << " cycles executed instead of " << firmwareCycles << std::endl;
+		ok = false;
+	}
+	
+	pru.stopThread(true);
+	
+	return ok;
+}
+
+/* A PRU running out of moves while more are pending counts one starvation, however long it then stays idle */
+static bool testStarvations() {
+	PruTimer pru;
+	SteppersCommand block[10];
+	
+	for(int i=0; i<10; i++) {
+		block[i].step = 1 << X_AXIS;
+		block[i].direction = 0;
+		block[i].cancellableMask = 0;
+		block[i].options = 0;
+		block[i].delay = 1000;
+	}
+	
+	pru.initVirtualPRU(false);
+	pru.runThread();
+	
+	//The planner stalls with moves pending: the PRU thread wakes up every second meanwhile
+	pru.setMovesPending(true);
+	pru.push_block((uint8_t*)block, sizeof(block), sizeof(SteppersCommand), 0);
+	pru.waitUntilFinished();
+	std::this_thread::sleep_for(std::chrono::milliseconds(2500));
+	
+	uint64_t stalled = pru.getStarvations();
+	
+	pru.push_block((uint8_t*)block, sizeof(block), sizeof(SteppersCommand), 0);
+	pru.waitUntilFinished();
+	std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+	
+	uint64_t again = pru.getStarvations();
+	
+	pru.stopThread(true);
+	
+	if(stalled != 1 || again != 2) {
+		std::cout << "Starvations: " << stalled << " after the first stall, " << again << " after the second" << std::endl;
+		return false;
+	}
+	
+	return true;
+}
+
+/* Records the real time of the first step */
+class FirstStepTime : public VirtualPruObserver {
+public:
+	std::atomic<bool> stepped;
+	std::chrono::steady_clock::time_point time;
+	
+	FirstStepTime() : stepped(false) {}
+	
+	void step(const SteppersCommand& command, uint8_t stepped, uint64_t cycle) {
+		if(!this->stepped) {
+			time = std::chrono::steady_clock::now();
+			this->stepped = true;
+		}
+	}
+	
+	void blockDone(bool cancelled) {}
+};
+
+/* In real time mode the steps must take their simulated time, from the first step to the end of the moves */
+static bool testRealTime(bool trapezoids) {
+	PathPlanner planner;
+	FirstStepTime firstStep;
+	
+	planner.initVirtualPRU(true);
+	configure(planner);
+	planner.setTrapezoidCommands(trapezoids);
+	planner.getVirtualPRU()->setObserver(&firstStep);
+	planner.runThread();
+	
+	for(int i=1; i<=4; i++) {
+		float target[NUM_AXIS] = {0.01f*(i%2), 0.005f*i, 0, 0};
+		planner.queueMoveTo(target, 0.05, false, true);
+	}
+	
+	planner.waitUntilFinished();
+	
+	double real = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-firstStep.time).count()/1000.0;
+	double simulated = planner.getVirtualPRU()->getCycles()/(F_CPU/1000.0);
+	
+	std::cout << (trapezoids ? "Real time with trapezoids: " : "Real time: ") << real << " ms for " << simulated << " ms of moves" << std::endl;
+	
+	planner.stopThread(true);
+	
+	return fabs(real-simulated) <= simulated*MAX_REAL_TIME_STEPS_ERROR/100;
+}
+
+/* With the adaptive buffering, a single move starts after a short wait for other lines instead of PRINT_MOVE_BUFFER_WAIT */
+static bool testAdaptiveBuffering() {
+	PathPlanner planner;
+	
+	planner.initVirtualPRU(true);
+	configure(planner);
+	planner.setAdaptiveBuffering(true);
+	planner.runThread();
+	
+	auto start = std::chrono::steady_clock::now();
+	
+	float target[NUM_AXIS] = {0.005, 0, 0, 0};
+	planner.queueMoveTo(target, 0.05, false, true);
+	planner.waitUntilFinished();
+	
+	long long real = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()-start).count();
+	long long simulated = planner.getVirtualPRU()->getCycles()/(F_CPU/1000);
+	PlannerMetrics metrics = planner.getMetrics();
+	
+	std::cout << "Adaptive buffering: " << real << " ms for " << simulated << " ms of moves, " << metrics.bufferTarget*1000 << " ms buffered" << std::endl;
+	
+	planner.stopThread(true);
+	
+	return real >= simulated-MAX_REAL_TIME_ERROR && real <= simulated+ADAPTIVE_BUFFER_WAIT_MIN+MAX_REAL_TIME_ERROR 
+		&& metrics.bufferTarget*1000 >= ADAPTIVE_BUFFERED_MOVE_TIME_MIN && metrics.bufferTarget*1000 <= ADAPTIVE_BUFFERED_MOVE_TIME_MAX;
+}
+
+int main(int argc, const char * argv[]) {
+	bool ok = testPositions(false);
+	ok = testPositions(true) && ok;
+	ok = testModeSwitch() && ok;
+	ok = testArenaFull() && ok;
+	ok = testCancel() && ok;
+	ok = testBlockTimes() && ok;
+	ok = testStarvations() && ok;
+	ok = testRealTime(false) && ok;
+	ok = testRealTime(true) && ok;
+	ok = testAdaptiveBuffering() && ok;
+	
+	std::cout << (ok ? "OK" : "FAILED") << std::endl;
+	
+	return ok ? 0 : 1;
+}
@@ -25,7 +25,7 @@
 
 int main(int argc, const char * argv[])
 {
-	LOG( "Start test program" << std::endl);
+	LOG_INFO(LOG_PLANNER, "Start test program" << std::endl);
 	
 
 	PathPlanner planner;